@@ -6,6 +6,10 @@ if uname | grep -q 'Darwin' ; then
     exit 0
 fi
 
+if ! make check ; then
+    exit 1
+fi
+
 sudo cp .travis/test.gophermap /var/gopher/gophermap
 sudo chmod 644 /var/gopher/gophermap
 
@@ -0,0 +1,182 @@
+/*
+ * Gophernicus
+ *
+ * Copyright (c) 2009-2018 Kim Holviala <kimholviala@fastmail.com>
+ * Copyright (c) 2019 Gophernicus Developers <gophernicus@gophernicus.org>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "gophernicus.h"
+
+
+
+/*
+ * Allocations are rounded up to this to keep everything aligned
+ */
+#define ARENA_ALIGN    16
+
+/* Header for allocations that didn't fit the arena block */
+typedef struct overflow {
+	struct overflow *next;
+	char pad[ARENA_ALIGN - sizeof(struct overflow *)];
+} overflow;
+
+/* Header for blocks kept around for reuse by the next connection */
+typedef struct spare {
+	struct spare *next;
+	size_t size;
+} spare;
+
+
+/*
+ * Initialize a request arena - a failed malloc() just means that
+ * everything is allocated from the heap
+ */
+void arena_init(arena *a, size_t size)
+{
+	if ((a->base = malloc(size)) == NULL) size = 0;
+
+	a->size = size;
+	a->used = 0;
+	a->peak = 0;
+	a->extra = NULL;
+	a->spare = NULL;
+	a->spare_size = 0;
+}
+
+
+/*
+ * Allocate memory that lives until the next arena_reset()
+ */
+void *arena_alloc(arena *a, size_t size)
+{
+	overflow *o;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+	a->peak += size;
+
+	/* Fits in the block */
+	if (a->size - a->used >= size) {
+		p = a->base + a->used;
+		a->used += size;
+		return p;
+	}
+
+	/* Doesn't fit - get it from the heap until the next reset */
+	if ((o = malloc(sizeof(overflow) + size)) == NULL) return NULL;
+
+	o->next = a->extra;
+	a->extra = o;
+	return o + 1;
+}
+
+
+/*
+ * Release everything allocated since the last reset
+ */
+void arena_reset(arena *a)
+{
+	overflow *o;
+	char *base;
+
+	while ((o = a->extra)) {
+		a->extra = o->next;
+		free(o);
+	}
+
+	/* Grow the block so the next request fits in it - within reason */
+	if (a->peak > ARENA_MAX) a->peak = ARENA_MAX;
+	if (a->peak > a->size && (base = realloc(a->base, a->peak))) {
+		a->base = base;
+		a->size = a->peak;
+	}
+
+	a->used = 0;
+	a->peak = 0;
+}
+
+
+/*
+ * Get a block that outlives arena_reset() - connection buffers come from
+ * here so a worker reuses the same few instead of going to malloc() for
+ * every connection
+ */
+void *arena_get(arena *a, size_t size)
+{
+	spare **link;
+	spare *s;
+
+	for (link = (spare **) &a->spare; (s = *link); link = &s->next) {
+		if (s->size != size) continue;
+
+		*link = s->next;
+		a->spare_size -= size;
+		return s + 1;
+	}
+
+	if ((s = malloc(sizeof(spare) + size)) == NULL) return NULL;
+
+	s->size = size;
+	return s + 1;
+}
+
+
+/*
+ * Give a block from arena_get() back for reuse
+ */
+void arena_put(arena *a, void *p)
+{
+	spare *s = (spare *) p - 1;
+
+	if (a->spare_size + s->size > ARENA_SPARES || s->size > FILEBUFSIZE) {
+		free(s);
+		return;
+	}
+
+	s->next = a->spare;
+	a->spare = s;
+	a->spare_size += s->size;
+}
+
+
+/*
+ * Free a request arena
+ */
+void arena_free(arena *a)
+{
+	spare *s;
+
+	while ((s = a->spare)) {
+		a->spare = s->next;
+		free(s);
+	}
+	a->spare_size = 0;
+
+	arena_reset(a);
+	if (a->base) free(a->base);
+
+	a->base = NULL;
+	a->size = 0;
+}
@@ -0,0 +1,1690 @@
+/*
+ * Gophernicus
+ *
+ * Copyright (c) 2009-2018 Kim Holviala <kimholviala@fastmail.com>
+ * Copyright (c) 2019 Gophernicus Developers <gophernicus@gophernicus.org>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include "gophernicus.h"
+
+
+/*
+ * Can something last changed at this time be cached as of now? A file
+ * or directory changed during the last second may change again without
+ * getting a new mtime (or ctime), so it can't be trusted until later.
+ */
+static int settled(time_t changed, time_t now)
+{
+	return (changed < now - 1);
+}
+
+
+/*
+ * Pre-rendered menu
+ */
+typedef struct {
+	unsigned long hash;
+	char *key;
+	char *data;
+	size_t len;
+	menu_stamp stamp;
+	time_t created;
+	time_t used;
+} menu_entry;
+
+static menu_entry menus[MENU_CACHE_SIZE];
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t menu_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/*
+ * Build the lookup key of the current menu request
+ */
+static unsigned long menu_key(state *st, char *key, size_t keysize)
+{
+	int flags;
+
+	flags = st->cfg->opt_parent | st->cfg->opt_header << 1 | st->cfg->opt_footer << 2 |
+		st->cfg->opt_date << 3 | st->cfg->opt_magic << 4 | st->cfg->opt_iconv << 5 |
+		st->cfg->opt_vhost << 6 | st->cfg->opt_exec << 7 | st->cfg->opt_personal_spaces << 8;
+
+	snprintf(key, keysize, "%s\t%i\t%s\t%s\t%i\t%i\t%x",
+		st->server_host,
+		st->server_port,
+		st->req_selector,
+		st->req_query_string,
+		st->cfg->out_charset,
+		st->cfg->out_width,
+		flags);
+
+	return strhash(key);
+}
+
+
+/*
+ * Get the mtimes a rendered menu depends on
+ */
+static void menu_stamp_get(state *st, menu_stamp *stamp)
+{
+	struct stat file;
+
+	stamp->dir = stamp->map = stamp->tag = 0;
+
+	if (fstat(st->req_dirfd, &file) == OK) stamp->dir = file.st_mtime;
+	if (fstatat(st->req_dirfd, st->cfg->map_file, &file, 0) == OK) stamp->map = file.st_mtime;
+	if (fstatat(st->req_dirfd, st->cfg->tag_file, &file, 0) == OK) stamp->tag = file.st_mtime;
+}
+
+
+/*
+ * Send a cached menu - returns OK if there was a valid one.
+ * Fills in the current stamp for menu_cache_store() either way.
+ */
+int menu_cache_send(state *st, menu_stamp *stamp)
+{
+	menu_entry *m;
+	char key[BUFSIZE * 3];
+	unsigned long hash;
+	time_t now;
+	char *data = NULL;
+	size_t len = 0;
+	int i;
+
+	menu_stamp_get(st, stamp);
+	hash = menu_key(st, key, sizeof(key));
+	now = time(NULL);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&menu_lock);
+#endif
+	for (i = 0; i < MENU_CACHE_SIZE; i++) {
+		m = &menus[i];
+		if (!m->key || m->hash != hash || strcmp(m->key, key) != MATCH) continue;
+
+		/* Directory changed or entries may have been edited in place? */
+		if (memcmp(&m->stamp, stamp, sizeof(menu_stamp)) != MATCH ||
+		    (now - m->created) > MENU_CACHE_TTL) break;
+
+		/* Copy it so a slow client doesn't hold the cache locked */
+		if ((data = malloc(m->len)) == NULL) break;
+		memcpy(data, m->data, m->len);
+		len = m->len;
+		m->used = now;
+		break;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&menu_lock);
+#endif
+
+	if (!data) return ERROR;
+
+	conn_write(st->conn, data, len);
+	free(data);
+
+	log_debug("served menu \"%s\" from cache", st->req_selector);
+	return OK;
+}
+
+
+/*
+ * Save a freshly rendered menu
+ */
+void menu_cache_store(state *st, menu_stamp *stamp, const char *data, size_t len)
+{
+	menu_entry *m;
+	menu_entry *old;
+	char key[BUFSIZE * 3];
+	unsigned long hash;
+	time_t now;
+	char *copy;
+	int i;
+
+	if (len > MENU_CACHE_MAX) return;
+
+	now = time(NULL);
+	if (!settled(stamp->dir, now) || !settled(stamp->map, now) || !settled(stamp->tag, now)) return;
+
+	hash = menu_key(st, key, sizeof(key));
+	if ((copy = malloc(len)) == NULL) return;
+	memcpy(copy, data, len);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&menu_lock);
+#endif
+	/* Replace the old version, an empty slot or the least recently used */
+	old = &menus[0];
+	for (i = 0; i < MENU_CACHE_SIZE; i++) {
+		m = &menus[i];
+		if (m->key && m->hash == hash && strcmp(m->key, key) == MATCH) {
+			old = m;
+			break;
+		}
+		if (!m->key) old = m;
+		else if (old->key && m->used < old->used) old = m;
+	}
+
+	if (old->key && strcmp(old->key, key) == MATCH) free(old->data);
+	else {
+		if (old->key) {
+			free(old->key);
+			free(old->data);
+		}
+
+		if ((old->key = strdup(key)) == NULL) {
+			old->data = NULL;
+			free(copy);
+			goto unlock;
+		}
+	}
+
+	old->hash = hash;
+	old->data = copy;
+	old->len = len;
+	old->stamp = *stamp;
+	old->created = old->used = now;
+
+unlock:
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&menu_lock);
+#endif
+	return;
+}
+
+
+/*
+ * Cached stat() result and descriptor of a path
+ */
+typedef struct {
+	unsigned long hash;
+	char *path;
+	struct stat s;
+	int error;	/* errno of a failed stat(), 0 if the path exists */
+	int fd;
+	time_t checked;
+	time_t used;
+} file_entry;
+
+static file_entry files[FILE_CACHE_SIZE];
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/*
+ * One-shot inetd processes would only fill the cache
+ */
+static int file_cached(state *st)
+{
+	return st->cfg->opt_cache && st->cfg->opt_daemon;
+}
+
+
+/*
+ * Find a path in the file cache - stat()s it again if the entry is
+ * too old, adds it if it's not there. Call with file_lock held.
+ */
+static file_entry *file_lookup(const char *path, time_t now)
+{
+	file_entry *f;
+	file_entry *old;
+	struct stat s;
+	unsigned long hash = strhash(path);
+	int i;
+
+
+	old = &files[0];
+	for (i = 0; i < FILE_CACHE_SIZE; i++) {
+		f = &files[i];
+		if (f->path && f->hash == hash && strcmp(f->path, path) == MATCH) break;
+
+		if (!f->path) old = f;
+		else if (old->path && f->used < old->used) old = f;
+	}
+
+	/* New path - take over the least recently used slot */
+	if (i == FILE_CACHE_SIZE) {
+		f = old;
+		if (f->path) {
+			free(f->path);
+			if (f->fd != ERROR) close(f->fd);
+		}
+
+		f->fd = ERROR;
+		f->checked = 0;
+		if ((f->path = strdup(path)) == NULL) return NULL;
+		f->hash = hash;
+	}
+	f->used = now;
+
+	/* An open file can be checked without a path lookup */
+	if (f->fd != ERROR && (now - f->checked) <= FILE_CACHE_TTL) {
+		if (fstat(f->fd, &f->s) == OK) return f;
+		f->checked = 0;
+	}
+
+	/* Missing files and dirs are trusted until they expire */
+	if ((now - f->checked) <= FILE_CACHE_TTL) return f;
+
+	if (stat(path, &s) == ERROR) {
+		f->error = errno;
+		if (f->fd != ERROR) close(f->fd);
+		f->fd = ERROR;
+	}
+	else {
+		/* Replaced by another file? */
+		if (f->fd != ERROR && (s.st_dev != f->s.st_dev || s.st_ino != f->s.st_ino)) {
+			close(f->fd);
+			f->fd = ERROR;
+		}
+		f->error = 0;
+		f->s = s;
+	}
+
+	f->checked = now;
+	return f;
+}
+
+
+/*
+ * stat() through the file cache - failures are cached too
+ */
+int file_cache_stat(state *st, const char *path, struct stat *s)
+{
+	file_entry *f;
+	int ret = OK;
+
+	if (!file_cached(st)) return stat(path, s);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&file_lock);
+#endif
+	if ((f = file_lookup(path, time(NULL))) == NULL) ret = stat(path, s);
+	else if (f->error) {
+		errno = f->error;
+		ret = ERROR;
+	}
+	else *s = f->s;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&file_lock);
+#endif
+
+	return ret;
+}
+
+
+/*
+ * Open a file for reading through the file cache - the caller gets
+ * its own descriptor and must use pread()/sendfile() with it, as the
+ * file offset is shared with the cached one
+ */
+int file_cache_open(state *st, const char *path)
+{
+	file_entry *f;
+	int fd = ERROR;
+
+	if (!file_cached(st)) return open(path, O_RDONLY | O_CLOEXEC);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&file_lock);
+#endif
+	if ((f = file_lookup(path, time(NULL))) && !f->error &&
+	    (f->s.st_mode & S_IFMT) == S_IFREG) {
+		if (f->fd == ERROR) f->fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (f->fd != ERROR) fd = fcntl(f->fd, F_DUPFD_CLOEXEC, 0);
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&file_lock);
+#endif
+
+	if (fd == ERROR) fd = open(path, O_RDONLY | O_CLOEXEC);
+	return fd;
+}
+
+
+/*
+ * Where the windows of a paged directory start - the last entry of
+ * every full window, so that deep pages don't have to step through the
+ * directory one window at a time for every request
+ */
+typedef struct {
+	unsigned long hash;
+	char *key;
+	menu_stamp stamp;
+	sdirent *cursor;	/* cursor[k - 1] ends window k */
+	int num;
+	int size;
+	time_t created;
+	time_t used;
+} page_entry;
+
+static page_entry pages[PAGE_CACHE_SIZE];
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/*
+ * Build the lookup key of a paged directory - the hides of its
+ * gophermap change what's listed
+ */
+static unsigned long page_key(state *st, int window, char *key, size_t keysize)
+{
+	size_t len;
+	int i;
+
+	snprintf(key, keysize, "%s\t%i", st->req_realpath, window);
+
+	for (i = 0; i < st->hidden_count; i++) {
+		len = strlen(key);
+		snprintf(key + len, keysize - len, "\t%s", st->hidden[i]);
+	}
+
+	return strhash(key);
+}
+
+
+/*
+ * Find the cursors of the current directory - the entry is emptied if
+ * the directory has changed. Call with page_lock held.
+ */
+static page_entry *page_lookup(state *st, int window, int create)
+{
+	page_entry *p;
+	page_entry *old;
+	menu_stamp stamp;
+	char key[BUFSIZE * 2];
+	unsigned long hash;
+	time_t now;
+	int i;
+
+	menu_stamp_get(st, &stamp);
+	hash = page_key(st, window, key, sizeof(key));
+	now = time(NULL);
+
+	old = &pages[0];
+	for (i = 0; i < PAGE_CACHE_SIZE; i++) {
+		p = &pages[i];
+		if (p->key && p->hash == hash && strcmp(p->key, key) == MATCH) break;
+
+		if (!p->key) old = p;
+		else if (old->key && p->used < old->used) old = p;
+	}
+
+	if (i == PAGE_CACHE_SIZE) {
+		if (!create) return NULL;
+
+		p = old;
+		if (p->key) free(p->key);
+		if ((p->key = strdup(key)) == NULL) return NULL;
+		p->hash = hash;
+		p->created = 0;
+	}
+
+	/* Start over if the directory changed or entries may have been edited in place */
+	if (memcmp(&p->stamp, &stamp, sizeof(menu_stamp)) != MATCH ||
+	    (now - p->created) > MENU_CACHE_TTL) {
+		for (i = 0; i < p->num; i++) free(p->cursor[i].name);
+		p->num = 0;
+		p->stamp = stamp;
+		p->created = now;
+	}
+
+	p->used = now;
+	return p;
+}
+
+
+/*
+ * Get the last entry of the furthest known window up to window max -
+ * returns the number of the window, 0 if none is known
+ */
+int page_cursor_get(state *st, int window, int max, sdirent *cursor, char *name, size_t namesize)
+{
+	page_entry *p;
+	int k = 0;
+
+	if (!file_cached(st) || !st->req_cacheable || max < 1) return 0;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&page_lock);
+#endif
+	if ((p = page_lookup(st, window, FALSE)) && p->num > 0) {
+		k = min(p->num, max);
+		*cursor = p->cursor[k - 1];
+		snprintf(name, namesize, "%s", p->cursor[k - 1].name);
+		cursor->name = name;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&page_lock);
+#endif
+	return k;
+}
+
+
+/*
+ * Remember the last entry of window k - windows are added in order
+ */
+void page_cursor_put(state *st, int window, int k, sdirent *cursor)
+{
+	page_entry *p;
+	sdirent *grown;
+	int size;
+
+	if (!file_cached(st) || !st->req_cacheable) return;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&page_lock);
+#endif
+	/* The directory must stay put for a while to be trusted */
+	if ((p = page_lookup(st, window, TRUE)) == NULL || k != p->num + 1 ||
+	    !settled(p->stamp.dir, p->used) || !settled(p->stamp.map, p->used)) goto unlock;
+
+	if (p->num == p->size) {
+		size = p->size ? p->size * 2 : 16;
+		if ((grown = realloc(p->cursor, sizeof(sdirent) * size)) == NULL) goto unlock;
+		p->cursor = grown;
+		p->size = size;
+	}
+
+	p->cursor[p->num] = *cursor;
+	if ((p->cursor[p->num].name = strdup(cursor->name))) p->num++;
+
+unlock:
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&page_lock);
+#endif
+	return;
+}
+
+
+/*
+ * Virtual host routing index - which vhosts have which top level
+ * entries, so a selector can be found without trying every vhost
+ */
+typedef struct {
+	char *name;
+	mode_t mode;
+	time_t mtime;
+} vhost_dir;
+
+typedef struct {
+	unsigned long hash;
+	char *name;	/* Top level entry, "" for the vhost root */
+	int vhost;
+} vhost_route;
+
+static struct {
+	vhost_dir *dirs;
+	int num_dirs;
+	vhost_route *routes;
+	int num_routes;
+	unsigned int mask;
+	time_t root_mtime;
+	time_t built;
+	time_t checked;
+} vhosts;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t vhost_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/*
+ * Throw away the routing index
+ */
+static void vhost_index_free(void)
+{
+	unsigned int i;
+	int n;
+
+	if (vhosts.routes) {
+		for (i = 0; i <= vhosts.mask; i++)
+			if (vhosts.routes[i].name) free(vhosts.routes[i].name);
+		free(vhosts.routes);
+	}
+
+	for (n = 0; n < vhosts.num_dirs; n++) free(vhosts.dirs[n].name);
+	if (vhosts.dirs) free(vhosts.dirs);
+
+	memset(&vhosts, 0, sizeof(vhosts));
+}
+
+
+/*
+ * Put a route in the table - same names stay in insertion order
+ * along the probe sequence
+ */
+static void vhost_index_put(unsigned long hash, char *name, int vhost)
+{
+	unsigned int i;
+
+	for (i = hash & vhosts.mask; vhosts.routes[i].name; i = (i + 1) & vhosts.mask);
+
+	vhosts.routes[i].hash = hash;
+	vhosts.routes[i].name = name;
+	vhosts.routes[i].vhost = vhost;
+	vhosts.num_routes++;
+}
+
+
+/*
+ * Keep the route table at most half full
+ */
+static int vhost_index_grow(void)
+{
+	vhost_route *old = vhosts.routes;
+	unsigned int mask = vhosts.mask;
+	unsigned int start;
+	unsigned int i;
+
+	if (old && vhosts.num_routes < (int) (mask + 1) / 2) return OK;
+
+	if ((vhosts.routes = calloc(old ? (mask + 1) * 2 : mask + 1, sizeof(vhost_route))) == NULL) {
+		vhosts.routes = old;
+		return ERROR;
+	}
+	if (old) vhosts.mask = mask * 2 + 1;
+	vhosts.num_routes = 0;
+
+	/*
+	 * Same names sit in one run of used slots in insertion order, so
+	 * rehashing run by run from an empty slot keeps their order even
+	 * when a run wraps around the end of the table
+	 */
+	if (old) {
+		for (start = 0; old[start].name; start++);
+		for (i = (start + 1) & mask; i != start; i = (i + 1) & mask)
+			if (old[i].name) vhost_index_put(old[i].hash, old[i].name, old[i].vhost);
+		free(old);
+	}
+	return OK;
+}
+
+
+/*
+ * Add a route to the index
+ */
+static int vhost_index_add(const char *name, int vhost)
+{
+	char *copy;
+
+	if (vhost_index_grow() == ERROR) return ERROR;
+	if ((copy = strdup(name)) == NULL) return ERROR;
+
+	vhost_index_put(strhash(name), copy, vhost);
+	return OK;
+}
+
+
+/*
+ * Scan the server root and the top level of every vhost
+ */
+static int vhost_index_build(const char *root, time_t now)
+{
+	DIR *dp;
+	DIR *vp;
+	struct dirent *d;
+	struct stat s;
+	vhost_dir *dirs;
+	int vfd;
+	int fd;
+	int n;
+
+	if ((dp = opendir(root)) == NULL) return ERROR;
+	fd = dirfd(dp);
+
+	if (fstat(fd, &s) == ERROR) goto fail;
+	vhosts.root_mtime = s.st_mtime;
+	vhosts.mask = VHOST_ROUTES - 1;
+
+	while ((d = readdir(dp))) {
+
+		/* Same rules as the plain vhost scan */
+		if (d->d_name[0] == '.') continue;
+		if (sstrncmp(d->d_name, "lost+found") == MATCH) continue;
+		if (fstatat(fd, d->d_name, &s, 0) == ERROR) continue;
+		if ((s.st_mode & S_IFMT) != S_IFDIR) continue;
+
+		if ((dirs = realloc(vhosts.dirs, sizeof(vhost_dir) * (vhosts.num_dirs + 1))) == NULL) goto fail;
+		vhosts.dirs = dirs;
+
+		n = vhosts.num_dirs;
+		if ((dirs[n].name = strdup(d->d_name)) == NULL) goto fail;
+		dirs[n].mode = s.st_mode;
+		dirs[n].mtime = s.st_mtime;
+		vhosts.num_dirs++;
+
+		/* Every vhost has a root */
+		if (vhost_index_add(EMPTY, n) == ERROR) goto fail;
+
+		/* Unreadable vhosts just won't get any more routes */
+		if ((vfd = openat(fd, d->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == ERROR) continue;
+		if ((vp = fdopendir(vfd)) == NULL) {
+			close(vfd);
+			continue;
+		}
+
+		while ((d = readdir(vp))) {
+			if (strcmp(d->d_name, ".") == MATCH || strcmp(d->d_name, "..") == MATCH) continue;
+			if (vhost_index_add(d->d_name, n) == ERROR) {
+				closedir(vp);
+				goto fail;
+			}
+		}
+		closedir(vp);
+	}
+
+	closedir(dp);
+	vhosts.built = vhosts.checked = now;
+	log_debug("indexed %i routes in %i vhosts", vhosts.num_routes, vhosts.num_dirs);
+	return OK;
+
+fail:
+	closedir(dp);
+	vhost_index_free();
+	return ERROR;
+}
+
+
+/*
+ * Check every once in a while whether vhosts were added or their
+ * top level entries changed
+ */
+static int vhost_index_fresh(const char *root, time_t now)
+{
+	struct stat s;
+	int fd;
+	int n;
+
+	if (!vhosts.routes) return FALSE;
+	if ((now - vhosts.checked) <= VHOST_INDEX_TTL) return TRUE;
+
+	if ((fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == ERROR) return FALSE;
+	if (fstat(fd, &s) == ERROR || s.st_mtime != vhosts.root_mtime ||
+	    !settled(vhosts.root_mtime, vhosts.built)) {
+		close(fd);
+		return FALSE;
+	}
+
+	/* Directories changed during the scan can't be trusted */
+	for (n = 0; n < vhosts.num_dirs; n++) {
+		if (fstatat(fd, vhosts.dirs[n].name, &s, 0) == ERROR ||
+		    s.st_mtime != vhosts.dirs[n].mtime ||
+		    !settled(vhosts.dirs[n].mtime, vhosts.built)) {
+			close(fd);
+			return FALSE;
+		}
+	}
+
+	close(fd);
+	vhosts.checked = now;
+	return TRUE;
+}
+
+
+/*
+ * Get an up to date index - call with vhost_lock held
+ */
+static int vhost_index(state *st)
+{
+	time_t now = time(NULL);
+
+	if (vhost_index_fresh(st->cfg->server_root, now)) return OK;
+
+	vhost_index_free();
+	return vhost_index_build(st->cfg->server_root, now);
+}
+
+
+/*
+ * Find the vhost a selector is under - OK if found, ERROR if no vhost
+ * has it, AGAIN if the index can't be used and vhosts must be scanned
+ */
+int vhost_cache_find(state *st)
+{
+	vhost_route *r;
+	struct stat file;
+	unsigned long hash;
+	unsigned int i;
+	char *name;
+	size_t len;
+	int ret = ERROR;
+
+	if (!file_cached(st)) return AGAIN;
+
+	/* Route by the first selector component */
+	name = st->req_selector;
+	while (*name == '/') name++;
+	len = strcspn(name, "/");
+	hash = memhash(name, len);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&vhost_lock);
+#endif
+	if (vhost_index(st) == ERROR) ret = AGAIN;
+	else {
+		for (i = hash & vhosts.mask; vhosts.routes[i].name; i = (i + 1) & vhosts.mask) {
+			r = &vhosts.routes[i];
+			if (r->hash != hash || strncmp(r->name, name, len) != MATCH || r->name[len]) continue;
+
+			/* Only the first level is indexed */
+			snprintf(st->req_realpath, sizeof(st->req_realpath), "%s/%s%s",
+				st->cfg->server_root, vhosts.dirs[r->vhost].name, st->req_selector);
+
+			if (file_cache_stat(st, st->req_realpath, &file) == OK) {
+				sstrlcpy(st->server_host, vhosts.dirs[r->vhost].name);
+				ret = OK;
+				break;
+			}
+		}
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&vhost_lock);
+#endif
+
+	return ret;
+}
+
+
+/*
+ * Get the vhost directories for a vhost listing without scanning the
+ * server root - ERROR if the index can't be used
+ */
+int vhost_cache_list(state *st, sdirent **list)
+{
+	sdirent *dir = NULL;
+	int num = ERROR;
+	int n;
+
+	if (!file_cached(st)) return ERROR;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&vhost_lock);
+#endif
+	if (vhost_index(st) == OK &&
+	    (vhosts.num_dirs == 0 || (dir = arena_alloc(st->conn->arena, sizeof(sdirent) * vhosts.num_dirs)))) {
+
+		for (n = 0; n < vhosts.num_dirs; n++) {
+			if ((dir[n].name = arena_alloc(st->conn->arena, strlen(vhosts.dirs[n].name) + 1)) == NULL) break;
+			strcpy(dir[n].name, vhosts.dirs[n].name);
+
+			dir[n].mode = vhosts.dirs[n].mode;
+			dir[n].mtime = vhosts.dirs[n].mtime;
+			dir[n].uid = 0;
+			dir[n].gid = 0;
+			dir[n].size = 0;
+		}
+		num = n;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&vhost_lock);
+#endif
+
+	*list = dir;
+	return num;
+}
+
+
+/*
+ * Compiled gophermap
+ */
+typedef struct {
+	unsigned long hash;
+	char *key;
+	gmap *map;
+	time_t used;
+} map_entry;
+
+static map_entry maps[MAP_CACHE_SIZE];
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/*
+ * Drop a reference to a compiled gophermap - call with map_lock held
+ */
+static void map_unref(gmap *m)
+{
+	if (--m->refs > 0) return;
+
+	if (m->lines) free(m->lines);
+	if (m->strings) free(m->strings);
+	if (m->files) free(m->files);
+	free(m);
+}
+
+
+/*
+ * Done with a compiled gophermap
+ */
+void map_release(gmap *m)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&map_lock);
+#endif
+	map_unref(m);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&map_lock);
+#endif
+}
+
+
+/*
+ * Check that none of the files a gophermap was compiled from changed
+ */
+static int map_fresh(state *st, gmap *m, struct stat *file)
+{
+	map_stamp *f;
+	struct stat s;
+	int i;
+
+	/* The gophermap itself was just stat()ed by the caller */
+	f = &m->files[0];
+	if (file->st_ino != f->ino || file->st_size != f->size || file->st_ctime != f->ctime)
+		return FALSE;
+
+	/* Includes are relative to the menu directory */
+	for (i = 1; i < m->num_files; i++) {
+		f = &m->files[i];
+
+		if (fstatat(st->req_dirfd, m->strings + f->name, &s, 0) == ERROR) {
+			if (f->ino) return FALSE;
+			continue;
+		}
+		if (s.st_ino != f->ino || s.st_size != f->size || s.st_ctime != f->ctime)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Get a still valid compiled gophermap - release it with map_release()
+ */
+gmap *map_cache_get(state *st, const char *key, struct stat *file)
+{
+	map_entry *e;
+	gmap *m = NULL;
+	unsigned long hash;
+	int i;
+
+	if (!file_cached(st)) return NULL;
+	hash = strhash(key);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&map_lock);
+#endif
+	for (i = 0; i < MAP_CACHE_SIZE; i++) {
+		e = &maps[i];
+		if (!e->key || e->hash != hash || strcmp(e->key, key) != MATCH) continue;
+
+		if (map_fresh(st, e->map, file)) {
+			m = e->map;
+			m->refs++;
+			e->used = time(NULL);
+		}
+		break;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&map_lock);
+#endif
+
+	return m;
+}
+
+
+/*
+ * Keep a freshly compiled gophermap for the next requests
+ */
+void map_cache_put(state *st, const char *key, gmap *m)
+{
+	map_entry *e;
+	map_entry *old;
+	unsigned long hash;
+	time_t now;
+	int i;
+
+	if (!file_cached(st) || m->error) return;
+
+	now = time(NULL);
+	for (i = 0; i < m->num_files; i++)
+		if (m->files[i].ino && !settled(m->files[i].ctime, now)) return;
+
+	hash = strhash(key);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&map_lock);
+#endif
+	/* Replace the old version, an empty slot or the least recently used */
+	old = &maps[0];
+	for (i = 0; i < MAP_CACHE_SIZE; i++) {
+		e = &maps[i];
+		if (e->key && e->hash == hash && strcmp(e->key, key) == MATCH) {
+			old = e;
+			break;
+		}
+		if (!e->key) old = e;
+		else if (old->key && e->used < old->used) old = e;
+	}
+
+	if (old->key) map_unref(old->map);
+	if (!old->key || strcmp(old->key, key) != MATCH) {
+		if (old->key) free(old->key);
+		if ((old->key = strdup(key)) == NULL) goto unlock;
+	}
+
+	old->hash = hash;
+	old->map = m;
+	old->used = now;
+	m->refs++;
+
+unlock:
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&map_lock);
+#endif
+	return;
+}
+
+
+/*
+ * Cached output of an executable gophermap, stored compiled
+ */
+typedef struct {
+	unsigned long magic;
+	time_t expires;
+	ino_t ino;	/* The gophermap that produced it */
+	time_t ctime;
+	int result;
+	int keylen;
+	int num_lines;
+	int strings_len;
+} exec_header;
+
+
+/*
+ * Get the file a cache key is stored in
+ */
+static void exec_cache_path(state *st, const char *key, char *path, size_t size, const char *suffix)
+{
+	snprintf(path, size, "%s/map-%016llx%s", st->cfg->cache_dir, strhash(key), suffix);
+}
+
+
+/*
+ * Check that a line read from the disk points inside the strings
+ */
+static int exec_line_ok(map_line *l, int len)
+{
+	if (l->name < 0 || l->name >= len) return FALSE;
+	if (l->selector != ERROR && (l->selector < 0 || l->selector >= len)) return FALSE;
+	if (l->host != ERROR && (l->host < 0 || l->host >= len)) return FALSE;
+	return TRUE;
+}
+
+
+/*
+ * Load the cached output of an executable gophermap - sets *stale if
+ * it has expired and should be refreshed
+ */
+gmap *exec_cache_get(state *st, const char *key, struct stat *file, int *stale)
+{
+	exec_header h;
+	struct stat s;
+	char path[BUFSIZE];
+	char *stored = NULL;
+	gmap *m = NULL;
+	size_t lines;
+	int fd;
+	int i;
+
+	if (!*st->cfg->cache_dir) return NULL;
+
+	exec_cache_path(st, key, path, sizeof(path), EMPTY);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == ERROR) return NULL;
+
+	/* Same map, same key and all of it there? */
+	if (fstat(fd, &s) == ERROR || read(fd, &h, sizeof(h)) != sizeof(h)) goto fail;
+	if (h.magic != EXEC_CACHE_MAGIC || h.ino != file->st_ino || h.ctime != file->st_ctime) goto fail;
+	if (h.keylen != (int) strlen(key) || h.num_lines < 0 || h.strings_len < 1) goto fail;
+
+	lines = sizeof(map_line) * h.num_lines;
+	if ((size_t) s.st_size != sizeof(h) + h.keylen + lines + h.strings_len) goto fail;
+
+	if ((stored = malloc(h.keylen)) == NULL || read(fd, stored, h.keylen) != h.keylen ||
+	    memcmp(stored, key, h.keylen) != MATCH) goto fail;
+
+	if ((m = calloc(1, sizeof(gmap))) == NULL) goto fail;
+	m->refs = 1;
+	m->result = h.result;
+	m->num_lines = h.num_lines;
+	m->strings_len = h.strings_len;
+
+	if ((m->lines = malloc(lines + 1)) == NULL || (m->strings = malloc(h.strings_len)) == NULL) goto fail;
+	if (read(fd, m->lines, lines) != (ssize_t) lines ||
+	    read(fd, m->strings, h.strings_len) != h.strings_len) goto fail;
+
+	/* Don't trust the disk too much */
+	if (m->strings[h.strings_len - 1] != '\0') goto fail;
+	for (i = 0; i < m->num_lines; i++)
+		if (!exec_line_ok(&m->lines[i], h.strings_len)) goto fail;
+
+	/* Nobody has asked for it in ages - run the map again */
+	if (time(NULL) >= h.expires + EXEC_CACHE_STALE) {
+		unlink(path);
+		goto fail;
+	}
+
+	*stale = (time(NULL) >= h.expires);
+	free(stored);
+	close(fd);
+	return m;
+
+fail:
+	if (m) map_release(m);
+	if (stored) free(stored);
+	close(fd);
+	return NULL;
+}
+
+
+/*
+ * Store the output of an executable gophermap that asked for caching
+ */
+void exec_cache_put(state *st, const char *key, struct stat *file, gmap *m)
+{
+	exec_header h;
+	char path[BUFSIZE];
+	char tmp[BUFSIZE];
+	size_t lines;
+	int fd;
+
+	if (!*st->cfg->cache_dir || m->error || m->ttl <= 0) return;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = EXEC_CACHE_MAGIC;
+	h.expires = time(NULL) + m->ttl;
+	h.ino = file->st_ino;
+	h.ctime = file->st_ctime;
+	h.result = m->result;
+	h.keylen = strlen(key);
+	h.num_lines = m->num_lines;
+	h.strings_len = m->strings_len;
+	lines = sizeof(map_line) * m->num_lines;
+
+	/* Write a new file and rename it over the old one */
+	exec_cache_path(st, key, path, sizeof(path), EMPTY);
+	exec_cache_path(st, key, tmp, sizeof(tmp), ".XXXXXX");
+	if ((fd = mkstemp(tmp)) == ERROR) return;
+
+	if (write(fd, &h, sizeof(h)) != sizeof(h) ||
+	    write(fd, key, h.keylen) != h.keylen ||
+	    write(fd, m->lines, lines) != (ssize_t) lines ||
+	    write(fd, m->strings, h.strings_len) != h.strings_len) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	close(fd);
+	if (rename(tmp, path) == ERROR) unlink(tmp);
+
+	/* inetd servers have no parent to sweep the directory */
+	if (!st->cfg->opt_daemon && rand() % 64 == 0) exec_cache_sweep(st->cfg);
+}
+
+
+/*
+ * Forget the output of a map that doesn't want caching anymore
+ */
+void exec_cache_drop(state *st, const char *key)
+{
+	char path[BUFSIZE];
+
+	exec_cache_path(st, key, path, sizeof(path), EMPTY);
+	unlink(path);
+}
+
+
+/*
+ * Create a lock file - only one process gets it
+ */
+static int cache_lock(const char *path)
+{
+	struct stat s;
+	int fd;
+
+	/* Refreshes that died or hung don't block the output forever */
+	if (stat(path, &s) == OK && (time(NULL) - s.st_mtime) > EXEC_CACHE_LOCK)
+		unlink(path);
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) == ERROR) return ERROR;
+	close(fd);
+	return OK;
+}
+
+
+/*
+ * Claim the refresh of a stale output - only one process gets it
+ */
+int exec_cache_lock(state *st, const char *key)
+{
+	char path[BUFSIZE];
+
+	exec_cache_path(st, key, path, sizeof(path), ".lock");
+	return cache_lock(path);
+}
+
+
+/*
+ * Done refreshing
+ */
+void exec_cache_unlock(state *st, const char *key)
+{
+	char path[BUFSIZE];
+
+	exec_cache_path(st, key, path, sizeof(path), ".lock");
+	unlink(path);
+}
+
+
+/*
+ * Sort cached outputs oldest first
+ */
+static int exec_age_sort(const void *a, const void *b)
+{
+	const sdirent *x = a;
+	const sdirent *y = b;
+
+	if (x->mtime != y->mtime) return (x->mtime < y->mtime) ? -1 : 1;
+	return 0;
+}
+
+
+/*
+ * Keep the executable gophermap outputs in -C bounded - every query
+ * string gets an output of its own, so remove the ones that expired
+ * long ago and then the oldest until there are at most EXEC_CACHE_MAX
+ */
+void exec_cache_sweep(const config *cfg)
+{
+	struct dirent *d;
+	struct stat s;
+	exec_header h;
+	sdirent *list = NULL;
+	sdirent *grown;
+	char path[BUFSIZE];
+	time_t now;
+	DIR *dp;
+	int size = 0;
+	int num = 0;
+	int fresh;
+	int fd;
+	int i;
+
+	if (!*cfg->cache_dir || (dp = opendir(cfg->cache_dir)) == NULL) return;
+	now = time(NULL);
+
+	while ((d = readdir(dp))) {
+		if (strncmp(d->d_name, "map-", 4) != MATCH) continue;
+
+		snprintf(path, sizeof(path), "%s/%s", cfg->cache_dir, d->d_name);
+		if (lstat(path, &s) == ERROR || (s.st_mode & S_IFMT) != S_IFREG) continue;
+
+		/* Temporary files and locks left behind by refreshes that died */
+		if (strchr(d->d_name, '.')) {
+			if ((now - s.st_mtime) > EXEC_CACHE_LOCK) unlink(path);
+			continue;
+		}
+
+		/* Expired long ago? */
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == ERROR) continue;
+		fresh = (read(fd, &h, sizeof(h)) == sizeof(h) && h.magic == EXEC_CACHE_MAGIC &&
+		         now < h.expires + EXEC_CACHE_STALE);
+		close(fd);
+
+		if (!fresh) {
+			unlink(path);
+			continue;
+		}
+
+		/* Remember the rest for removing the oldest */
+		if (num == size) {
+			size = size ? size * 2 : 256;
+			if ((grown = realloc(list, sizeof(sdirent) * size)) == NULL) break;
+			list = grown;
+		}
+
+		if ((list[num].name = strdup(d->d_name)) == NULL) break;
+		list[num++].mtime = s.st_mtime;
+	}
+	closedir(dp);
+
+	if (num > EXEC_CACHE_MAX) {
+		qsort(list, num, sizeof(sdirent), exec_age_sort);
+
+		for (i = 0; i < num - EXEC_CACHE_MAX; i++) {
+			snprintf(path, sizeof(path), "%s/%s", cfg->cache_dir, list[i].name);
+			unlink(path);
+		}
+	}
+
+	for (i = 0; i < num; i++) free(list[i].name);
+	if (list) free(list);
+}
+
+
+/*
+ * Cached output of a filter - the output itself follows the key
+ */
+typedef struct {
+	unsigned long magic;
+	ino_t filter_ino;	/* The filter that produced it */
+	time_t filter_mtime;
+	dev_t dev;	/* From this file */
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+	int keylen;
+} filter_header;
+
+
+/*
+ * Get the file a filter cache key is stored in
+ */
+static void filter_cache_path(state *st, const char *key, char *path, size_t size, const char *suffix)
+{
+	snprintf(path, size, "%s/filter-%016llx%s", st->cfg->cache_dir, strhash(key), suffix);
+}
+
+
+/*
+ * Open the cached output of a filter for a file - returns the fd
+ * with the output starting at *start, or ERROR if it must be run
+ */
+int filter_cache_get(state *st, const char *key, struct stat *filter, struct stat *file, off_t *start)
+{
+	filter_header h;
+	char stored[BUFSIZE];
+	char path[BUFSIZE];
+	int fd;
+
+	if (!*st->cfg->cache_dir) return ERROR;
+
+	filter_cache_path(st, key, path, sizeof(path), EMPTY);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == ERROR) return ERROR;
+
+	/* Same filter, same file and same key? */
+	if (read(fd, &h, sizeof(h)) != sizeof(h) || h.magic != FILTER_CACHE_MAGIC) goto fail;
+	if (h.filter_ino != filter->st_ino || h.filter_mtime != filter->st_mtime ||
+	    h.dev != file->st_dev || h.ino != file->st_ino ||
+	    h.mtime != file->st_mtime || h.size != file->st_size) goto fail;
+
+	if (h.keylen != (int) strlen(key) || h.keylen >= (int) sizeof(stored) ||
+	    read(fd, stored, h.keylen) != h.keylen ||
+	    memcmp(stored, key, h.keylen) != MATCH) goto fail;
+
+	*start = sizeof(h) + h.keylen;
+	return fd;
+
+fail:
+	close(fd);
+	return ERROR;
+}
+
+
+/*
+ * Can the output of a filter for a file be cached yet? Not while
+ * either of them may still change without getting a new mtime.
+ */
+int filter_cache_settled(struct stat *filter, struct stat *file)
+{
+	time_t now = time(NULL);
+
+	return (settled(file->st_mtime, now) && settled(filter->st_mtime, now));
+}
+
+
+/*
+ * Claim the caching of a filter output - only one process gets it
+ */
+int filter_cache_lock(state *st, const char *key)
+{
+	char path[BUFSIZE];
+
+	filter_cache_path(st, key, path, sizeof(path), ".lock");
+	return cache_lock(path);
+}
+
+
+/*
+ * Done caching
+ */
+void filter_cache_unlock(state *st, const char *key)
+{
+	char path[BUFSIZE];
+
+	filter_cache_path(st, key, path, sizeof(path), ".lock");
+	unlink(path);
+}
+
+
+/*
+ * Store what a filter writes to a pipe until it closes it in a new file
+ * for filter_cache_commit() - returns ERROR if nothing could be stored
+ */
+int filter_cache_put(state *st, const char *key, struct stat *filter, struct stat *file,
+	int in, char *tmp, size_t size)
+{
+	filter_header h;
+	char buf[BUFSIZE];
+	ssize_t bytes;
+	off_t total = 0;
+	int fd;
+
+	if (!*st->cfg->cache_dir || !filter_cache_settled(filter, file)) return ERROR;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = FILTER_CACHE_MAGIC;
+	h.filter_ino = filter->st_ino;
+	h.filter_mtime = filter->st_mtime;
+	h.dev = file->st_dev;
+	h.ino = file->st_ino;
+	h.mtime = file->st_mtime;
+	h.size = file->st_size;
+	h.keylen = strlen(key);
+
+	/* Written aside until the filter is known to have worked */
+	filter_cache_path(st, key, tmp, size, ".XXXXXX");
+	if ((fd = mkstemp(tmp)) == ERROR) return ERROR;
+
+	if (write(fd, &h, sizeof(h)) != sizeof(h) ||
+	    write(fd, key, h.keylen) != h.keylen) goto fail;
+
+	for (;;) {
+		if ((bytes = read(in, buf, sizeof(buf))) == ERROR) {
+			if (errno == EINTR) continue;
+			goto fail;
+		}
+		if (bytes == 0) break;
+
+		if (write(fd, buf, bytes) != bytes) goto fail;
+		total += bytes;
+	}
+
+	/* No output is more likely a broken filter than a result */
+	if (total == 0) goto fail;
+
+	if (close(fd) == ERROR) {
+		unlink(tmp);
+		return ERROR;
+	}
+	return OK;
+
+fail:
+	close(fd);
+	unlink(tmp);
+	return ERROR;
+}
+
+
+/*
+ * Done filtering - keep the output only if the filter worked
+ */
+void filter_cache_commit(state *st, const char *key, char *tmp, int keep)
+{
+	char path[BUFSIZE];
+
+	if (!keep) {
+		unlink(tmp);
+		return;
+	}
+
+	filter_cache_path(st, key, path, sizeof(path), EMPTY);
+	if (rename(tmp, path) == ERROR) unlink(tmp);
+}
+
+
+/*
+ * A text file converted for sending - the converted text follows
+ * unless the file could be sent as it is
+ */
+typedef struct {
+	unsigned long magic;
+	dev_t dev;	/* Converted from this file */
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+	int charset;
+	int plain;
+} text_header;
+
+
+/*
+ * Get the file the converted text of a file is stored in
+ */
+static void text_cache_path(state *st, struct stat *file, char *path, size_t size, const char *suffix)
+{
+	snprintf(path, size, "%s/text-%llx-%llx-%i%s", st->cfg->cache_dir,
+		(unsigned long long) file->st_dev, (unsigned long long) file->st_ino,
+		st->cfg->opt_iconv ? st->cfg->out_charset : AUTO, suffix);
+}
+
+
+/*
+ * Open the converted text of a file - returns the fd with the text
+ * starting at *start, or ERROR if it must be converted. Sets *plain if
+ * the file itself can be sent instead.
+ */
+int text_cache_get(state *st, struct stat *file, off_t *start, int *plain)
+{
+	text_header h;
+	char path[BUFSIZE];
+	int fd;
+
+	if (!*st->cfg->cache_dir) return ERROR;
+
+	text_cache_path(st, file, path, sizeof(path), EMPTY);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == ERROR) return ERROR;
+
+	if (read(fd, &h, sizeof(h)) != sizeof(h) || h.magic != TEXT_CACHE_MAGIC ||
+	    h.dev != file->st_dev || h.ino != file->st_ino ||
+	    h.mtime != file->st_mtime || h.size != file->st_size ||
+	    h.charset != (st->cfg->opt_iconv ? st->cfg->out_charset : AUTO)) {
+		close(fd);
+		return ERROR;
+	}
+
+	*start = sizeof(h);
+	*plain = h.plain;
+	return fd;
+}
+
+
+/*
+ * Start storing the converted text of a file - returns a stream to
+ * write the text to
+ */
+FILE *text_cache_create(state *st, struct stat *file, char *tmp, size_t size)
+{
+	text_header h;
+	FILE *fp;
+	int fd;
+
+	if (!*st->cfg->cache_dir) return NULL;
+
+	text_cache_path(st, file, tmp, size, ".XXXXXX");
+	if ((fd = mkstemp(tmp)) == ERROR) return NULL;
+
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		return NULL;
+	}
+
+	/* Filled in when done */
+	memset(&h, 0, sizeof(h));
+	fwrite(&h, sizeof(h), 1, fp);
+	return fp;
+}
+
+
+/*
+ * Done converting - plain if the text turned out to be the same as the
+ * file, ERROR if the conversion failed
+ */
+void text_cache_commit(state *st, struct stat *file, char *tmp, FILE *fp, int plain)
+{
+	text_header h;
+	char path[BUFSIZE];
+
+	memset(&h, 0, sizeof(h));
+	h.magic = TEXT_CACHE_MAGIC;
+	h.dev = file->st_dev;
+	h.ino = file->st_ino;
+	h.mtime = file->st_mtime;
+	h.size = file->st_size;
+	h.charset = st->cfg->opt_iconv ? st->cfg->out_charset : AUTO;
+	h.plain = (plain == TRUE);
+
+	if (!settled(file->st_mtime, time(NULL))) plain = ERROR;
+
+	/* No need to keep a copy of the file */
+	if (plain == TRUE && (fflush(fp) == EOF ||
+	    ftruncate(fileno(fp), sizeof(h)) == ERROR)) plain = ERROR;
+
+	if (plain == ERROR || fseek(fp, 0, SEEK_SET) == ERROR ||
+	    fwrite(&h, sizeof(h), 1, fp) != 1) {
+		fclose(fp);
+		unlink(tmp);
+		return;
+	}
+
+	if (fclose(fp) == EOF) {
+		unlink(tmp);
+		return;
+	}
+
+	text_cache_path(st, file, path, sizeof(path), EMPTY);
+	if (rename(tmp, path) == ERROR) unlink(tmp);
+}
+
+
+/*
+ * Content sniffing results shared by all processes
+ */
+#ifdef HAVE_SHMEM
+typedef struct {
+	unsigned long check;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+	int type;
+} sniff_entry;
+
+typedef struct {
+	shm_header header;
+	sniff_entry entry[SNIFF_CACHE_SIZE];
+} sniff_table;
+
+static sniff_table *sniffs;
+
+
+/*
+ * Checksum of an entry - a half-written entry won't match
+ */
+static unsigned long sniff_check(const sniff_entry *e)
+{
+	unsigned long check;
+
+	check = (unsigned long) e->dev * 31 + (unsigned long) e->ino;
+	check = check * 1000003 ^ (unsigned long) e->mtime;
+	check = check * 1000003 ^ (unsigned long) e->size;
+	check = check * 1000003 ^ (unsigned long) e->type;
+
+	/* Empty slots are all zeroes */
+	return check | 1;
+}
+
+
+/*
+ * Attach to the shared sniffing cache
+ */
+void sniff_cache_init(void)
+{
+	sniffs = shm_attach(SNIFF_SHM_KEY, sizeof(sniff_table), SNIFF_VERSION, NULL, NULL, NULL);
+}
+
+
+/*
+ * Look up the sniffed type of a file - returns ERROR if it must be
+ * read. Leaves the stat() of the file for sniff_cache_put().
+ */
+int sniff_cache_get(const char *file, struct stat *s)
+{
+	sniff_entry e;
+
+	s->st_mode = 0;
+	if (!sniffs || stat(file, s) == ERROR) return ERROR;
+
+	memcpy(&e, &sniffs->entry[((unsigned long) s->st_ino) % SNIFF_CACHE_SIZE], sizeof(e));
+
+	if (e.check != sniff_check(&e) || e.dev != s->st_dev || e.ino != s->st_ino ||
+	    e.mtime != s->st_mtime || e.size != s->st_size) return ERROR;
+
+	return e.type;
+}
+
+
+/*
+ * Remember the sniffed type of a file
+ */
+void sniff_cache_put(const struct stat *s, int type)
+{
+	sniff_entry e;
+
+	if (!sniffs || s->st_mode == 0) return;
+
+	if (!settled(s->st_mtime, time(NULL))) return;
+
+	memset(&e, 0, sizeof(e));
+	e.dev = s->st_dev;
+	e.ino = s->st_ino;
+	e.mtime = s->st_mtime;
+	e.size = s->st_size;
+	e.type = type;
+	e.check = sniff_check(&e);
+
+	memcpy(&sniffs->entry[((unsigned long) s->st_ino) % SNIFF_CACHE_SIZE], &e, sizeof(e));
+}
+#endif
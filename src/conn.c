@@ -0,0 +1,486 @@
+/*
+ * Gophernicus
+ *
+ * Copyright (c) 2009-2018 Kim Holviala <kimholviala@fastmail.com>
+ * Copyright (c) 2019 Gophernicus Developers <gophernicus@gophernicus.org>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "gophernicus.h"
+
+
+
+/*
+ * Initialize a client connection - its buffers come from the arena of
+ * whoever serves it
+ */
+void conn_init(conn *c, arena *mem, int in, int out)
+{
+	c->in = in;
+	c->out = out;
+	c->defer = FALSE;
+	c->detached = FALSE;
+	c->error = FALSE;
+	c->nosock = FALSE;
+	c->delay = 0;
+	c->arena = mem;
+	c->ring = NULL;
+	c->shm = NULL;
+	c->session = ERROR;
+	c->session_id = 0;
+
+	c->req = NULL;
+	c->req_len = 0;
+
+	c->size = OUTBUFSIZE;
+	c->len = 0;
+	c->pos = 0;
+	c->sent = 0;
+	if ((c->buf = arena_get(mem, c->size)) == NULL) c->size = 0;
+
+	c->file = ERROR;
+	c->file_pos = 0;
+	c->file_size = 0;
+
+	c->text = NULL;
+	c->text_charset = AUTO;
+	c->text_iconv = FALSE;
+	c->text_partial = FALSE;
+}
+
+
+/*
+ * Release everything owned by a connection (but not the socket)
+ */
+void conn_free(conn *c)
+{
+#ifdef HAVE_SHMEM
+	update_shm_sent(c);
+	c->shm = NULL;
+#endif
+
+	if (c->file != ERROR) close(c->file);
+	if (c->text) fclose(c->text);
+	c->file = ERROR;
+	c->text = NULL;
+
+	if (c->buf) arena_put(c->arena, c->buf);
+	if (c->req) arena_put(c->arena, c->req);
+	c->buf = NULL;
+	c->req = NULL;
+	c->size = c->len = c->pos = c->req_len = 0;
+}
+
+
+/*
+ * Read one line from the client without consuming anything past it
+ */
+static char *read_line(int fd, char *buf, size_t bufsize)
+{
+	int is_socket = TRUE;
+	ssize_t bytes;
+	size_t len = 0;
+	char *c;
+
+	while (len < bufsize - 1) {
+
+		/* Peek at the socket so the rest of the connection stays unread */
+		if (is_socket) {
+			if ((bytes = recv(fd, buf + len, bufsize - 1 - len, MSG_PEEK)) == ERROR) {
+				if (errno == EINTR) continue;
+				if (errno != ENOTSOCK) break;
+				is_socket = FALSE;
+				continue;
+			}
+			if (bytes == 0) break;
+
+			/* Consume up to and including the newline */
+			if ((c = memchr(buf + len, '\n', bytes))) bytes = c - (buf + len) + 1;
+		}
+
+		/* Pipes and files are read one byte at a time */
+		else bytes = 1;
+
+		if ((bytes = read(fd, buf + len, bytes)) <= 0) {
+			if (bytes == ERROR && errno == EINTR) continue;
+			break;
+		}
+
+		len += bytes;
+		if (buf[len - 1] == '\n') break;
+	}
+
+	buf[len] = '\0';
+	return len ? buf : NULL;
+}
+
+
+/*
+ * Check whether the whole request has arrived
+ */
+int conn_request_ready(const config *cfg, const conn *c)
+{
+	const char *nl;
+
+	if (c->req_len >= REQBUFSIZE) return TRUE;
+	if ((nl = memchr(c->req, '\n', c->req_len)) == NULL) return FALSE;
+
+	/* A proxy protocol header is followed by the real selector */
+#ifdef ENABLE_HAPROXY1
+	if (cfg->opt_proxy && c->req_len >= 9 && memcmp(c->req, "PROXY TCP", 9) == MATCH) {
+		nl++;
+		return memchr(nl, '\n', c->req_len - (nl - c->req)) != NULL;
+	}
+#endif
+
+	return TRUE;
+}
+
+
+/*
+ * Get one request line - either already received by the event loop
+ * or read straight from the client
+ */
+char *conn_getline(conn *c, char *buf, size_t bufsize)
+{
+	char *nl;
+	size_t len;
+
+	if (!c->req) return read_line(c->in, buf, bufsize);
+	if (c->req_len == 0) return NULL;
+
+	/* Pop the first line off the request buffer */
+	if ((nl = memchr(c->req, '\n', c->req_len))) len = nl - c->req + 1;
+	else len = c->req_len;
+	len = min(len, bufsize - 1);
+
+	memcpy(buf, c->req, len);
+	buf[len] = '\0';
+
+	c->req_len -= len;
+	memmove(c->req, c->req + len, c->req_len);
+	return buf;
+}
+
+
+/*
+ * Queue a file (from start to end) to be sent after the buffered output
+ */
+void conn_sendfile(conn *c, int fd, off_t start, off_t end)
+{
+	char *buf;
+	int buffered = TRUE;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, start, end - start, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	/* Files read through the buffer (always with io_uring) go in bigger pieces */
+#ifdef HAVE_SENDFILE
+	buffered = (c->ring != NULL);
+#endif
+	if (buffered && c->size < FILEBUFSIZE && end - start > (off_t) c->size &&
+		(buf = arena_get(c->arena, FILEBUFSIZE))) {
+		if (c->buf) {
+			memcpy(buf, c->buf, c->len);
+			arena_put(c->arena, c->buf);
+		}
+		c->buf = buf;
+		c->size = FILEBUFSIZE;
+	}
+
+	c->file = fd;
+	c->file_pos = start;
+	c->file_size = end;
+}
+
+
+/*
+ * Check whether more of the reply follows what's in the output buffer
+ */
+int conn_pending(conn *c)
+{
+	if (c->file != ERROR && c->file_pos < c->file_size) return TRUE;
+	if (!c->text) return FALSE;
+
+#ifndef ENABLE_STRICT_RFC1436
+	/* Peek for the end of the text (which needs no terminator) */
+	{
+		int ch;
+
+		if ((ch = getc(c->text)) == EOF) return FALSE;
+		ungetc(ch, c->text);
+	}
+#endif
+	return TRUE;
+}
+
+
+/*
+ * Send a gather list to the client - sockets are told when more is
+ * coming so that the kernel can fill whole segments
+ */
+static ssize_t conn_send(conn *c, struct iovec *iov, int count, int more)
+{
+	struct msghdr msg;
+	ssize_t bytes;
+
+	if (!c->nosock) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+
+		if ((bytes = sendmsg(c->out, &msg, more ? MSG_MORE : 0)) != ERROR ||
+			errno != ENOTSOCK) return bytes;
+
+		/* Pipes and such (inetd mode) */
+		c->nosock = TRUE;
+	}
+
+	return writev(c->out, iov, count);
+}
+
+
+/*
+ * Send what's buffered plus what follows - more is TRUE when called
+ * to make room in the middle of a reply
+ */
+static int conn_send_all(conn *c, int more)
+{
+	struct iovec iov;
+	ssize_t bytes;
+
+	if (c->error) return ERROR;
+
+	for (;;) {
+
+		/* Put the next piece of a file after what's buffered so they leave together */
+		if (!more && c->pos == 0 && c->len < OUTBUFSIZE / 2) {
+			if (c->text) send_text_chunk(c);
+#ifndef HAVE_SENDFILE
+			else if (c->file != ERROR) {
+
+				/* Never past the end the file had when it was queued */
+				bytes = 0;
+				if (c->file_pos < c->file_size)
+					bytes = pread(c->file, c->buf + c->len, min((off_t) (c->size - c->len),
+						c->file_size - c->file_pos), c->file_pos);
+
+				if (bytes > 0) {
+					c->file_pos += bytes;
+					c->len += bytes;
+				}
+				else if (bytes == ERROR && errno == EINTR) continue;
+
+				/* Whole file sent (or it shrunk under us) */
+				else {
+					close(c->file);
+					c->file = ERROR;
+				}
+			}
+#endif
+		}
+
+		/* Send buffered output */
+		if (c->pos < c->len) {
+			iov.iov_base = c->buf + c->pos;
+			iov.iov_len = c->len - c->pos;
+
+			if ((bytes = conn_send(c, &iov, 1, more || conn_pending(c))) == ERROR) {
+				if (errno == EINTR) continue;
+				if (c->defer && (errno == EAGAIN || errno == EWOULDBLOCK)) return AGAIN;
+
+				c->error = TRUE;
+				return ERROR;
+			}
+
+			c->pos += bytes;
+			c->sent += bytes;
+			continue;
+		}
+		c->pos = c->len = 0;
+
+		if (more) return OK;
+
+#ifdef HAVE_SENDFILE
+		/* Send more of a binary file */
+		if (c->file != ERROR) {
+			if (c->file_pos < c->file_size) {
+				if ((bytes = sendfile(c->out, c->file, &c->file_pos,
+					min(c->file_size - c->file_pos, SENDFILE_MAX))) == ERROR) {
+					if (errno == EINTR) continue;
+					if (c->defer && (errno == EAGAIN || errno == EWOULDBLOCK)) return AGAIN;
+
+					c->error = TRUE;
+					return ERROR;
+				}
+
+				c->sent += bytes;
+				if (bytes > 0) continue;
+			}
+
+			/* Whole file sent (or it shrunk under us) */
+			close(c->file);
+			c->file = ERROR;
+			continue;
+		}
+#endif
+		if (c->text || c->file != ERROR) continue;
+		return OK;
+	}
+}
+
+
+/*
+ * Make room for at least len more bytes in the output buffer
+ */
+static int conn_reserve(conn *c, size_t len)
+{
+	char *buf;
+	size_t size;
+
+	if (c->size - c->len >= len) return OK;
+
+	/* Blocking connections empty the buffer first */
+	if (!c->defer) {
+		if (conn_send_all(c, TRUE) == ERROR) return ERROR;
+		if (c->size - c->len >= len) return OK;
+	}
+
+	/* Grow the buffer */
+	size = max(c->size * 2, c->len + len);
+	if ((buf = arena_get(c->arena, size)) == NULL) return ERROR;
+
+	if (c->buf) {
+		memcpy(buf, c->buf, c->len);
+		arena_put(c->arena, c->buf);
+	}
+
+	c->buf = buf;
+	c->size = size;
+	return OK;
+}
+
+
+/*
+ * Queue data for the client
+ */
+void conn_write(conn *c, const void *data, size_t len)
+{
+	struct iovec iov[2];
+	ssize_t sent;
+	size_t bytes;
+
+	/* Blocking connections send big writes along with the buffer (often a whole reply) */
+	if (!c->defer && !c->error && len > c->size - c->len) {
+		iov[0].iov_base = c->buf + c->pos;
+		iov[0].iov_len = c->len - c->pos;
+		iov[1].iov_base = (void *) data;
+		iov[1].iov_len = len;
+
+		while (iov[1].iov_len > 0) {
+			if ((sent = conn_send(c, iov[0].iov_len ? iov : iov + 1,
+				iov[0].iov_len ? 2 : 1, FALSE)) == ERROR) {
+				if (errno == EINTR) continue;
+
+				c->error = TRUE;
+				return;
+			}
+			c->sent += sent;
+
+			bytes = min((size_t) sent, iov[0].iov_len);
+			iov[0].iov_base = (char *) iov[0].iov_base + bytes;
+			iov[0].iov_len -= bytes;
+			sent -= bytes;
+
+			iov[1].iov_base = (char *) iov[1].iov_base + sent;
+			iov[1].iov_len -= sent;
+		}
+
+		c->pos = c->len = 0;
+		return;
+	}
+
+	while (len > 0 && !c->error) {
+
+		/* Blocking connections send the data in buffer-sized pieces */
+		if (!c->defer) bytes = min(len, max(c->size, OUTBUFSIZE));
+		else bytes = len;
+
+		if (conn_reserve(c, bytes) == ERROR) {
+			c->error = TRUE;
+			return;
+		}
+
+		memcpy(c->buf + c->len, data, bytes);
+		c->len += bytes;
+
+		data = (const char *) data + bytes;
+		len -= bytes;
+	}
+}
+
+
+/*
+ * Queue formatted output for the client
+ */
+void conn_printf(conn *c, const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	if (c->error) return;
+
+	/* Try formatting straight into the buffer */
+	va_start(args, fmt);
+	len = vsnprintf(c->buf + c->len, c->size - c->len, fmt, args);
+	va_end(args);
+
+	if (len < 0) return;
+	if ((size_t) len < c->size - c->len) {
+		c->len += len;
+		return;
+	}
+
+	/* Didn't fit - make room and try again */
+	if (conn_reserve(c, len + 1) == ERROR) {
+		c->error = TRUE;
+		return;
+	}
+
+	va_start(args, fmt);
+	vsnprintf(c->buf + c->len, c->size - c->len, fmt, args);
+	va_end(args);
+	c->len += len;
+}
+
+
+/*
+ * Send as much pending output as the client accepts - returns OK when
+ * everything has been sent, AGAIN if the socket would block
+ */
+int conn_flush(conn *c)
+{
+	return conn_send_all(c, FALSE);
+}
@@ -0,0 +1,309 @@
+/*
+ * Gophernicus
+ *
+ * Copyright (c) 2009-2018 Kim Holviala <kimholviala@fastmail.com>
+ * Copyright (c) 2019 Gophernicus Developers <gophernicus@gophernicus.org>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "gophernicus.h"
+
+
+#ifdef HAVE_EPOLL
+
+/*
+ * Event loop client
+ */
+typedef struct client {
+	struct client *prev;
+	struct client *next;
+	conn c;
+	char stage;
+	time_t atime;
+	time_t wake;
+} client;
+
+
+/*
+ * Start tracking a new connection
+ */
+static client *client_open(int epfd, client **list, arena *mem, int fd, time_t now)
+{
+	struct epoll_event ev;
+	client *cl;
+
+	if ((cl = arena_get(mem, sizeof(client))) == NULL) return NULL;
+	memset(cl, 0, sizeof(client));
+
+	conn_init(&cl->c, mem, fd, fd);
+	cl->c.defer = TRUE;
+
+	if ((cl->c.req = arena_get(mem, REQBUFSIZE)) == NULL || cl->c.buf == NULL) {
+		conn_free(&cl->c);
+		arena_put(mem, cl);
+		return NULL;
+	}
+
+	cl->stage = STAGE_READ;
+	cl->atime = now;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = cl;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == ERROR) {
+		conn_free(&cl->c);
+		arena_put(mem, cl);
+		return NULL;
+	}
+
+	/* Link to the list of clients */
+	cl->next = *list;
+	if (*list) (*list)->prev = cl;
+	*list = cl;
+
+	return cl;
+}
+
+
+/*
+ * Hang up & forget a connection
+ */
+static void client_close(int epfd, client **list, client *cl)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, cl->c.in, NULL);
+	close(cl->c.in);
+	conn_free(&cl->c);
+
+	if (cl->prev) cl->prev->next = cl->next;
+	else *list = cl->next;
+	if (cl->next) cl->next->prev = cl->prev;
+
+	arena_put(cl->c.arena, cl);
+}
+
+
+/*
+ * Change the events a connection waits for
+ */
+static void client_wait(int epfd, client *cl, char stage, int events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = cl;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, cl->c.in, &ev);
+
+	cl->stage = stage;
+}
+
+
+/*
+ * Send more of the reply - returns TRUE when the connection is done
+ */
+static int client_write(int epfd, client *cl, time_t now)
+{
+	off_t sent = cl->c.sent;
+	int ret;
+
+	ret = conn_flush(&cl->c);
+	if (cl->c.sent > sent) cl->atime = now;
+
+	if (ret != AGAIN) return TRUE;
+
+	/* Socket is full - continue when the client has read some */
+	if (cl->stage != STAGE_WRITE) client_wait(epfd, cl, STAGE_WRITE, EPOLLOUT);
+	return FALSE;
+}
+
+
+/*
+ * Receive more of the request - returns TRUE when it's ready for serving
+ */
+static int client_read(const config *cfg, client *cl, time_t now)
+{
+	conn *c = &cl->c;
+	ssize_t bytes;
+
+	for (;;) {
+		if ((bytes = read(c->in, c->req + c->req_len, REQBUFSIZE - c->req_len)) == ERROR) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return FALSE;
+
+			/* Broken connection - serve what we have */
+			return TRUE;
+		}
+
+		/* Client closed its end */
+		if (bytes == 0) return TRUE;
+
+		c->req_len += bytes;
+		cl->atime = now;
+
+		if (conn_request_ready(cfg, c)) return TRUE;
+	}
+}
+
+
+/*
+ * Serve a fully received request
+ */
+static int client_serve(const config *cfg, shm_state *shm, int shmid,
+	int epfd, client *cl, time_t now)
+{
+	handle_request(cfg, &cl->c, shm, shmid);
+
+	/* A CGI child took over the connection */
+	if (cl->c.detached) return TRUE;
+
+	/* Throttled clients get their reply later */
+	if (cl->c.delay > 0) {
+		cl->wake = now + cl->c.delay;
+		client_wait(epfd, cl, STAGE_WAIT, 0);
+		return FALSE;
+	}
+
+	return client_write(epfd, cl, now);
+}
+
+
+/*
+ * Accept all pending connections
+ */
+static void accept_clients(int epfd, client **list, arena *mem, int sock, time_t now)
+{
+	int fd;
+
+	while ((fd = accept_client(sock)) != ERROR) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		if (client_open(epfd, list, mem, fd, now) == NULL) {
+			log_fatal("out of memory for a new connection");
+			close(fd);
+		}
+	}
+}
+
+
+/*
+ * Event loop worker - multiplexes any number of connections in one process
+ */
+void event_loop(const config *cfg, shm_state *shm, int shmid, int sock)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct epoll_event ev;
+	client *clients = NULL;
+	arena mem;
+	client *cl;
+	client *next;
+	time_t now;
+	time_t last = 0;
+	int epfd;
+	int num;
+	int i;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == ERROR) {
+		log_fatal("epoll_create1() failed in worker %i", (int) getpid());
+		return;
+	}
+
+	/* Requests are served one at a time so they can share an arena */
+	arena_init(&mem, ARENA_SIZE);
+
+	/* Accepting must never block the loop */
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	/* Wake up just one worker per new connection */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+	ev.events |= EPOLLEXCLUSIVE;
+#endif
+	ev.data.ptr = NULL;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev);
+
+	for (;;) {
+		if ((num = epoll_wait(epfd, events, MAX_EVENTS, 1000)) == ERROR) {
+			if (errno == EINTR) continue;
+
+			log_fatal("epoll_wait() failed in worker %i", (int) getpid());
+			break;
+		}
+
+		now = time(NULL);
+
+		for (i = 0; i < num; i++) {
+
+			/* New connections */
+			if ((cl = events[i].data.ptr) == NULL) {
+				accept_clients(epfd, &clients, &mem, sock, now);
+				continue;
+			}
+
+			/* Request arrived? */
+			if (cl->stage == STAGE_READ) {
+				if (!client_read(cfg, cl, now)) continue;
+				if (client_serve(cfg, shm, shmid, epfd, cl, now))
+					client_close(epfd, &clients, cl);
+				continue;
+			}
+
+			/* Client is ready for more */
+			if (cl->stage == STAGE_WRITE && client_write(epfd, cl, now))
+				client_close(epfd, &clients, cl);
+		}
+
+		/* Housekeeping once a second */
+		if (now == last) continue;
+		last = now;
+
+		for (cl = clients; cl; cl = next) {
+			next = cl->next;
+
+			/* Throttle delay over? */
+			if (cl->stage == STAGE_WAIT) {
+				if (now < cl->wake) continue;
+
+				cl->atime = now;
+				if (client_write(epfd, cl, now)) client_close(epfd, &clients, cl);
+				continue;
+			}
+
+			/* Drop stalled clients */
+			if ((now - cl->atime) > CONN_TIMEOUT) {
+				log_debug("dropping stalled connection from worker %i", (int) getpid());
+				client_close(epfd, &clients, cl);
+			}
+		}
+
+		reap_children();
+	}
+
+	/* Only reached on fatal errors */
+	while (clients) client_close(epfd, &clients, clients);
+	close(epfd);
+	arena_free(&mem);
+}
+
+#endif
@@ -0,0 +1,476 @@
+/*
+ * Gophernicus
+ *
+ * Copyright (c) 2009-2018 Kim Holviala <kimholviala@fastmail.com>
+ * Copyright (c) 2019 Gophernicus Developers <gophernicus@gophernicus.org>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include "gophernicus.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+
+/* FastCGI protocol, see the FastCGI 1.0 specification */
+#define FCGI_VERSION    1
+#define FCGI_BEGIN_REQUEST    1
+#define FCGI_END_REQUEST    3
+#define FCGI_PARAMS    4
+#define FCGI_STDIN    5
+#define FCGI_STDOUT    6
+#define FCGI_STDERR    7
+#define FCGI_RESPONDER    1
+#define FCGI_LISTENSOCK_FILENO    0
+#define FCGI_REQUEST_ID    1
+#define FCGI_MAX_CONTENT    65535
+
+typedef struct {
+	unsigned char version;
+	unsigned char type;
+	unsigned char id_b1;
+	unsigned char id_b0;
+	unsigned char length_b1;
+	unsigned char length_b0;
+	unsigned char padding;
+	unsigned char reserved;
+} fcgi_header;
+
+
+/*
+ * Check whether a script should run as a FastCGI application
+ */
+int fastcgi_script(state *st, char *script)
+{
+	size_t len;
+
+	if (!*st->cfg->fcgi_dir) return FALSE;
+
+	len = strlen(script);
+	return (len > sizeof(FCGI_SUFFIX) - 1 &&
+		strcmp(script + len - sizeof(FCGI_SUFFIX) + 1, FCGI_SUFFIX) == MATCH);
+}
+
+
+/*
+ * Get the socket path of an application
+ */
+static void fcgi_path(state *st, char *script, char *path, size_t size, const char *suffix)
+{
+	snprintf(path, size, "%s/fcgi-%016llx%s", st->cfg->fcgi_dir, strhash(script), suffix);
+}
+
+
+/*
+ * Write a whole buffer to a blocking socket
+ */
+static int write_all(int fd, const void *data, size_t len)
+{
+	ssize_t bytes;
+
+	while (len > 0) {
+		if ((bytes = write(fd, data, len)) == ERROR) {
+			if (errno == EINTR) continue;
+			return ERROR;
+		}
+		data = (const char *) data + bytes;
+		len -= bytes;
+	}
+	return OK;
+}
+
+
+/*
+ * Read exactly len bytes from a blocking socket
+ */
+static int read_all(int fd, void *data, size_t len)
+{
+	ssize_t bytes;
+
+	while (len > 0) {
+		if ((bytes = read(fd, data, len)) <= 0) {
+			if (bytes == ERROR && errno == EINTR) continue;
+			return ERROR;
+		}
+		data = (char *) data + bytes;
+		len -= bytes;
+	}
+	return OK;
+}
+
+
+/*
+ * Send one record to the application
+ */
+static int fcgi_record(int fd, int type, const void *data, size_t len)
+{
+	fcgi_header h;
+
+	h.version = FCGI_VERSION;
+	h.type = type;
+	h.id_b1 = 0;
+	h.id_b0 = FCGI_REQUEST_ID;
+	h.length_b1 = (len >> 8) & 0xff;
+	h.length_b0 = len & 0xff;
+	h.padding = 0;
+	h.reserved = 0;
+
+	if (write_all(fd, &h, sizeof(h)) == ERROR) return ERROR;
+	return write_all(fd, data, len);
+}
+
+
+/*
+ * Encode a name or value length
+ */
+static size_t fcgi_length(unsigned char *buf, size_t len)
+{
+	if (len < 128) {
+		buf[0] = len;
+		return 1;
+	}
+
+	buf[0] = ((len >> 24) & 0x7f) | 0x80;
+	buf[1] = (len >> 16) & 0xff;
+	buf[2] = (len >> 8) & 0xff;
+	buf[3] = len & 0xff;
+	return 4;
+}
+
+
+/*
+ * Send the CGI environment as name-value pairs
+ */
+static int fcgi_params(int fd, cgi_env *env, unsigned char *buf, size_t size)
+{
+	size_t used = 0;
+	size_t nlen;
+	size_t vlen;
+	char *c;
+	int i;
+
+	for (i = 0; i < env->count; i++) {
+		if ((c = strchr(env->vars[i], '=')) == NULL) continue;
+		nlen = c - env->vars[i];
+		vlen = strlen(c + 1);
+
+		/* Full record? */
+		if (used + nlen + vlen + 8 > size) {
+			if (fcgi_record(fd, FCGI_PARAMS, buf, used) == ERROR) return ERROR;
+			used = 0;
+		}
+
+		used += fcgi_length(buf + used, nlen);
+		used += fcgi_length(buf + used, vlen);
+		memcpy(buf + used, env->vars[i], nlen);
+		memcpy(buf + used + nlen, c + 1, vlen);
+		used += nlen + vlen;
+	}
+
+	if (used && fcgi_record(fd, FCGI_PARAMS, buf, used) == ERROR) return ERROR;
+	return fcgi_record(fd, FCGI_PARAMS, NULL, 0);
+}
+
+
+/*
+ * Connect to the socket of a running application
+ */
+static int fcgi_connect(char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	sstrlcpy(addr.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == ERROR) return ERROR;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == ERROR) {
+		close(fd);
+		return ERROR;
+	}
+	return fd;
+}
+
+
+/*
+ * Check whether an application still listens on its socket, without
+ * waiting for it - a full backlog means it's alive but busy
+ */
+static int fcgi_alive(char *path)
+{
+	struct sockaddr_un addr;
+	int alive;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	sstrlcpy(addr.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == ERROR) return FALSE;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	alive = (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == OK ||
+		errno == EAGAIN || errno == EINPROGRESS);
+
+	close(fd);
+	return alive;
+}
+
+
+/*
+ * Stop the processes of an application that has been replaced. Its
+ * process group can't have been reused by anybody else while one of
+ * them still listens on the socket.
+ */
+static void fcgi_stop(char *path)
+{
+	char pidfile[BUFSIZE];
+	FILE *fp;
+	int pgid;
+
+	snprintf(pidfile, sizeof(pidfile), "%s.pid", path);
+	if (fcgi_alive(path) && (fp = fopen(pidfile, "r"))) {
+		if (fscanf(fp, "%i", &pgid) == 1 && pgid > 1) kill(-pgid, SIGTERM);
+		fclose(fp);
+	}
+
+	unlink(pidfile);
+	unlink(path);
+}
+
+
+/*
+ * Get the environment we were started with, with a safe PATH
+ */
+static char **fcgi_envp(void)
+{
+	extern char **environ;
+	char **envp;
+	char **e;
+	int n = 0;
+
+	for (e = environ; *e; e++) n++;
+	if ((envp = malloc(sizeof(char *) * (n + 2))) == NULL) return NULL;
+
+	n = 0;
+	for (e = environ; *e; e++)
+		if (sstrncmp(*e, "PATH=") != MATCH) envp[n++] = *e;
+
+	envp[n++] = "PATH=" SAFE_PATH;
+	envp[n] = NULL;
+	return envp;
+}
+
+
+/*
+ * Start the processes of an application listening on a new socket
+ */
+static int fcgi_spawn(state *st, char *script, char *path)
+{
+	struct sockaddr_un addr;
+	char pidfile[BUFSIZE];
+	char *argv[2];
+	char **envp;
+	FILE *fp;
+	pid_t pid;
+	int sock;
+	int fd;
+	int i;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	sstrlcpy(addr.sun_path, path);
+
+	if ((envp = fcgi_envp()) == NULL) return ERROR;
+
+	/* Listen before starting so requests can queue up right away */
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == ERROR ||
+	    bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == ERROR ||
+	    listen(sock, LISTEN_BACKLOG) == ERROR) {
+		if (sock != ERROR) close(sock);
+		free(envp);
+		return ERROR;
+	}
+
+	log_info("starting FastCGI application \"%s\"", script);
+
+	argv[0] = script;
+	argv[1] = NULL;
+
+	if ((pid = fork()) == ERROR) {
+		close(sock);
+		unlink(path);
+		free(envp);
+		return ERROR;
+	}
+
+	/*
+	 * Middle child - a new process group for the applications, then exit.
+	 * Our parent may be threaded, so nothing here may allocate memory.
+	 */
+	if (pid == 0) {
+		setsid();
+		if (fchdir(st->req_dirfd) == ERROR) _exit(EXIT_FAILURE);
+
+		if ((fd = open("/dev/null", O_RDWR)) != ERROR) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		dup2(sock, FCGI_LISTENSOCK_FILENO);
+
+		for (fd = STDERR_FILENO + 1; fd < getdtablesize(); fd++) close(fd);
+
+		signal(SIGPIPE, SIG_DFL);
+
+		for (i = 0; i < FCGI_PROCESSES; i++) {
+			if (fork() == 0) {
+				execve(script, argv, envp);
+				_exit(127);
+			}
+		}
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(sock);
+	waitpid(pid, NULL, 0);
+
+	/* The process group is the middle child */
+	snprintf(pidfile, sizeof(pidfile), "%s.pid", path);
+	if ((fp = fopen(pidfile, "w"))) {
+		fprintf(fp, "%i\n", (int) pid);
+		fclose(fp);
+	}
+
+	free(envp);
+	return OK;
+}
+
+
+/*
+ * Get a connection to the application of a script, starting it if
+ * it's not running or the script has changed since
+ */
+static int fcgi_open(state *st, char *script)
+{
+	struct stat sock;
+	struct stat file;
+	char path[BUFSIZE];
+	char lock[BUFSIZE];
+	int lockfd;
+	int fd;
+
+	fcgi_path(st, script, path, sizeof(path), EMPTY);
+	fcgi_path(st, script, lock, sizeof(lock), ".lock");
+
+	if (stat(script, &file) == ERROR) return ERROR;
+
+	/* Usually it's just there */
+	if (lstat(path, &sock) == OK &&
+	    file.st_mtime < sock.st_mtime &&
+	    (fd = fcgi_connect(path)) != ERROR) return fd;
+
+	/* One process at a time gets to replace the application */
+	if ((lockfd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == ERROR) return ERROR;
+	flock(lockfd, LOCK_EX);
+
+	if (lstat(path, &sock) == OK && file.st_mtime < sock.st_mtime) {
+		if ((fd = fcgi_connect(path)) != ERROR) goto unlock;
+
+		/* Still running but didn't answer - just busy, leave it be */
+		if (fcgi_alive(path)) goto unlock;
+	}
+
+	/* Dead, changed or never started */
+	fcgi_stop(path);
+	fd = ERROR;
+	if (fcgi_spawn(st, script, path) == OK) fd = fcgi_connect(path);
+
+unlock:
+	flock(lockfd, LOCK_UN);
+	close(lockfd);
+	return fd;
+}
+
+
+/*
+ * Run a CGI request through a persistent FastCGI application - returns
+ * ERROR if the application couldn't be reached and the script should
+ * run the classic way instead
+ */
+int fastcgi_request(state *st, char *script)
+{
+	conn *c = st->conn;
+	struct timeval tv;
+	fcgi_header h;
+	cgi_env env;
+	size_t len;
+	char *buf;
+	int fd;
+
+	/* Room for one record and the end of a log line */
+	if ((buf = arena_alloc(c->arena, FCGI_MAX_CONTENT + 256)) == NULL) return ERROR;
+	if ((fd = fcgi_open(st, script)) == ERROR) return ERROR;
+	log_debug("passing request to FastCGI application \"%s\"", script);
+
+	/* Don't wait forever for a stuck application */
+	tv.tv_sec = CONN_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	/* Begin a responder request that closes the connection when done */
+	memset(buf, 0, 8);
+	buf[1] = FCGI_RESPONDER;
+
+	cgi_environment(st, script, &env);
+	if (fcgi_record(fd, FCGI_BEGIN_REQUEST, buf, 8) == ERROR ||
+	    fcgi_params(fd, &env, (unsigned char *) buf, FCGI_MAX_CONTENT) == ERROR ||
+	    fcgi_record(fd, FCGI_STDIN, NULL, 0) == ERROR) {
+		close(fd);
+		return ERROR;
+	}
+
+	/* Stream the output to the client */
+	while (read_all(fd, &h, sizeof(h)) == OK) {
+		len = ((size_t) h.length_b1 << 8 | h.length_b0) + h.padding;
+		if (read_all(fd, buf, len) == ERROR) break;
+		len -= h.padding;
+
+		if (h.type == FCGI_STDOUT) conn_write(c, buf, len);
+		if (h.type == FCGI_STDERR && len > 0) {
+			buf[len] = '\0';
+			chomp(buf);
+			log_info("FastCGI application \"%s\": %s", script, buf);
+		}
+		if (h.type == FCGI_END_REQUEST) break;
+	}
+
+	close(fd);
+	conn_flush(c);
+	return OK;
+}
@@ -27,38 +27,141 @@
  */
 
 
+/* Changing directory in posix_spawn() needs the GNU extensions of glibc */
+#ifdef __linux
+#define _GNU_SOURCE
+#endif
+
 #include "gophernicus.h"
 
+#include <sys/resource.h>
+
+#ifdef HAVE_SPAWN
+#include <spawn.h>
+#endif
+
 
 /*
  * Send a binary file to the client
  */
 void send_binary_file(state *st)
 {
-	/* Faster sendfile() version */
-#ifdef HAVE_SENDFILE
+	conn *c = st->conn;
 	int fd;
-	off_t offset = 0;
 
 	log_debug("send binary file \"%s\"", st->req_realpath);
 
-	if ((fd = open(st->req_realpath, O_RDONLY)) == ERROR) return;
-	sendfile(1, fd, &offset, st->req_filesize);
-	close(fd);
+	if ((fd = file_cache_open(st, st->req_realpath)) == ERROR) return;
 
-	/* More compatible POSIX fread()/fwrite() version */
-#else
-	FILE *fp;
-	char buf[BUFSIZE];
-	int bytes;
+	/* The file is sent by conn_flush() */
+	conn_sendfile(c, fd, 0, st->req_filesize);
+}
 
-	log_debug("send binary file \"%s\"", st->req_realpath);
 
-	if ((fp = fopen(st->req_realpath , "r")) == NULL) return;
-	while ((bytes = fread(buf, 1, sizeof(buf), fp)) > 0)
-		fwrite(buf, bytes, 1, stdout);
-	fclose(fp);
+/*
+ * Convert a whole text file for sending - one line at a time, however
+ * long, with CRLF line endings in the output charset. Sets *plain if
+ * the output is the same as the file.
+ */
+static int convert_text(state *st, FILE *in, FILE *out, int *plain)
+{
+	char *line = NULL;
+	char *buf = NULL;
+	size_t line_size = 0;
+	size_t buf_size = 0;
+	ssize_t len;
+	ssize_t i;
+	char *c;
+
+	*plain = TRUE;
+
+	while ((len = getline(&line, &line_size, in)) > 0) {
+
+		/* Already CRLF and nothing else to do? */
+		if (len < 2 || line[len - 2] != '\r' || line[len - 1] != '\n') *plain = FALSE;
+		for (i = 0; *plain && i < len; i++)
+			if (line[i] == '\0' || (st->cfg->opt_iconv && (line[i] & 0x80))) *plain = FALSE;
+
+		if (line[len - 1] == '\n') line[--len] = '\0';
+		if (len > 0 && line[len - 1] == '\r') line[--len] = '\0';
+
+		/* UTF-8 at most doubles ISO-8859-1 */
+		if (st->cfg->opt_iconv) {
+			if (buf_size < (size_t) len * 2 + 1) {
+				if ((c = realloc(buf, len * 2 + 1)) == NULL) break;
+				buf = c;
+				buf_size = len * 2 + 1;
+			}
+			strniconv(st->cfg->out_charset, buf, line, buf_size);
+			c = buf;
+		}
+		else c = line;
+
+#ifdef ENABLE_STRICT_RFC1436
+		if (strcmp(c, ".") == MATCH) fputc('.', out);
 #endif
+		fputs(c, out);
+		fputs(CRLF, out);
+	}
+
+#ifdef ENABLE_STRICT_RFC1436
+	fputs("." CRLF, out);
+	*plain = FALSE;
+#endif
+
+	len = (ferror(in) || ferror(out) || !feof(in)) ? ERROR : OK;
+	if (line) free(line);
+	if (buf) free(buf);
+	return len;
+}
+
+
+/*
+ * Send a text file converted earlier - returns ERROR if there's no
+ * cache directory to keep the converted text in
+ */
+static int send_text_variant(state *st)
+{
+	conn *c = st->conn;
+	struct stat file;
+	char tmp[BUFSIZE];
+	FILE *in;
+	FILE *out;
+	off_t start;
+	int plain;
+	int fd;
+
+	if (file_cache_stat(st, st->req_realpath, &file) == ERROR) return ERROR;
+
+	/* Convert the file once per modification & charset */
+	if ((fd = text_cache_get(st, &file, &start, &plain)) == ERROR) {
+		if ((in = fopen(st->req_realpath, "re")) == NULL) return ERROR;
+
+		if ((out = text_cache_create(st, &file, tmp, sizeof(tmp))) == NULL) {
+			fclose(in);
+			return ERROR;
+		}
+
+		log_debug("converting text file \"%s\"", st->req_realpath);
+		if (convert_text(st, in, out, &plain) == ERROR) plain = ERROR;
+		text_cache_commit(st, &file, tmp, out, plain);
+		fclose(in);
+
+		if ((fd = text_cache_get(st, &file, &start, &plain)) == ERROR) return ERROR;
+	}
+
+	/* Nothing to convert - send the file itself */
+	if (plain) {
+		close(fd);
+		send_binary_file(st);
+		return OK;
+	}
+
+	log_debug("sending converted text file \"%s\"", st->req_realpath);
+
+	/* The text is sent by conn_flush() */
+	conn_sendfile(c, fd, start, lseek(fd, 0, SEEK_END));
+	return OK;
 }
 
 
@@ -67,45 +170,99 @@ void send_binary_file(state *st)
  */
 void send_text_file(state *st)
 {
+	conn *c = st->conn;
 	FILE *fp;
-	char in[BUFSIZE];
-	char out[BUFSIZE];
-	int line;
+
+	/* Ready-made text from the cache directory? */
+	if (*st->cfg->cache_dir && send_text_variant(st) == OK) return;
 
 	log_debug("sending text file \"%s\"", st->req_realpath);
 
-	if ((fp = fopen(st->req_realpath , "r")) == NULL) return;
+	if ((fp = fopen(st->req_realpath , "re")) == NULL) return;
 
-	/* Loop through the file line by line */
-	line = 0;
+	/* The file is converted and sent by conn_flush() */
+	c->text = fp;
+	c->text_charset = st->cfg->out_charset;
+	c->text_iconv = st->cfg->opt_iconv;
+	c->text_partial = FALSE;
+}
 
-	while (fgets(in, sizeof(in), fp)) {
 
-		/* Covert to output charset & print */
-		if (st->opt_iconv) sstrniconv(st->out_charset, out, in);
-		else sstrlcpy(out, in);
+/*
+ * Length of an unfinished UTF-8 char at the end of a buffer
+ */
+static size_t utf8_tail(const char *buf, size_t len)
+{
+	unsigned char ch;
+	size_t n;
 
-		chomp(out);
+	for (n = 1; n <= 3 && n <= len; n++) {
+		ch = (unsigned char) buf[len - n];
 
+		if ((ch & 0xc0) == 0x80) continue;
+		if ((ch & 0xe0) == 0xc0) return (n < 2) ? n : 0;
+		if ((ch & 0xf0) == 0xe0) return (n < 3) ? n : 0;
+		if ((ch & 0xf8) == 0xf0) return n;
+		break;
+	}
+	return 0;
+}
+
+
+/*
+ * Convert the next buffer-full of a text file being sent
+ */
+void send_text_chunk(conn *c)
+{
+	char in[BUFSIZE];
+	char out[BUFSIZE * 2];
+	size_t len;
+	size_t tail;
+	int partial;
+
+	/* Loop through the file line by line */
+	while (c->len < OUTBUFSIZE / 2) {
+		if (!fgets(in, sizeof(in), c->text)) {
 #ifdef ENABLE_STRICT_RFC1436
-		if (strcmp(out, ".") == MATCH) printf(".." CRLF);
-		else
+			conn_printf(c, "." CRLF);
 #endif
-		printf("%s" CRLF, out);
-		line++;
-	}
+			fclose(c->text);
+			c->text = NULL;
+			return;
+		}
+
+		/* Lines longer than the buffer continue in the next round */
+		len = strlen(in);
+		partial = (len == sizeof(in) - 1 && in[len - 1] != '\n');
+
+		/* Leave a char split by the buffer for the next round */
+		if (partial && c->text_iconv && (tail = utf8_tail(in, len)) &&
+		    fseek(c->text, -(long) tail, SEEK_CUR) == OK) in[len - tail] = '\0';
+
+		/* Covert to output charset & print (UTF-8 at most doubles it) */
+		if (c->text_iconv) sstrniconv(c->text_charset, out, in);
+		else sstrlcpy(out, in);
 
+		if (partial) {
+			conn_printf(c, "%s", out);
+			c->text_partial = TRUE;
+			continue;
+		}
+
+		chomp(out);
 #ifdef ENABLE_STRICT_RFC1436
-	printf("." CRLF);
+		if (!c->text_partial && strcmp(out, ".") == MATCH) conn_printf(c, ".");
 #endif
-	fclose(fp);
+		c->text_partial = FALSE;
+		conn_printf(c, "%s" CRLF, out);
+	}
 }
 
 
 /*
  * Print hURL redirect page
  */
-void url_redirect(state *st)
+int url_redirect(state *st)
 {
 	char unsafe[BUFSIZE];
 
@@ -121,10 +278,10 @@ void url_redirect(state *st)
 		sstrncmp(dest, "ftp://") != MATCH &&
 		sstrncmp(dest, "irc://") != MATCH &&
 		sstrncmp(dest, "mailto:") != MATCH)
-		die(st, ERR_ACCESS, "Refusing to HTTP redirect unsafe protocols");
+		return die(st, ERR_ACCESS, "Refusing to HTTP redirect unsafe protocols");
 
 	log_info("request for \"gopher%s://%s:%i/h%s\" from %s",
-	         st->server_port == st->server_tls_port ? "s" : "",
+	         st->server_port == st->cfg->server_tls_port ? "s" : "",
 	         st->server_host,
 	         st->server_port,
 	         st->req_selector,
@@ -133,7 +290,7 @@ void url_redirect(state *st)
 	log_combined(st, HTTP_OK);
 
 	/* Output HTML */
-	printf("<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 3.2 Final//EN\">\n"
+	conn_printf(st->conn, "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 3.2 Final//EN\">\n"
 		"<HTML>\n<HEAD>\n"
 		"  <META HTTP-EQUIV=\"Refresh\" content=\"1;URL=%1$s\">\n"
 		"  <META HTTP-EQUIV=\"Content-Type\" CONTENT=\"text/html;charset=iso-8859-1\">\n"
@@ -142,7 +299,8 @@ void url_redirect(state *st)
 		"<STRONG>Redirecting to <A HREF=\"%1$s\">%1$s</A></STRONG>\n"
 		"<PRE>\n", dest);
 	footer(st);
-	printf("</PRE>\n</BODY>\n</HTML>\n");
+	conn_printf(st->conn, "</PRE>\n</BODY>\n</HTML>\n");
+	return OK;
 }
 
 
@@ -153,13 +311,16 @@ void url_redirect(state *st)
 void server_status(state *st, shm_state *shm, int shmid)
 {
 	struct shmid_ds shm_ds;
+	shm_session copy;
 	time_t now;
 	time_t uptime;
+	long hits;
+	long kbytes;
 	int sessions;
 	int i;
 
 	log_info("request for \"gopher%s://%s:%i/0" SERVER_STATUS "\" from %s",
-	         st->server_port == st->server_tls_port ? "s" : "",
+	         st->server_port == st->cfg->server_tls_port ? "s" : "",
 	         st->server_host,
 	         st->server_port,
 	         st->req_remote_addr);
@@ -169,9 +330,12 @@ void server_status(state *st, shm_state *shm, int shmid)
 	/* Quit if shared memory isn't initialized yet */
 	if (!shm) return;
 
-	/* Update counters */
-	shm->hits++;
-	shm->kbytes += 1;
+	/* Update counters, the data is counted once it's been sent */
+	shm_count(shm, 1, 0);
+	st->conn->shm = shm;
+	st->req_filetype = TYPE_TEXT;
+	update_shm_session(st, shm);
+	read_shm_counters(shm, &hits, &kbytes);
 
 	/* Get server uptime */
 	now = time(NULL);
@@ -181,7 +345,7 @@ void server_status(state *st, shm_state *shm, int shmid)
 	shmctl(shmid, IPC_STAT, &shm_ds);
 
 	/* Print statistics */
-	printf("Total Accesses: %li" CRLF
+	conn_printf(st->conn, "Total Accesses: %li" CRLF
 		"Total kBytes: %li" CRLF
 		"Uptime: %i" CRLF
 		"ReqPerSec: %.3f" CRLF
@@ -190,38 +354,43 @@ void server_status(state *st, shm_state *shm, int shmid)
 		"BusyServers: %i" CRLF
 		"IdleServers: 0" CRLF
 		"CPULoad: %.2f" CRLF,
-			shm->hits,
-			shm->kbytes,
+			hits,
+			kbytes,
 			(int) uptime,
-			(float) shm->hits / (float) uptime,
-			shm->kbytes * 1024 / (int) uptime,
-			shm->kbytes * 1024 / (shm->hits + 1),
+			(float) hits / (float) uptime,
+			kbytes * 1024 / (int) uptime,
+			kbytes * 1024 / (hits + 1),
 			(int) shm_ds.shm_nattch,
 			loadavg());
 
+	/* Print CGI job counters */
+	jobs_status(st);
+
 	/* Print active sessions */
 	sessions = 0;
 
-	for (i = 0; i < SHM_SESSIONS; i++) {
-		if ((now - shm->session[i].req_atime) < st->session_timeout) {
+	for (i = 0; i < shm->sessions; i++) {
+		if (read_shm_session(shm, i, &copy) == ERROR) continue;
+
+		if ((now - copy.req_atime) < st->cfg->session_timeout) {
 			sessions++;
 
-			if (st->debug) {
-				printf("Session: %-4i %-40s %-4li %-7li gopher%s://%s:%i/%c%s" CRLF,
-					(int) (now - shm->session[i].req_atime),
-					shm->session[i].req_remote_addr,
-					shm->session[i].hits,
-					shm->session[i].kbytes,
-					(shm->session[i].server_port == st->server_tls_port ? "s" : ""),
-					shm->session[i].server_host,
-					shm->session[i].server_port,
-					shm->session[i].req_filetype,
-					shm->session[i].req_selector);
+			if (st->cfg->debug) {
+				conn_printf(st->conn, "Session: %-4i %-40s %-4li %-7li gopher%s://%s:%i/%c%s" CRLF,
+					(int) (now - copy.req_atime),
+					copy.req_remote_addr,
+					copy.hits,
+					copy.kbytes,
+					(copy.server_port == st->cfg->server_tls_port ? "s" : ""),
+					copy.server_host,
+					copy.server_port,
+					copy.req_filetype,
+					copy.req_selector);
 			}
 		}
 	}
 
-	printf("Total Sessions: %i" CRLF, sessions);
+	conn_printf(st->conn, "Total Sessions: %i" CRLF, sessions);
 }
 #endif
 
@@ -232,27 +401,26 @@ void server_status(state *st, shm_state *shm, int shmid)
 void caps_txt(state *st, shm_state *shm)
 {
 	log_info("request for \"gopher%s://%s:%i/0" CAPS_TXT "\" from %s",
-	         st->server_port == st->server_tls_port ? "s" : "",
+	         st->server_port == st->cfg->server_tls_port ? "s" : "",
 	         st->server_host,
 	         st->server_port,
 	         st->req_remote_addr);
 
 	log_combined(st, HTTP_OK);
 
-	/* Update counters */
+	/* Update counters, the data is counted once it's been sent */
 #ifdef HAVE_SHMEM
 	if (shm) {
-		shm->hits++;
-		shm->kbytes += 1;
+		shm_count(shm, 1, 0);
+		st->conn->shm = shm;
 
 		/* Update session data */
-		st->req_filesize += 1024;
 		update_shm_session(st, shm);
 	}
 #endif
 
 	/* Standard caps.txt stuff */
-	printf("CAPS" CRLF
+	conn_printf(st->conn, "CAPS" CRLF
 		CRLF
 		"##" CRLF
 		"## This is an automatically generated caps file." CRLF
@@ -273,119 +441,573 @@ void caps_txt(state *st, shm_state *shm)
 		"ServerSoftware=" SERVER_SOFTWARE CRLF
 		"ServerSoftwareVersion=" VERSION " \"" CODENAME "\"" CRLF
 		"ServerArchitecture=%s" CRLF,
-			st->session_timeout,
-			strcharset(st->out_charset),
-			st->server_tls_port,
-			st->server_platform);
+			st->cfg->session_timeout,
+			strcharset(st->cfg->out_charset),
+			st->cfg->server_tls_port,
+			st->cfg->server_platform);
 
 	/* Optional keys */
-	if (*st->server_description)
-		printf("ServerDescription=%s" CRLF, st->server_description);
-	if (*st->server_location)
-		printf("ServerGeolocationString=%s" CRLF, st->server_location);
-	if (*st->server_admin)
-		printf("ServerAdmin=%s" CRLF, st->server_admin);
+	if (*st->cfg->server_description)
+		conn_printf(st->conn, "ServerDescription=%s" CRLF, st->cfg->server_description);
+	if (*st->cfg->server_location)
+		conn_printf(st->conn, "ServerGeolocationString=%s" CRLF, st->cfg->server_location);
+	if (*st->cfg->server_admin)
+		conn_printf(st->conn, "ServerAdmin=%s" CRLF, st->cfg->server_admin);
+}
+
+
+/*
+ * Add a variable to a CGI environment
+ */
+static void env_set(cgi_env *env, const char *name, const char *value)
+{
+	size_t len;
+
+	len = strlen(name) + strlen(value) + 2;
+	if (env->count >= MAX_CGI_ENV || env->used + len > sizeof(env->buf)) return;
+
+	snprintf(env->buf + env->used, len, "%s=%s", name, value);
+	env->vars[env->count++] = env->buf + env->used;
+	env->vars[env->count] = NULL;
+	env->used += len;
 }
 
 
 /*
- * Setup environment variables as per the CGI spec
+ * Build the environment of a script as per the CGI spec
  */
-void setenv_cgi(state *st, char *script)
+void cgi_environment(state *st, char *script, cgi_env *env)
 {
 	char buf[BUFSIZE];
 
+	env->count = 0;
+	env->used = 0;
+	env->vars[0] = NULL;
+
 	/* Security */
-	setenv("PATH", SAFE_PATH, 1);
+	env_set(env, "PATH", SAFE_PATH);
 
 	/* Set up the environment as per CGI spec */
-	setenv("GATEWAY_INTERFACE", "CGI/1.1", 1);
-	setenv("CONTENT_LENGTH", "0", 1);
-	setenv("QUERY_STRING", st->req_query_string, 1);
-	snprintf(buf, sizeof(buf), SERVER_SOFTWARE_FULL, st->server_platform);
-	setenv("SERVER_SOFTWARE", buf, 1);
-	setenv("SERVER_ARCH", st->server_platform, 1);
-	setenv("SERVER_DESCRIPTION", st->server_description, 1);
+	env_set(env, "GATEWAY_INTERFACE", "CGI/1.1");
+	env_set(env, "CONTENT_LENGTH", "0");
+	env_set(env, "QUERY_STRING", st->req_query_string);
+	snprintf(buf, sizeof(buf), SERVER_SOFTWARE_FULL, st->cfg->server_platform);
+	env_set(env, "SERVER_SOFTWARE", buf);
+	env_set(env, "SERVER_ARCH", st->cfg->server_platform);
+	env_set(env, "SERVER_DESCRIPTION", st->cfg->server_description);
 	snprintf(buf, sizeof(buf), SERVER_SOFTWARE "/" VERSION);
-	setenv("SERVER_VERSION", buf, 1);
+	env_set(env, "SERVER_VERSION", buf);
 
 	if (st->req_protocol == PROTO_HTTP)
-		setenv("SERVER_PROTOCOL", "HTTP/0.9", 1);
+		env_set(env, "SERVER_PROTOCOL", "HTTP/0.9");
 	else
-		setenv("SERVER_PROTOCOL", "RFC1436", 1);
+		env_set(env, "SERVER_PROTOCOL", "RFC1436");
 
-	if (st->server_port == st->server_tls_port) {
-		setenv("HTTPS", "on", 1);
-		setenv("TLS", "on", 1);
+	if (st->server_port == st->cfg->server_tls_port) {
+		env_set(env, "HTTPS", "on");
+		env_set(env, "TLS", "on");
 	}
 
-	setenv("SERVER_NAME", st->server_host, 1);
+	env_set(env, "SERVER_NAME", st->server_host);
 	snprintf(buf, sizeof(buf), "%i", st->server_port);
-	setenv("SERVER_PORT", buf, 1);
-	snprintf(buf, sizeof(buf), "%i", st->server_tls_port);
-	setenv("SERVER_TLS_PORT", buf, 1);
-	setenv("REQUEST_METHOD", "GET", 1);
-	setenv("DOCUMENT_ROOT", st->server_root, 1);
-	setenv("SCRIPT_NAME", st->req_selector, 1);
-	setenv("SCRIPT_FILENAME", script, 1);
-	setenv("LOCAL_ADDR", st->req_local_addr, 1);
-	setenv("REMOTE_ADDR", st->req_remote_addr, 1);
-	setenv("HTTP_REFERER", st->req_referrer, 1);
+	env_set(env, "SERVER_PORT", buf);
+	snprintf(buf, sizeof(buf), "%i", st->cfg->server_tls_port);
+	env_set(env, "SERVER_TLS_PORT", buf);
+	env_set(env, "REQUEST_METHOD", "GET");
+	env_set(env, "DOCUMENT_ROOT", st->cfg->server_root);
+	env_set(env, "SCRIPT_NAME", st->req_selector);
+	env_set(env, "SCRIPT_FILENAME", script);
+	env_set(env, "LOCAL_ADDR", st->req_local_addr);
+	env_set(env, "REMOTE_ADDR", st->req_remote_addr);
+	env_set(env, "HTTP_REFERER", st->req_referrer);
 #ifdef HAVE_SHMEM
 	snprintf(buf, sizeof(buf), "%x", st->session_id);
-	setenv("SESSION_ID", buf, 1);
+	env_set(env, "SESSION_ID", buf);
 #endif
-	setenv("HTTP_ACCEPT_CHARSET", strcharset(st->out_charset), 1);
+	env_set(env, "HTTP_ACCEPT_CHARSET", strcharset(st->cfg->out_charset));
 
 	/* Gophernicus extras */
 	snprintf(buf, sizeof(buf), "%c", st->req_filetype);
-	setenv("GOPHER_FILETYPE", buf, 1);
-	setenv("GOPHER_CHARSET", strcharset(st->out_charset), 1);
-	setenv("GOPHER_REFERER", st->req_referrer, 1);
-	snprintf(buf, sizeof(buf), "%i", st->out_width);
-	setenv("COLUMNS", buf, 1);
+	env_set(env, "GOPHER_FILETYPE", buf);
+	env_set(env, "GOPHER_CHARSET", strcharset(st->cfg->out_charset));
+	env_set(env, "GOPHER_REFERER", st->req_referrer);
+	snprintf(buf, sizeof(buf), "%i", st->cfg->out_width);
+	env_set(env, "COLUMNS", buf);
 	snprintf(buf, sizeof(buf), CODENAME);
-	setenv("SERVER_CODENAME", buf, 1);
+	env_set(env, "SERVER_CODENAME", buf);
 
 	/* Bucktooth extras */
 	if (*st->req_query_string) {
 		snprintf(buf, sizeof(buf), "%s?%s",
 			st->req_selector, st->req_query_string);
-		setenv("SELECTOR", buf, 1);
+		env_set(env, "SELECTOR", buf);
 	}
-	else setenv("SELECTOR", st->req_selector, 1);
+	else env_set(env, "SELECTOR", st->req_selector);
 
-	setenv("SERVER_HOST", st->server_host, 1);
-	setenv("REQUEST", st->req_selector, 1);
-	setenv("SEARCHREQUEST", st->req_search, 1);
+	env_set(env, "SERVER_HOST", st->server_host);
+	env_set(env, "REQUEST", st->req_selector);
+	env_set(env, "SEARCHREQUEST", st->req_search);
 }
 
 
 /*
- * Execute a CGI script
+ * Put the CGI variables on top of the environment we were started with
+ */
+static char **cgi_envp(cgi_env *env)
+{
+	extern char **environ;
+	char **envp;
+	char **e;
+	size_t len;
+	int n = 0;
+	int i;
+
+	for (e = environ; *e; e++) n++;
+	if ((envp = malloc(sizeof(char *) * (n + env->count + 1))) == NULL) return NULL;
+
+	n = 0;
+	for (e = environ; *e; e++) {
+
+		/* Only set by us for TLS requests */
+		if (strncmp(*e, "HTTPS=", 6) == MATCH || strncmp(*e, "TLS=", 4) == MATCH) continue;
+
+		len = strcspn(*e, "=") + 1;
+		for (i = 0; i < env->count; i++)
+			if (strncmp(*e, env->vars[i], len) == MATCH) break;
+
+		if (i == env->count) envp[n++] = *e;
+	}
+
+	for (i = 0; i < env->count; i++) envp[n++] = env->vars[i];
+	envp[n] = NULL;
+
+	return envp;
+}
+
+
+/*
+ * Replace this process with a script running in the CGI environment
+ */
+static void exec_cgi(state *st, char *script, char *const argv[])
+{
+	cgi_env env;
+	char **envp;
+
+	cgi_environment(st, script, &env);
+	if ((envp = cgi_envp(&env))) {
+		execve(argv[0], argv, envp);
+		free(envp);
+	}
+}
+
+
+/*
+ * Apply the resource limits of CGI scripts to ourselves
  */
-static void run_cgi(state *st, char *script, char *arg)
+static void cgi_rlimits(state *st)
 {
-	if (st->opt_exec) {
+	struct rlimit cpu;
+	struct rlimit mem;
+
+	/* SIGXCPU first, SIGKILL a second later */
+	cpu.rlim_cur = st->cfg->cgi_cpu;
+	cpu.rlim_max = st->cfg->cgi_cpu + 1;
+	mem.rlim_cur = mem.rlim_max = (rlim_t) st->cfg->cgi_mbytes * 1024 * 1024;
+
+	if (st->cfg->cgi_cpu > 0) setrlimit(RLIMIT_CPU, &cpu);
+	if (st->cfg->cgi_mbytes > 0) setrlimit(RLIMIT_AS, &mem);
+}
 
-		/* Setup environment & execute the binary */
-		log_debug("executing script \"%s\"", script);
 
-		setenv_cgi(st, script);
-		execl(script, script, arg, NULL);
-	} else {
+/*
+ * Open a pipe whose ends aren't inherited by any script - only the
+ * copy spawn_cgi() puts on a child's stdin/stdout survives the exec
+ */
+int pipe_cloexec(int fds[2])
+{
+#ifdef HAVE_ACCEPT4
+	return pipe2(fds, O_CLOEXEC);
+#else
+	if (pipe(fds) == ERROR) return ERROR;
+
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return OK;
+#endif
+}
+
+
+/*
+ * Start argv[0] as a script in the request directory with the CGI
+ * environment and in/out as its stdin/stdout - returns the pid, or
+ * ERROR with errno set when it couldn't be executed. Limited
+ * scripts get a process group of their own and the CGI rlimits, which
+ * must be in place before the exec so they're set in a forked child.
+ */
+pid_t spawn_cgi(state *st, char *script, char *const argv[], int in, int out, int limit)
+{
+#ifdef HAVE_SPAWN
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+#endif
+	sigset_t sigs;
+	cgi_env env;
+	char **envp;
+	ssize_t len;
+	pid_t pid;
+	int err[2];
+	int code;
+
+	cgi_environment(st, script, &env);
+	if ((envp = cgi_envp(&env)) == NULL) return ERROR;
+
+#ifdef HAVE_SPAWN
+	/* No copy of our address space, however big the worker has grown */
+	if (!limit || (st->cfg->cgi_cpu <= 0 && st->cfg->cgi_mbytes <= 0)) goto spawn;
+#endif
+
+	/* The child reports a failed exec here, like posix_spawn() does */
+	if (pipe_cloexec(err) == ERROR) {
+		free(envp);
+		return ERROR;
+	}
+
+	/* Only async-signal-safe calls in the child, we may have threads */
+	if ((pid = fork()) == 0) {
+		close(err[0]);
+		if (in != STDIN_FILENO) dup2(in, STDIN_FILENO);
+		if (out != STDOUT_FILENO) dup2(out, STDOUT_FILENO);
+
+		signal(SIGPIPE, SIG_DFL);
+		sigemptyset(&sigs);
+		sigprocmask(SIG_SETMASK, &sigs, NULL);
+		if (limit) {
+			setpgid(0, 0);
+			cgi_rlimits(st);
+		}
+
+		if (fchdir(st->req_dirfd) == OK) execve(argv[0], argv, envp);
+
+		code = errno;
+		if (write(err[1], &code, sizeof(code)) != sizeof(code)) _exit(126);
+		_exit(127);
+	}
+
+	/* The pipe closes without a word once the exec succeeds */
+	close(err[1]);
+	len = 0;
+	while (pid > 0 && (len = read(err[0], &code, sizeof(code))) == ERROR && errno == EINTR);
+	close(err[0]);
+	free(envp);
+
+	if (len == sizeof(code)) {
+		waitpid(pid, NULL, 0);
+		errno = code;
+		return ERROR;
+	}
+	return pid;
+
+#ifdef HAVE_SPAWN
+spawn:
+	posix_spawn_file_actions_init(&actions);
+	if (in != STDIN_FILENO) posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+	if (out != STDOUT_FILENO) posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+	posix_spawn_file_actions_addfchdir_np(&actions, st->req_dirfd);
+
+	posix_spawnattr_init(&attr);
+	sigemptyset(&sigs);
+	posix_spawnattr_setsigmask(&attr, &sigs);
+	sigaddset(&sigs, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigs);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF |
+		(limit ? POSIX_SPAWN_SETPGROUP : 0));
+	posix_spawnattr_setpgroup(&attr, 0);
+
+	if ((errno = posix_spawn(&pid, argv[0], &actions, &attr, argv, envp)) != OK) pid = ERROR;
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	free(envp);
+	return pid;
+#endif
+}
+
+
+/*
+ * Execute a CGI script
+ */
+static int run_cgi(state *st, char *script, char *arg)
+{
+	conn *c = st->conn;
+	char *argv[3];
+	pid_t pid;
+	int flags;
+	int fcgi;
+	int fd;
+	int slot = ERROR;
+
+	if (!st->cfg->opt_exec) {
 		log_debug("execution of script \"%s\" blocked by `-nx'", script);
+		return die(st, ERR_ACCESS, "");
+	}
+
+	argv[0] = script;
+	argv[1] = arg;
+	argv[2] = NULL;
+
+	/* Persistent applications have a pool of their own */
+	fcgi = (!arg && fastcgi_script(st, script));
+
+	/* Threads can't fork safely, so they talk to the application themselves */
+	if (fcgi && st->cfg->opt_daemon && st->cfg->daemon_engine == ENGINE_THREAD) {
+		if (fastcgi_request(st, script) == OK) return OK;
+		fcgi = FALSE;
+	}
+
+	if (!fcgi && job_start(st, script, &slot) == ERROR) return die(st, ERR_BUSY, "");
+
+	log_debug("executing script \"%s\"", script);
+
+	/* Daemons hand the connection over to another process */
+	if (st->cfg->opt_daemon) {
+
+		/* The script gets a plain blocking socket */
+		flags = fcntl(c->out, F_GETFL);
+		fcntl(c->out, F_SETFL, flags & ~O_NONBLOCK);
+		c->defer = FALSE;
+		conn_flush(c);
+
+		/* Persistent applications are talked to from a child of ours */
+		if (fcgi) pid = fork();
+		else pid = spawn_cgi(st, script, argv, c->in, c->out, TRUE);
+
+		if (pid == ERROR) {
+			job_cancel(slot);
+			fcntl(c->out, F_SETFL, flags);
+			c->defer = TRUE;
+			return die(st, ERR_ACCESS, "");
+		}
+
+		if (pid > 0) {
+			job_running(slot, pid, st->cfg->cgi_timeout);
+			c->detached = TRUE;
+			return OK;
+		}
+
+		signal(SIGPIPE, SIG_DFL);
+
+		/* The relay mustn't keep the listening socket & other clients open */
+		if (fcgi) {
+			for (fd = STDERR_FILENO + 1; fd < getdtablesize(); fd++)
+				if (fd != c->in && fd != c->out && fd != st->req_dirfd) close(fd);
+		}
 	}
 
+	/* Send what we have so far */
+	conn_flush(c);
+
+	/* Persistent applications are already running, no need to exec */
+	if (fcgi && fastcgi_request(st, script) == OK) {
+		if (st->cfg->opt_daemon) _exit(EXIT_SUCCESS);
+		return OK;
+	}
+
+	/* The script keeps our pid and the slot */
+	if (slot != ERROR) {
+		setpgid(0, 0);
+		job_running(slot, getpid(), st->cfg->cgi_timeout);
+	}
+	cgi_rlimits(st);
+	if (st->cfg->cgi_timeout > 0) alarm(st->cfg->cgi_timeout);
+
+	/* Connect the client to stdin/stdout & execute the binary in its own directory */
+	if (c->in != STDIN_FILENO) dup2(c->in, STDIN_FILENO);
+	if (c->out != STDOUT_FILENO) dup2(c->out, STDOUT_FILENO);
+	if (fchdir(st->req_dirfd) == OK) exec_cgi(st, script, argv);
+
 	/* Didn't work - die */
+	alarm(0);
+	job_cancel(slot);
 	die(st, ERR_ACCESS, "");
+
+	if (st->cfg->opt_daemon) {
+		conn_flush(c);
+		_exit(EXIT_FAILURE);
+	}
+	return ERROR;
+}
+
+
+/*
+ * Change the signal mask of the calling thread
+ */
+void signal_mask(int how, sigset_t *set, sigset_t *old)
+{
+#ifdef HAVE_PTHREAD
+	pthread_sigmask(how, set, old);
+#else
+	sigprocmask(how, set, old);
+#endif
+}
+
+
+/*
+ * Run a filter for a file into the cache - returns NULL once it has run,
+ * whether or not the output could be kept, or the error to report
+ */
+static const char *cache_filter(state *st, char *filter, struct stat *script,
+	struct stat *file, const char *key, int in)
+{
+	sigset_t sigs;
+	sigset_t old;
+	char tmp[BUFSIZE];
+	char *argv[3];
+	pid_t pid;
+	int status;
+	int stored;
+	int ok;
+	int slot;
+	int fds[2];
+
+	if (job_start(st, filter, &slot) == ERROR) return ERR_BUSY;
+	log_debug("caching output of filter \"%s\"", filter);
+
+	/* The exit status decides whether the output is kept */
+	job_waited(slot);
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	signal_mask(SIG_BLOCK, &sigs, &old);
+
+	argv[0] = filter;
+	argv[1] = st->req_realpath;
+	argv[2] = NULL;
+
+	if (pipe_cloexec(fds) == ERROR) {
+		job_cancel(slot);
+		signal_mask(SIG_SETMASK, &old, NULL);
+		return NULL;
+	}
+
+	if ((pid = spawn_cgi(st, filter, argv, in, fds[1], TRUE)) == ERROR) {
+		job_cancel(slot);
+		signal_mask(SIG_SETMASK, &old, NULL);
+		close(fds[0]);
+		close(fds[1]);
+		return ERR_ACCESS;
+	}
+
+	job_running(slot, pid, st->cfg->cgi_timeout);
+	close(fds[1]);
+	stored = filter_cache_put(st, key, script, file, fds[0], tmp, sizeof(tmp));
+	close(fds[0]);
+
+	/* Crashed, failed or killed filters leave nothing behind */
+	ok = (job_wait(slot, pid, &status) == OK &&
+		WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	signal_mask(SIG_SETMASK, &old, NULL);
+	if (stored == OK) filter_cache_commit(st, key, tmp, ok);
+
+	return NULL;
+}
+
+
+/*
+ * Cache the output of a filter in the background for the next requests
+ * while the client gets it the classic way. Not for pool threads, only
+ * async-signal-safe calls may follow a fork.
+ */
+static void refresh_filter(state *st, char *filter, struct stat *script,
+	struct stat *file, const char *key)
+{
+	pid_t child;
+	int fd;
+
+	if (filter_cache_lock(st, key) == ERROR) return;
+
+	if ((child = fork()) == ERROR) {
+		filter_cache_unlock(st, key);
+		return;
+	}
+	if (child > 0) {
+		waitpid(child, NULL, 0);
+		return;
+	}
+
+	/* Detach so that nobody needs to wait for the refresh */
+	if ((child = fork()) != 0) {
+		if (child == ERROR) filter_cache_unlock(st, key);
+		_exit(EXIT_SUCCESS);
+	}
+
+	/* Don't keep client connections, listeners or the event loop open */
+	if ((fd = open("/dev/null", O_RDWR)) != ERROR) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+	}
+	for (fd = STDERR_FILENO + 1; fd < getdtablesize(); fd++)
+		if (fd != st->req_dirfd) close(fd);
+
+	cache_filter(st, filter, script, file, key, STDIN_FILENO);
+
+	filter_cache_unlock(st, key);
+	_exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Filter a file through a script - with a cache directory the output
+ * is kept and sent again for as long as the filter and file don't change
+ */
+static int run_filter(state *st, char *filter, struct stat *script)
+{
+	conn *c = st->conn;
+	struct stat file;
+	const char *error;
+	char key[BUFSIZE * 2 + 16];
+	off_t start;
+	int fd;
+
+	if (!*st->cfg->cache_dir || !st->cfg->opt_filter_cache || !st->cfg->opt_exec ||
+	    file_cache_stat(st, st->req_realpath, &file) == ERROR)
+		return run_cgi(st, filter, st->req_realpath);
+
+	snprintf(key, sizeof(key), "%s\t%s\t%i", filter, st->req_realpath, st->cfg->out_charset);
+
+	/* Not cached yet - run the filter into the cache first */
+	if ((fd = filter_cache_get(st, key, script, &file, &start)) == ERROR) {
+
+		/* Changed just now? Then it can't be kept, don't run it twice */
+		if (!filter_cache_settled(script, &file))
+			return run_cgi(st, filter, st->req_realpath);
+
+		/* Event loops can't wait for it, their other clients would stall */
+		if (st->cfg->opt_daemon && (st->cfg->daemon_engine == ENGINE_EPOLL ||
+		    st->cfg->daemon_engine == ENGINE_URING)) {
+			refresh_filter(st, filter, script, &file, key);
+			return run_cgi(st, filter, st->req_realpath);
+		}
+
+		if ((error = cache_filter(st, filter, script, &file, key, c->in)))
+			return die(st, error, "");
+
+		/* Couldn't be cached - the classic way then */
+		if ((fd = filter_cache_get(st, key, script, &file, &start)) == ERROR)
+			return run_cgi(st, filter, st->req_realpath);
+	}
+	else log_debug("sending cached output of filter \"%s\"", filter);
+
+	/* The output is sent by conn_flush() */
+	conn_sendfile(c, fd, start, lseek(fd, 0, SEEK_END));
+	return OK;
 }
 
 
 /*
  * Handle file selectors
  */
-void gopher_file(state *st)
+int gopher_file(state *st)
 {
 	struct stat file;
 	char buf[BUFSIZE];
@@ -395,31 +1017,31 @@ void gopher_file(state *st)
 	if ((c = strrchr(st->req_realpath, '/'))) c++;
 	else c = st->req_realpath;
 
-	if (strcmp(c, st->map_file) == MATCH)
-		die(st, ERR_ACCESS, "Refusing to serve out a gophermap file");
-	if (strcmp(c, st->tag_file) == MATCH)
-		die(st, ERR_ACCESS, "Refusing to serve out a gophertag file");
+	if (strcmp(c, st->cfg->map_file) == MATCH)
+		return die(st, ERR_ACCESS, "Refusing to serve out a gophermap file");
+	if (strcmp(c, st->cfg->tag_file) == MATCH)
+		return die(st, ERR_ACCESS, "Refusing to serve out a gophertag file");
 
 	/* Check for & run CGI and query scripts */
-	if (strstr(st->req_realpath, st->cgi_file) || st->req_filetype == TYPE_QUERY)
-		run_cgi(st, st->req_realpath, NULL);
+	if (strstr(st->req_realpath, st->cfg->cgi_file) || st->req_filetype == TYPE_QUERY)
+		return run_cgi(st, st->req_realpath, NULL);
 
 	/* Check for a file suffix filter */
-	if (*st->filter_dir && (c = strrchr(st->req_realpath, '.'))) {
-		snprintf(buf, sizeof(buf), "%s/%s", st->filter_dir, c + 1);
+	if (*st->cfg->filter_dir && (c = strrchr(st->req_realpath, '.'))) {
+		snprintf(buf, sizeof(buf), "%s/%s", st->cfg->filter_dir, c + 1);
 
 		/* Filter file through the script */
-		if (stat(buf, &file) == OK && (file.st_mode & S_IXOTH))
-			run_cgi(st, buf, st->req_realpath);
+		if (file_cache_stat(st, buf, &file) == OK && (file.st_mode & S_IXOTH))
+			return run_filter(st, buf, &file);
 	}
 
 	/* Check for a filetype filter */
-	if (*st->filter_dir) {
-		snprintf(buf, sizeof(buf), "%s/%c", st->filter_dir, st->req_filetype);
+	if (*st->cfg->filter_dir) {
+		snprintf(buf, sizeof(buf), "%s/%c", st->cfg->filter_dir, st->req_filetype);
 
 		/* Filter file through the script */
-		if (stat(buf, &file) == OK && (file.st_mode & S_IXOTH))
-			run_cgi(st, buf, st->req_realpath);
+		if (file_cache_stat(st, buf, &file) == OK && (file.st_mode & S_IXOTH))
+			return run_filter(st, buf, &file);
 	}
 
 	/* Output regular files */
@@ -427,4 +1049,6 @@ void gopher_file(state *st)
 		send_text_file(st);
 	else
 		send_binary_file(st);
+
+	return OK;
 }
@@ -2,20 +2,104 @@
 # script for conversion of filetypes.conf into filetypes.h
 # (called by Makefile before compilation)
 # (2020-1-16 // HB9KNS)
+#
+# The suffixes end up in a perfect hash table: a suffix first hashes
+# to a bucket, and each bucket gets a multiplier that sends all its
+# suffixes to free slots. Lookups (ftype_lookup() in menu.c) then
+# cost two hashes and one string compare. The hash must match
+# ftype_hash() and FTYPE_SLOT() in the C code.
 cat <<EOH
 /* $outp autogenerated on `date -u` by $0 */
 
-#define FILETYPES \\
 EOH
-# slurp $inpt and get gopher type and list of extensions
-while read gtype exts
-do if ! test "$gtype" = "" -o "$gtype" = "#"
-# process extensions, removing trailing SPC,
-# prepending '"' and appending '","gophertype",' to each,
-# and prepending TAB and appending ' \'
- then echo $exts | sed -e "s/\([^ ][^ ]*\) */\"\1\",\"$gtype\",/g;s/^/	/;s/\$/ \\\\/"
- fi
-done
-cat <<EOF
-	NULL, NULL
-EOF
+awk '
+function hash(s,    h, i) {
+	h = 5381
+	for (i = 1; i <= length(s); i++)
+		h = (h * 33 + ord[substr(s, i, 1)]) % 4294967296
+	return h
+}
+# top bits of h * mult mod 2^32, in halves to stay exact in floating point
+function slot(h, mult, bits,    lo, hi) {
+	lo = h % 65536
+	hi = (h - lo) / 65536
+	return int((((hi * mult) % 65536) * 65536 + lo * mult) % 4294967296 / 2 ^ (32 - bits))
+}
+BEGIN {
+	for (i = 1; i < 256; i++) ord[sprintf("%c", i)] = i
+}
+# slurp gopher type and list of extensions, first mapping wins
+NF > 0 && $1 != "#" {
+	for (i = 2; i <= NF; i++) {
+		s = tolower($i)
+		if (s in seen) continue
+		if (length(s) > 14) {
+			print "filetypes.sh: ignoring too long suffix " $i | "cat 1>&2"
+			continue
+		}
+		seen[s] = 1
+		n++
+		key[n] = s
+		type[n] = substr($1, 1, 1)
+	}
+}
+END {
+	# Table at most half full, a bucket for every four slots
+	bits = 4
+	while (2 ^ bits < n * 2) bits++
+	rbits = bits - 2
+
+	for (k = 1; k <= n; k++) {
+		h[k] = hash(key[k])
+		b = slot(h[k], 2654435769, rbits)
+		bucket[b] = bucket[b] " " k
+		size[b]++
+		if (size[b] > maxsize) maxsize = size[b]
+	}
+
+	# Place the crowded buckets first while there is room
+	for (sz = maxsize; sz > 0; sz--) {
+		for (b = 0; b < 2 ^ rbits; b++) {
+			if (size[b] != sz) continue
+			split(bucket[b], members, " ")
+
+			for (d = 1; ; d++) {
+				if (d > 100000) {
+					print "filetypes.sh: cannot build the suffix hash" | "cat 1>&2"
+					exit 1
+				}
+
+				ok = 1
+				for (j = 1; j <= sz; j++) {
+					s = slot(h[members[j]], 2654435769 + 2 * d, bits)
+					if ((s in used) || (s in taken)) { ok = 0; break }
+					taken[s] = d
+				}
+				for (s in taken) delete taken[s]
+				if (!ok) continue
+
+				disp[b] = d
+				for (j = 1; j <= sz; j++) used[slot(h[members[j]], 2654435769 + 2 * d, bits)] = members[j]
+				break
+			}
+		}
+	}
+
+	printf "#define FILETYPE_BITS %d\n", bits
+	printf "#define FILETYPE_BUCKET_BITS %d\n\n", rbits
+
+	printf "#define FILETYPE_DISPLACE \\\n"
+	for (b = 0; b < 2 ^ rbits; b++) printf "\t%d, \\\n", disp[b] + 0
+	printf "\t0\n\n"
+
+	printf "#define FILETYPE_TABLE \\\n"
+	for (s = 0; s < 2 ^ bits; s++) {
+		if (s in used) {
+			t = type[used[s]]
+			if (t == "\\" || t == "'"'"'") t = "\\" t
+			printf "\t{ \"%s\", '"'"'%s'"'"' }, \\\n", key[used[s]], t
+		}
+		else printf "\t{ \"\", 0 }, \\\n"
+	}
+	printf "\t{ \"\", 0 }\n"
+}'
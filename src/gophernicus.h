@@ -62,6 +62,9 @@
 #undef  HAVE_STRLCPY        /* strlcpy() from OpenBSD */
 #undef  HAVE_SENDFILE        /* sendfile() in Linux & others */
 /* #undef  HAVE_LIBWRAP           autodetected, don't enable here */
+/* #define HAVE_SPAWN        autodetected, posix_spawn() with posix_spawn_file_actions_addfchdir_np() */
+/* #define HAVE_GETCPU        autodetected, sched_getcpu() */
+/* #define HAVE_ACCEPT4        autodetected, accept4() and pipe2() */
 
 #include "config.h"
 
@@ -70,6 +73,9 @@
 #undef  PASSWD_MIN_UID
 #define PASSWD_MIN_UID 500
 #define _FILE_OFFSET_BITS 64
+#define HAVE_EPOLL        /* epoll() event loop for daemon mode */
+#define HAVE_AFFINITY        /* sched_setaffinity() */
+#define HAVE_SENDFILE        /* sendfile() from file to socket */
 #endif
 
 /* Embedded Linux with uClibc */
@@ -101,6 +107,14 @@
 #define _LARGE_FILES 1
 #endif
 
+/* x86 SIMD, follows the compiler flags (SSE2 is always there on x86-64) */
+#ifdef __SSE2__
+#define HAVE_SSE2        /* SSE2 string kernels */
+#endif
+#ifdef __AVX2__
+#define HAVE_AVX2        /* AVX2 string kernels, needs -mavx2 or -march= */
+#endif
+
 /* Add other OS-specific defines here */
 
 /*
@@ -118,10 +132,25 @@
 #include <errno.h>
 #include <pwd.h>
 #include <limits.h>
+#include <ctype.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <stdarg.h>
+#include <sys/uio.h>
 
 #ifdef HAVE_SENDFILE
 #include <sys/sendfile.h>
-#include <fcntl.h>
+#endif
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
 #endif
 
 #ifdef HAVE_LOCALES
@@ -141,10 +170,26 @@
 #include <arpa/inet.h>
 #endif
 
+/* Hint that more data follows, where the platform has it */
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+/* Longest directory entry name, for fixed size name slots */
+#ifndef NAME_MAX
+#define NAME_MAX 255
+#endif
+
 #ifdef HAVE_UNAME
 #include <sys/utsname.h>
 #endif
 
+#if defined(HAVE_AVX2)
+#include <immintrin.h>
+#elif defined(HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
 #if !defined(HAVE_STRLCPY)
 size_t strlcpy(char *dst, const char *src, size_t siz);
 size_t strlcat(char *dst, const char *src, size_t siz);
@@ -167,6 +212,7 @@ size_t strlcat(char *dst, const char *src, size_t siz);
 #define FALSE        0
 #define TRUE        1
 
+#define AGAIN        2
 #define QUIT        1
 #define OK        0
 #define ERROR        -1
@@ -194,6 +240,18 @@ size_t strlcat(char *dst, const char *src, size_t siz);
 #define PROTO_GOPHER    'g'
 #define PROTO_HTTP    'h'
 
+/* Daemon engines */
+#define ENGINE_PREFORK    'p'
+#define ENGINE_EPOLL    'e'
+#define ENGINE_THREAD    't'
+#define ENGINE_URING    'u'
+
+/* Event loop connection stages */
+#define STAGE_READ    'r'
+#define STAGE_WAIT    'w'
+#define STAGE_WRITE    'o'
+#define STAGE_FILE    'f'
+
 /* Charsets */
 #define AUTO        0
 #define US_ASCII    1
@@ -217,6 +275,7 @@ size_t strlcat(char *dst, const char *src, size_t siz);
 #define DEFAULT_USERDIR		"public_gopher"
 #define DEFAULT_WIDTH       67
 #define DEFAULT_CHARSET		UTF_8
+#define DEFAULT_WORKERS		4
 #define MIN_WIDTH		33
 #define MAX_WIDTH		200
 #define UNKNOWN_ADDR		"unknown"
@@ -225,6 +284,8 @@ size_t strlcat(char *dst, const char *src, size_t siz);
 #define DEFAULT_SESSION_TIMEOUT        1800
 #define DEFAULT_SESSION_MAX_KBYTES    4194304
 #define DEFAULT_SESSION_MAX_HITS    4096
+#define DEFAULT_SESSIONS    4096
+#define MAX_SESSIONS    1048576
 
 /* Dummy values for gopher protocol */
 #define DUMMY_SELECTOR    "null"
@@ -244,6 +305,7 @@ size_t strlcat(char *dst, const char *src, size_t siz);
 /* Error messages */
 #define ERR_ACCESS    "Access denied!"
 #define ERR_NOTFOUND    "File or directory not found!"
+#define ERR_BUSY    "Server busy, try again later!"
 
 #define ERROR_HOST    "error.host\t1"
 #define ERROR_PREFIX    "Error: "
@@ -255,6 +317,9 @@ size_t strlcat(char *dst, const char *src, size_t siz);
 
 #define HEADER_FORMAT    "[%s]"
 #define FOOTER_FORMAT    "Gophered by Gophernicus/" VERSION " on %s"
+#define PAGE_FORMAT    "Page %i of %i"
+#define PREV_PAGE    "Previous page"
+#define NEXT_PAGE    "Next page"
 
 #define UNITS        "KB", "MB", "GB", "TB", "PB", NULL
 #define DATE_FORMAT    "%Y-%b-%d %H:%M"    /* See man 3 strftime */
@@ -280,11 +345,51 @@ size_t strlcat(char *dst, const char *src, size_t siz);
 /* Sizes & maximums */
 #define BUFSIZE        1024    /* Default size for string buffers */
 #define MAX_HIDDEN    32    /* Maximum number of hidden files */
-#define MAX_FILETYPES    1024    /* Maximum number of suffix to filetype mappings */
+#define MAX_FILETYPES    128    /* Slots for runtime suffix to filetype overrides (power of two) */
 #define MAX_FILTERS    16    /* Maximum number of file filters */
-#define MAX_SDIRENT    1024    /* Maximum number of files per directory to handle */
+#define MAX_SDIRENT    1048576    /* Maximum number of files per directory to handle */
+#define SDIRENT_CHUNK    256    /* Initial size of directory listings, doubled as needed */
+#define SDIRENT_POOL    (16 * 1024)    /* Arena chunk for packing directory entry names */
+#define PAGE_WINDOW    256    /* Entries kept per pass when paging a directory */
 #define MAX_REWRITE    32    /* Maximum number of selector rewrite options */
 #define MAX_USERS    1024 /* Maximum number of users for the ~ option */
+#define MAX_WORKERS    256    /* Maximum number of daemon worker processes */
+#define MAX_CGI_ENV    64    /* Maximum number of CGI environment variables */
+#define CGI_ENV_SIZE    (BUFSIZE * 16)    /* Space for CGI environment variables */
+#define FCGI_SUFFIX    ".fcgi"    /* Scripts run as persistent FastCGI applications */
+#define FCGI_PROCESSES    2    /* Application processes started per script */
+#define JOB_SLOTS    256    /* Max amount of CGI scripts tracked at once */
+#define JOB_REAPED    32    /* Exit statuses of reaped scripts kept per process */
+#define CGI_QUEUE_MAX    64    /* Requests waiting for a CGI slot */
+#define CGI_QUEUE_WAIT    10    /* Seconds to wait for a CGI slot */
+#define CGI_QUEUE_POLL    100000    /* Microseconds between checks for a CGI slot */
+#define LISTEN_BACKLOG    128    /* Pending connections queue for daemon mode */
+#define LISTEN_FDS_START    3    /* First socket passed by systemd */
+#define OUTBUFSIZE    8192    /* Output buffer size for client connections */
+#define FILEBUFSIZE    65536    /* Output buffer size when reading files into it */
+#define SENDFILE_MAX    0x7ffff000    /* Most Linux sends with one sendfile() */
+#define REQBUFSIZE    (BUFSIZE * 2)    /* Request buffer size for event loop connections */
+#define CONN_TIMEOUT    120    /* Seconds before a stalled daemon connection is dropped */
+#define MAX_EVENTS    64    /* Maximum number of events per epoll_wait() */
+#define ARENA_SIZE    (512 * 1024)    /* Initial size of per-worker request arenas */
+#define ARENA_MAX    (8 * 1024 * 1024)    /* Arenas don't grow past this between requests */
+#define ARENA_SPARES    (2 * 1024 * 1024)    /* Connection buffers a worker keeps for reuse */
+#define MENU_CACHE_SIZE    64    /* Maximum number of rendered menus cached per worker */
+#define MENU_CACHE_MAX    (256 * 1024)    /* Largest menu worth caching */
+#define MENU_CACHE_TTL    30    /* Seconds before a cached menu is rendered again anyway */
+#define PAGE_CACHE_SIZE    16    /* Paged directories whose windows are remembered per worker */
+#define FILE_CACHE_SIZE    128    /* Paths whose stat() and descriptor are cached per worker */
+#define FILE_CACHE_TTL    5    /* Seconds before a cached path is looked up again */
+#define VHOST_ROUTES    1024    /* Initial size of the vhost routing index */
+#define VHOST_INDEX_TTL    5    /* Seconds before vhost directories are checked for changes */
+#define MAP_CACHE_SIZE    64    /* Compiled gophermaps kept per worker */
+#define EXEC_CACHE_MAGIC    0x676d6170UL    /* Cached executable gophermap output + struct version */
+#define EXEC_CACHE_LOCK    120    /* Seconds before an unfinished refresh is given up on */
+#define EXEC_CACHE_STALE    3600    /* Seconds an expired output is still served while refreshed */
+#define EXEC_CACHE_MAX    4096    /* Outputs kept in -C before the oldest are removed */
+#define EXEC_CACHE_SWEEP    60    /* Seconds between sweeps of the -C directory */
+#define FILTER_CACHE_MAGIC    0x66696c74UL    /* Cached filter output + struct version */
+#define TEXT_CACHE_MAGIC    0x74657874UL    /* Converted text file + struct version */
 
 /* Struct for file suffix -> gopher filetype mapping */
 typedef struct {
@@ -298,24 +403,120 @@ typedef struct {
     char replace[BUFSIZE];
 } srewrite;
 
-/* Struct for keeping the current options & state */
+/* Struct for a reusable request memory arena */
+typedef struct {
+    char *base;
+    size_t size;
+    size_t used;
+    size_t peak;
+    void *extra;
+    void *spare;
+    size_t spare_size;
+} arena;
+
+/* Struct for the mtimes a cached menu depends on */
 typedef struct {
+    time_t dir;
+    time_t map;
+    time_t tag;
+} menu_stamp;
 
-    /* Request */
-    char req_selector[BUFSIZE];
-    char req_realpath[BUFSIZE];
-    char req_query_string[BUFSIZE];
-    char req_search[BUFSIZE];
-    char req_referrer[BUFSIZE];
-    char req_local_addr[64];
-    char req_remote_addr[64];
-    char req_filetype;
-    char req_protocol;
-    off_t req_filesize;
+/* Compiled gophermap line - strings are offsets into the map's strings */
+typedef struct {
+    char op;    /* Line type, one of the MAP_* below */
+    char type;    /* Gopher type of a resource */
+    int port;    /* ERROR for the server's own port */
+    int name;
+    int selector;
+    int host;    /* ERROR for the server's own host */
+} map_line;
+
+#define MAP_INFO    'i'
+#define MAP_TITLE    '!'
+#define MAP_LINK    'l'    /* Remote, absolute or hURL resource */
+#define MAP_RELATIVE    'r'    /* Resource relative to the menu */
+#define MAP_USERS    '~'
+#define MAP_VHOSTS    '%'
+#define MAP_HIDE    '-'
+#define MAP_FILETYPE    ':'
+#define MAP_INCLUDE    '='    /* Executable include, run on every request */
+
+/* A file a compiled gophermap was built from */
+typedef struct {
+    int name;
+    ino_t ino;    /* 0 if the file didn't exist */
+    off_t size;
+    time_t ctime;
+} map_stamp;
+
+/* Gophermap compiled with its static includes */
+typedef struct {
+    int refs;
+    int result;    /* QUIT, or OK if the directory listing follows */
+    char included;    /* Has static includes the menu cache can't track */
+    char error;
+    int ttl;    /* Seconds an executable map's output may be reused */
+    map_line *lines;
+    int num_lines;
+    char *strings;
+    int strings_len;
+    map_stamp *files;
+    int num_files;
+} gmap;
+
+/* io_uring instance, private to uring.c */
+typedef struct uring uring;
+
+/* Shared memory, defined below */
+#ifdef HAVE_SHMEM
+typedef struct shm_state shm_state;
+#endif
+
+/* Struct for a client connection */
+typedef struct {
+    int in;        /* Requests are read from here */
+    int out;        /* Responses are written here */
+    char defer;        /* Output is sent later by the event loop */
+    char detached;    /* A child process took over the connection */
+    char error;        /* Sending failed, client is gone */
+    char nosock;    /* Output isn't a socket (inetd with pipes) */
+    int delay;        /* Seconds to throttle the client */
+    arena *arena;    /* Request memory of whoever serves the connection */
+    uring *ring;    /* Ring for batching filesystem syscalls, if any */
+    shm_state *shm;    /* Where to account the data sent, if anywhere */
+    int session;    /* Session slot of the client in shm, or ERROR */
+    int session_id;
+
+    /* Request lines received by the event loop */
+    char *req;
+    size_t req_len;
+
+    /* Output buffer */
+    char *buf;
+    size_t size;
+    size_t len;
+    size_t pos;
+    off_t sent;
+
+    /* Binary file being sent */
+    int file;
+    off_t file_pos;
+    off_t file_size;
+
+    /* Text file being converted */
+    FILE *text;
+    int text_charset;
+    char text_iconv;
+    char text_partial;    /* In the middle of a long line */
+} conn;
+
+/* Struct for the options & settings - read-only once requests are served */
+typedef struct {
 
     /* Output */
     int out_width;
     int out_charset;
+    int out_page_size;
 
     /* Settings */
     char server_description[64];
@@ -323,7 +524,6 @@ typedef struct {
     char server_platform[64];
     char server_admin[64];
     char server_root[256];
-    char server_host_default[64];
     char server_host[64];
     int  server_port;
     int  server_tls_port;
@@ -335,25 +535,34 @@ typedef struct {
     char user_dir[64];
     char log_file[256];
 
-    char hidden[MAX_HIDDEN][256];
-    int hidden_count;
-
-    ftype filetype[MAX_FILETYPES];
+    ftype filetype[MAX_FILETYPES];    /* -e overrides of the built-in table, hashed */
     int filetype_count;
     char filter_dir[64];
+    char cache_dir[256];
+    char fcgi_dir[256];
 
     srewrite rewrite[MAX_REWRITE];
     int rewrite_count;
 
+    int daemon_workers;
+    char daemon_engine;
+
 #ifdef __OpenBSD__
 	char *extra_unveil_paths;
 #endif
 
     /* Session */
     int session_timeout;
+    int session_slots;
     int session_max_kbytes;
     int session_max_hits;
-    int session_id;
+
+    /* CGI limits */
+    int cgi_jobs;
+    int cgi_script_jobs;
+    int cgi_timeout;
+    int cgi_cpu;
+    int cgi_mbytes;
 
     /* Feature options */
     char opt_parent;
@@ -374,17 +583,80 @@ typedef struct {
     char opt_personal_spaces;
     char opt_http_requests;
     char opt_plus_menu;
+    char opt_daemon;
+    char opt_reuseport;
+    char opt_affinity;
+    char opt_cache;
+    char opt_filter_cache;
     char debug;
+} config;
+
+/* Struct for the state of one request */
+typedef struct {
+    const config *cfg;
+
+    /* Request */
+    conn *conn;
+    char req_selector[BUFSIZE];
+    char req_realpath[BUFSIZE];
+    char req_query_string[BUFSIZE];
+    char req_search[BUFSIZE];
+    char req_referrer[BUFSIZE];
+    char req_local_addr[64];
+    char req_remote_addr[64];
+    char req_filetype;
+    char req_protocol;
+    off_t req_filesize;
+    int req_dirfd;
+    char req_cacheable;
+
+    /* Virtual host the request is for */
+    char server_host_default[64];
+    char server_host[64];
+    int  server_port;
+
+    /* Set by gophermaps */
+    char hidden[MAX_HIDDEN][256];
+    int hidden_count;
+
+    ftype *filetype;    /* Overrides of the config table, hashed - NULL until needed */
+    int filetype_count;
+
+    /* Session */
+    int session_id;
 } state;
 
+/* Start of every shared memory segment */
+typedef struct {
+    unsigned int magic;    /* Never moves, so any version can tell the segment isn't its own */
+    unsigned int version;
+} shm_header;
+
 /* Shared memory for session & accounting data */
 #ifdef HAVE_SHMEM
 
-#define SHM_KEY        0xbeeb0008    /* Unique identifier + struct version */
+#define SHM_KEY        0xbeeb0100    /* Unique identifier */
+#define SHM_MAGIC    0x676f7068    /* "goph" once the segment is initialized */
+#define SHM_BUSY    1        /* Magic while the segment is being initialized */
+#define SHM_VERSION    12        /* Bump whenever shm_state changes */
 #define SHM_MODE    0600        /* Access mode for the shared memory */
-#define SHM_SESSIONS    256        /* Max amount of user sessions to track */
+#define SHM_COUNTERS    64        /* Per-CPU hit & transfer counters */
+#define SHM_SPINS    1000        /* Tries to get at a busy slot */
+#define SESSION_PROBE    16        /* Slots a client's session can be in */
+#define SESSION_LOCK_MAX    5        /* Seconds before a slot's lock is taken from its holder */
+#define CACHE_LINE    64        /* Keeps the per-CPU counters apart */
+#define SNIFF_SHM_KEY    0xbeeb0101    /* Shared content sniffing cache */
+#define SNIFF_VERSION    1        /* Bump whenever the sniffing cache changes */
+#define SNIFF_CACHE_SIZE    8192    /* Files whose sniffed type is remembered */
+#define JOBS_SHM_KEY    0xbeeb0102    /* Shared CGI job table */
+#define JOBS_VERSION    1        /* Bump whenever the job table changes */
 
 typedef struct {
+    unsigned int seq;    /* Odd while the slot is being written */
+    pid_t owner;    /* Holder of the write lock, 0 if none */
+    time_t locked;    /* When the holder got it, 0 if not known yet */
+    unsigned char addr[16];    /* Client address, IPv4 mapped to IPv6 */
+
     long hits;
     long kbytes;
 
@@ -398,20 +670,30 @@ typedef struct {
     int  server_port;
 } shm_session;
 
+/* Counters of one CPU, in a cache line of its own */
 typedef struct {
-    time_t start_time;
     long hits;
     long kbytes;
+    unsigned int seq;    /* Odd while the counters are being updated */
+} __attribute__((aligned(CACHE_LINE))) shm_counter;
+
+struct shm_state {
+    shm_header header;
+
+    time_t start_time;
     char server_platform[64];
     char server_description[64];
-    shm_session session[SHM_SESSIONS];
-} shm_state;
+    int sessions;    /* Size of the session table, a power of two */
+
+    shm_counter counter[SHM_COUNTERS];
+    shm_session session[];
+};
 
 #endif
 
 /* Struct for directory sorting */
 typedef struct {
-    char    name[128];    /* Should be 256 but we're saving stack space */
+    char    *name;
     mode_t    mode;
     uid_t    uid;
     gid_t    gid;
@@ -419,6 +701,14 @@ typedef struct {
     time_t    mtime;
 } sdirent;
 
+/* Environment of a CGI script, NAME=value strings */
+typedef struct {
+    char *vars[MAX_CGI_ENV + 1];
+    int count;
+    char buf[CGI_ENV_SIZE];
+    size_t used;
+} cgi_env;
+
 /* Struct for the userlist with date */
 typedef struct {
 	char   user[32]; /* Maximum in most systems */
@@ -447,20 +737,28 @@ typedef struct {
 /* gophernicus.c */
 void info(state *st, char *str, char type);
 void footer(state *st);
-void die(state *st, const char *message, const char *description);
+int die(state *st, const char *message, const char *description);
 void log_combined(state *st, int status);
 void html_encode(const char *unsafe, char *dest, int bufsize);
+void init_request(state *st);
+int handle_request(const config *cfg, conn *c, shm_state *shm, int shmid);
 
 /* file.c */
 void send_binary_file(state *st);
 void send_text_file(state *st);
-void url_redirect(state *st);
+void send_text_chunk(conn *c);
+int url_redirect(state *st);
 void server_status(state *st, shm_state *shm, int shmid);
 void caps_txt(state *st, shm_state *shm);
-void setenv_cgi(state *st, char *script);
-void gopher_file(state *st);
+void cgi_environment(state *st, char *script, cgi_env *env);
+void signal_mask(int how, sigset_t *set, sigset_t *old);
+int pipe_cloexec(int fds[2]);
+pid_t spawn_cgi(state *st, char *script, char *const argv[], int in, int out, int limit);
+int gopher_file(state *st);
 
 /* menu.c */
+unsigned long ftype_hash(const char *suffix);
+char ftype_lookup(state *st, const char *suffix);
 char gopher_filetype(state *st, char *file, char magic);
 void gopher_menu(state *st);
 
@@ -476,18 +774,112 @@ void strniconv(int charset, char *out, char *in, size_t outsize);
 void strnencode(char *out, const char *in, size_t outsize);
 void strndecode(char *out, char *in, size_t outsize);
 void strfsize(char *out, off_t size, size_t outsize);
+unsigned long long memhash(const void *data, size_t len);
+unsigned long long strhash(const char *str);
+
+/* server.c */
+int server(config *cfg, shm_state *shm, int shmid);
+void pin_cpu(int n);
+void socket_timeouts(int fd);
+int accept_client(int sock);
+void reap_children(void);
+
+/* thread.c */
+void thread_pool(const config *cfg, shm_state *shm, int shmid, int *socks, int nsocks);
+
+/* arena.c */
+void arena_init(arena *a, size_t size);
+void *arena_alloc(arena *a, size_t size);
+void arena_reset(arena *a);
+void *arena_get(arena *a, size_t size);
+void arena_put(arena *a, void *p);
+void arena_free(arena *a);
+
+/* event.c */
+void event_loop(const config *cfg, shm_state *shm, int shmid, int sock);
+
+/* cache.c */
+int menu_cache_send(state *st, menu_stamp *stamp);
+void menu_cache_store(state *st, menu_stamp *stamp, const char *data, size_t len);
+int page_cursor_get(state *st, int window, int max, sdirent *cursor, char *name, size_t namesize);
+void page_cursor_put(state *st, int window, int k, sdirent *cursor);
+int file_cache_stat(state *st, const char *path, struct stat *s);
+int file_cache_open(state *st, const char *path);
+int vhost_cache_find(state *st);
+int vhost_cache_list(state *st, sdirent **list);
+gmap *map_cache_get(state *st, const char *key, struct stat *file);
+void map_cache_put(state *st, const char *key, gmap *m);
+void map_release(gmap *m);
+gmap *exec_cache_get(state *st, const char *key, struct stat *file, int *stale);
+void exec_cache_put(state *st, const char *key, struct stat *file, gmap *m);
+void exec_cache_drop(state *st, const char *key);
+int exec_cache_lock(state *st, const char *key);
+void exec_cache_unlock(state *st, const char *key);
+void exec_cache_sweep(const config *cfg);
+int filter_cache_settled(struct stat *filter, struct stat *file);
+int filter_cache_lock(state *st, const char *key);
+void filter_cache_unlock(state *st, const char *key);
+int filter_cache_get(state *st, const char *key, struct stat *filter, struct stat *file, off_t *start);
+int filter_cache_put(state *st, const char *key, struct stat *filter, struct stat *file,
+    int in, char *tmp, size_t size);
+void filter_cache_commit(state *st, const char *key, char *tmp, int keep);
+int text_cache_get(state *st, struct stat *file, off_t *start, int *plain);
+FILE *text_cache_create(state *st, struct stat *file, char *tmp, size_t size);
+void text_cache_commit(state *st, struct stat *file, char *tmp, FILE *fp, int plain);
+void sniff_cache_init(void);
+int sniff_cache_get(const char *file, struct stat *s);
+void sniff_cache_put(const struct stat *s, int type);
+
+/* fastcgi.c */
+int fastcgi_script(state *st, char *script);
+int fastcgi_request(state *st, char *script);
+
+/* jobs.c */
+void jobs_init(void);
+int job_start(state *st, char *script, int *slot);
+void job_running(int slot, pid_t pid, int timeout);
+void job_waited(int slot);
+int job_wait(int slot, pid_t pid, int *status);
+void job_cancel(int slot);
+void job_exited(pid_t pid, int status);
+void jobs_expire(void);
+void jobs_status(state *st);
+
+/* uring.c */
+int uring_loop(const config *cfg, shm_state *shm, int shmid, int sock);
+int uring_stat_dir(uring *r, int dirfd, sdirent *list, int num);
+
+/* conn.c */
+void conn_init(conn *c, arena *mem, int in, int out);
+void conn_free(conn *c);
+int conn_request_ready(const config *cfg, const conn *c);
+char *conn_getline(conn *c, char *buf, size_t bufsize);
+void conn_write(conn *c, const void *data, size_t len);
+void conn_printf(conn *c, const char *fmt, ...);
+int conn_pending(conn *c);
+void conn_sendfile(conn *c, int fd, off_t start, off_t end);
+int conn_flush(conn *c);
 
 /* platform.c */
-void platform(state *st);
+void platform(config *cfg);
 float loadavg(void);
 
 /* session.c */
+shm_state *shm_init(config *cfg, int *shmid);
 void get_shm_session(state *st, shm_state *shm);
 void update_shm_session(state *st, shm_state *shm);
+void update_shm_sent(conn *c);
+void shm_count(shm_state *shm, long hits, long kbytes);
+void read_shm_counters(shm_state *shm, long *hits, long *kbytes);
+#ifdef HAVE_SHMEM
+void *shm_attach(key_t key, size_t size, unsigned int version,
+    void (*init)(void *mem, void *arg), void *arg, int *shmid);
+int read_shm_session(shm_state *shm, int i, shm_session *copy);
+#endif
 
 /* options.c */
-void add_ftype_mapping(state *st, char *suffix);
-void parse_args(state *st, int argc, char *argv[]);
+void add_ftype_mapping(ftype *filetype, int *count, char *suffix);
+void parse_args(config *cfg, int argc, char *argv[]);
 
 /* log.c */
 void log_init(int enable, int debug);
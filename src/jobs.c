@@ -0,0 +1,489 @@
+/*
+ * Gophernicus
+ *
+ * Copyright (c) 2009-2018 Kim Holviala <kimholviala@fastmail.com>
+ * Copyright (c) 2019 Gophernicus Developers <gophernicus@gophernicus.org>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include "gophernicus.h"
+
+
+/*
+ * CGI scripts running on the whole server, shared by all processes.
+ * A slot is taken with the pid of whoever starts the script and then
+ * holds the pid of the script itself until it has been reaped.
+ */
+typedef struct {
+	pid_t pid;
+	unsigned long long started;	/* Tells the pid apart from a reused one */
+	unsigned long script;
+	time_t deadline;
+	int waited;	/* Whoever reaps the script leaves its status here */
+	int exited;
+	int status;
+} job_slot;
+
+typedef struct {
+	shm_header header;
+	long queued;
+	long started;
+	long refused;
+	long timeouts;
+	long killed;
+	job_slot slot[JOB_SLOTS];
+} job_table;
+
+static job_table *jobs;
+
+/* Scripts reaped by this process, for job_wait() without the job table */
+typedef struct {
+	pid_t pid;
+	int status;
+} job_reaped;
+
+static job_reaped reaped[JOB_REAPED];
+static unsigned int reaped_next;
+
+
+/*
+ * Attach to the shared job table
+ */
+void jobs_init(void)
+{
+#ifdef HAVE_SHMEM
+	jobs = shm_attach(JOBS_SHM_KEY, sizeof(job_table), JOBS_VERSION, NULL, NULL, NULL);
+#endif
+}
+
+
+/*
+ * Get the start time of a process in clock ticks since boot - 0 if
+ * the system doesn't tell
+ */
+static unsigned long long proc_started(pid_t pid)
+{
+#ifdef __linux
+	unsigned long long started;
+	char buf[BUFSIZE];
+	char *c;
+	int fd;
+	int i;
+
+	snprintf(buf, sizeof(buf), "/proc/%i/stat", (int) pid);
+	if ((fd = open(buf, O_RDONLY | O_CLOEXEC)) == ERROR) return 0;
+	i = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (i <= 0) return 0;
+	buf[i] = '\0';
+
+	/* The command name may contain anything - skip past it */
+	if ((c = strrchr(buf, ')')) == NULL) return 0;
+
+	/* Start time is the 22nd field, the 20th after the name */
+	for (i = 0; i < 20 && c; i++) c = strchr(c + 1, ' ');
+	if (!c || sscanf(c, "%llu", &started) != 1) return 0;
+
+	return started;
+#else
+	return 0;
+#endif
+}
+
+
+/*
+ * Is the process in a slot still the one put there?
+ */
+static int job_alive(job_slot *s, pid_t pid)
+{
+	unsigned long long started;
+
+	if (kill(pid, 0) == ERROR && errno == ESRCH) return FALSE;
+
+	/* Same pid, different process - unless the slot just changed hands */
+	started = __atomic_load_n(&s->started, __ATOMIC_ACQUIRE);
+	if (started && proc_started(pid) != started)
+		return (__atomic_load_n(&s->pid, __ATOMIC_ACQUIRE) != pid);
+
+	return TRUE;
+}
+
+
+/*
+ * Hash a script path
+ */
+static unsigned long job_hash(const char *script)
+{
+	unsigned long hash = strhash(script);
+
+	return hash ? hash : 1;
+}
+
+
+/*
+ * Free slots whose process is gone without being reaped by us (crashed
+ * workers, scripts exec'd by inetd) and count the running scripts
+ */
+static int job_count(unsigned long script, int *same)
+{
+	pid_t pid;
+	int running = 0;
+	int i;
+
+	*same = 0;
+	for (i = 0; i < JOB_SLOTS; i++) {
+		if ((pid = __atomic_load_n(&jobs->slot[i].pid, __ATOMIC_ACQUIRE)) == 0) continue;
+
+		if (!job_alive(&jobs->slot[i], pid)) {
+			__atomic_store_n(&jobs->slot[i].deadline, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&jobs->slot[i].started, 0, __ATOMIC_RELAXED);
+			__atomic_compare_exchange_n(&jobs->slot[i].pid, &pid, 0,
+				FALSE, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		running++;
+		if (__atomic_load_n(&jobs->slot[i].script, __ATOMIC_RELAXED) == script) (*same)++;
+	}
+
+	return running;
+}
+
+
+/*
+ * Try to take a slot within the limits - returns the slot or ERROR
+ */
+static int job_claim(state *st, unsigned long script)
+{
+	pid_t self = getpid();
+	pid_t none;
+	int running;
+	int same;
+	int i;
+
+	running = job_count(script, &same);
+	if ((st->cfg->cgi_jobs && running >= st->cfg->cgi_jobs) ||
+	    (st->cfg->cgi_script_jobs && same >= st->cfg->cgi_script_jobs)) return ERROR;
+
+	for (i = 0; i < JOB_SLOTS; i++) {
+		none = 0;
+		if (!__atomic_compare_exchange_n(&jobs->slot[i].pid, &none, self,
+			FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) continue;
+
+		__atomic_store_n(&jobs->slot[i].started, proc_started(self), __ATOMIC_RELEASE);
+		__atomic_store_n(&jobs->slot[i].script, script, __ATOMIC_RELAXED);
+		__atomic_store_n(&jobs->slot[i].deadline, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&jobs->slot[i].waited, FALSE, __ATOMIC_RELAXED);
+		__atomic_store_n(&jobs->slot[i].exited, FALSE, __ATOMIC_RELAXED);
+
+		/* Somebody else may have got in at the same time */
+		running = job_count(script, &same);
+		if ((st->cfg->cgi_jobs && running > st->cfg->cgi_jobs) ||
+		    (st->cfg->cgi_script_jobs && same > st->cfg->cgi_script_jobs)) {
+			job_cancel(i);
+			return ERROR;
+		}
+
+		return i;
+	}
+
+	return ERROR;
+}
+
+
+/*
+ * Get a slot for running a script, waiting in line for a while if the
+ * limits have been reached - returns ERROR if the server is too busy,
+ * otherwise OK with the slot (or ERROR if jobs aren't tracked) in *slot
+ */
+int job_start(state *st, char *script, int *slot)
+{
+	unsigned long hash;
+	time_t give_up;
+	int queued = FALSE;
+	int wait;
+
+	*slot = ERROR;
+	if (!jobs) return OK;
+
+	/* Kill what has run out of time before counting */
+	jobs_expire();
+
+	hash = job_hash(script);
+	if ((*slot = job_claim(st, hash)) != ERROR) goto started;
+
+	/* Without limits only the table can be full - run untracked then */
+	if (!st->cfg->cgi_jobs && !st->cfg->cgi_script_jobs) return OK;
+
+	/* Event loops can't wait without stalling everybody else */
+	wait = !(st->cfg->opt_daemon &&
+		(st->cfg->daemon_engine == ENGINE_EPOLL || st->cfg->daemon_engine == ENGINE_URING));
+
+	if (wait && __atomic_add_fetch(&jobs->queued, 1, __ATOMIC_RELAXED) <= CGI_QUEUE_MAX) {
+		queued = TRUE;
+		give_up = time(NULL) + CGI_QUEUE_WAIT;
+		log_debug("waiting for a slot to run script \"%s\"", script);
+
+		while (time(NULL) < give_up) {
+			usleep(CGI_QUEUE_POLL);
+
+			/* Our own finished scripts are in the way too */
+			reap_children();
+			if ((*slot = job_claim(st, hash)) != ERROR) break;
+		}
+	}
+	if (wait) __atomic_sub_fetch(&jobs->queued, 1, __ATOMIC_RELAXED);
+
+	if (*slot == ERROR) {
+		__atomic_add_fetch(&jobs->refused, 1, __ATOMIC_RELAXED);
+		log_info("too many scripts running, refused \"%s\"%s",
+			script, queued ? " after waiting" : "");
+		return ERROR;
+	}
+
+started:
+	__atomic_add_fetch(&jobs->started, 1, __ATOMIC_RELAXED);
+	return OK;
+}
+
+
+/*
+ * Hand a slot over to the process running the script
+ */
+void job_running(int slot, pid_t pid, int timeout)
+{
+	if (!jobs || slot == ERROR) return;
+
+	/* A free slot has no start time - the new one follows the pid */
+	__atomic_store_n(&jobs->slot[slot].started, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&jobs->slot[slot].pid, pid, __ATOMIC_RELEASE);
+	__atomic_store_n(&jobs->slot[slot].started, proc_started(pid), __ATOMIC_RELEASE);
+	if (timeout > 0)
+		__atomic_store_n(&jobs->slot[slot].deadline, time(NULL) + timeout, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Keep the exit status of the script in a slot for job_wait()
+ */
+void job_waited(int slot)
+{
+	if (!jobs || slot == ERROR) return;
+
+	__atomic_store_n(&jobs->slot[slot].waited, TRUE, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Remember the exit status of a script reaped by this process - safe
+ * to call from a signal handler
+ */
+static void job_reaped_put(pid_t pid, int status)
+{
+	job_reaped *r = &reaped[__atomic_fetch_add(&reaped_next, 1, __ATOMIC_RELAXED) % JOB_REAPED];
+
+	__atomic_store_n(&r->pid, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->status, status, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->pid, pid, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Take the exit status of a script reaped by this process, the latest
+ * one if the pid was used before - returns ERROR if there's none
+ */
+static int job_reaped_get(pid_t pid, int *status)
+{
+	job_reaped *r;
+	unsigned int next;
+	int i;
+
+	next = __atomic_load_n(&reaped_next, __ATOMIC_ACQUIRE);
+
+	for (i = 1; i <= JOB_REAPED; i++) {
+		r = &reaped[(next - i) % JOB_REAPED];
+		if (__atomic_load_n(&r->pid, __ATOMIC_ACQUIRE) != pid) continue;
+
+		*status = __atomic_load_n(&r->status, __ATOMIC_RELAXED);
+		__atomic_compare_exchange_n(&r->pid, &pid, 0,
+			FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		return OK;
+	}
+
+	return ERROR;
+}
+
+
+/*
+ * Wait for a script to exit & give its slot back - returns ERROR if
+ * the exit status got lost
+ */
+int job_wait(int slot, pid_t pid, int *status)
+{
+	job_slot *s;
+	int i;
+
+	/* Usually it's ours to reap */
+	for (;;) {
+		if (waitpid(pid, status, 0) == pid) {
+			job_exited(pid, *status);
+			job_cancel(slot);
+			return OK;
+		}
+		if (errno != EINTR) break;
+	}
+
+	/* Reaped by our SIGCHLD handler (maybe in another thread) without a slot */
+	if (!jobs || slot == ERROR) {
+		for (i = 0; i < CGI_QUEUE_WAIT * 1000000 / CGI_QUEUE_POLL; i++) {
+			if (job_reaped_get(pid, status) == OK) return OK;
+			usleep(CGI_QUEUE_POLL);
+		}
+		return ERROR;
+	}
+
+	/* Reaped elsewhere (another thread) - the status is in the slot */
+	s = &jobs->slot[slot];
+
+	for (i = 0; i < CGI_QUEUE_WAIT * 1000000 / CGI_QUEUE_POLL; i++) {
+		if (__atomic_load_n(&s->exited, __ATOMIC_ACQUIRE)) {
+			*status = s->status;
+			job_cancel(slot);
+			return OK;
+		}
+		usleep(CGI_QUEUE_POLL);
+	}
+
+	job_cancel(slot);
+	return ERROR;
+}
+
+
+/*
+ * Give a slot back without running anything
+ */
+void job_cancel(int slot)
+{
+	if (!jobs || slot == ERROR) return;
+
+	__atomic_store_n(&jobs->slot[slot].deadline, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&jobs->slot[slot].started, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&jobs->slot[slot].pid, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Free the slot of a reaped script & keep its exit status
+ */
+void job_exited(pid_t pid, int status)
+{
+	int i;
+
+	job_reaped_put(pid, status);
+	if (!jobs) return;
+
+	for (i = 0; i < JOB_SLOTS; i++) {
+		if (__atomic_load_n(&jobs->slot[i].pid, __ATOMIC_ACQUIRE) != pid) continue;
+		if (WIFSIGNALED(status)) __atomic_add_fetch(&jobs->killed, 1, __ATOMIC_RELAXED);
+
+		if (!__atomic_load_n(&jobs->slot[i].waited, __ATOMIC_RELAXED)) {
+			job_cancel(i);
+			return;
+		}
+
+		/* Hold on to the slot (in our name) until job_wait() has the status */
+		__atomic_store_n(&jobs->slot[i].deadline, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&jobs->slot[i].started, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&jobs->slot[i].pid, getpid(), __ATOMIC_RELEASE);
+		jobs->slot[i].status = status;
+		__atomic_store_n(&jobs->slot[i].exited, TRUE, __ATOMIC_RELEASE);
+		return;
+	}
+}
+
+
+/*
+ * Kill the process groups of scripts that have run for too long
+ */
+void jobs_expire(void)
+{
+	time_t deadline;
+	time_t cleared;
+	time_t now;
+	pid_t pid;
+	int i;
+
+	if (!jobs) return;
+	now = time(NULL);
+
+	for (i = 0; i < JOB_SLOTS; i++) {
+		deadline = __atomic_load_n(&jobs->slot[i].deadline, __ATOMIC_RELAXED);
+		if (deadline == 0 || now < deadline) continue;
+		if ((pid = __atomic_load_n(&jobs->slot[i].pid, __ATOMIC_ACQUIRE)) == 0) continue;
+
+		/* The script is gone and its pid may be somebody else's */
+		if (!job_alive(&jobs->slot[i], pid)) continue;
+
+		/* Only one process gets to do it */
+		if (!__atomic_compare_exchange_n(&jobs->slot[i].deadline, &deadline, 0,
+			FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) continue;
+
+		/* Reused meanwhile by a script with the same deadline? Leave that one be */
+		if (__atomic_load_n(&jobs->slot[i].pid, __ATOMIC_ACQUIRE) != pid) {
+			cleared = 0;
+			__atomic_compare_exchange_n(&jobs->slot[i].deadline, &cleared, deadline,
+				FALSE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		log_info("killing script %i after running for too long", (int) pid);
+		kill(-pid, SIGKILL);
+		__atomic_add_fetch(&jobs->timeouts, 1, __ATOMIC_RELAXED);
+	}
+}
+
+
+/*
+ * Print job counters for /server-status
+ */
+void jobs_status(state *st)
+{
+	int same;
+
+	if (!jobs) return;
+
+	conn_printf(st->conn, "CGIRunning: %i" CRLF
+		"CGIQueued: %li" CRLF
+		"CGIStarted: %li" CRLF
+		"CGIRefused: %li" CRLF
+		"CGITimeouts: %li" CRLF
+		"CGIKilled: %li" CRLF,
+			job_count(0, &same),
+			__atomic_load_n(&jobs->queued, __ATOMIC_RELAXED),
+			__atomic_load_n(&jobs->started, __ATOMIC_RELAXED),
+			__atomic_load_n(&jobs->refused, __ATOMIC_RELAXED),
+			__atomic_load_n(&jobs->timeouts, __ATOMIC_RELAXED),
+			__atomic_load_n(&jobs->killed, __ATOMIC_RELAXED));
+}
@@ -58,37 +58,125 @@ int datesort(const void *a, const void *b)
 }
 
 
+/*
+ * Check whether a directory entry would be left out of the listing
+ * anyway, so there's no need to stat() it
+ */
+static int skip_entry(state *st, struct dirent *d, char vhosts)
+{
+	char known = FALSE;
+	char isdir = FALSE;
+	int i;
+
+	/* Dotfiles are never listed */
+	if (d->d_name[0] == '.') return TRUE;
+
+	/* Entry type is free on most filesystems - symlinks need a stat() */
+#ifdef DT_UNKNOWN
+	if (d->d_type != DT_UNKNOWN && d->d_type != DT_LNK) {
+		known = TRUE;
+		isdir = (d->d_type == DT_DIR);
+	}
+#endif
+
+	/* Virtual hosts are directories with a FQDN */
+	if (vhosts) {
+		if (!strchr(d->d_name, '.')) return TRUE;
+		return (known && !isdir);
+	}
+
+	/* Gophermaps and tags (but not dirs) */
+	if (known && !isdir && (strcmp(d->d_name, st->cfg->map_file) == MATCH ||
+	    strcmp(d->d_name, st->cfg->tag_file) == MATCH)) return TRUE;
+
+	/* Files marked for hiding */
+	for (i = 0; i < st->hidden_count; i++)
+		if (strcmp(d->d_name, st->hidden[i]) == MATCH) return TRUE;
+
+	return FALSE;
+}
+
+
 /*
  * Scan, stat and sort a directory folders first (scandir replacement)
+ * - the list and the names live in the request arena
  */
-static int sortdir(char *path, sdirent *list, int max)
+static int sortdir(state *st, const char *path, sdirent **listp, char vhosts)
 {
 	DIR *dp;
 	struct dirent *d;
 	struct stat s;
-	char buf[BUFSIZE];
+	sdirent *list;
+	sdirent *grown;
+	char *pool;
+	size_t left;
+	size_t len;
+	int size;
+	int num;
+	int fd;
 	int i;
+	int j;
 
 	/* Try to open the dir */
+	*listp = NULL;
 	if ((dp = opendir(path)) == NULL) return 0;
+	fd = dirfd(dp);
+
+	list = NULL;
+	pool = NULL;
+	left = 0;
+	size = 0;
 	i = 0;
 
-	/* Loop through the directory & stat() everything */
-	while (max--) {
+	/* Collect the interesting names */
+	while (i < MAX_SDIRENT) {
 		if ((d = readdir(dp)) == NULL) break;
+		if (skip_entry(st, d, vhosts)) continue;
+
+		/* Double the list when it's full */
+		if (i == size) {
+			size = size ? size * 2 : SDIRENT_CHUNK;
+			if ((grown = arena_alloc(st->conn->arena, sizeof(sdirent) * size)) == NULL) {
+				closedir(dp);
+				return ERROR;
+			}
+			if (i) memcpy(grown, list, sizeof(sdirent) * i);
+			list = grown;
+		}
 
-		snprintf(buf, sizeof(buf), "%s/%s", path, d->d_name);
-		if (stat(buf, &s) == ERROR) continue;
+		/* Pack the names back to back instead of aligning each one */
+		len = strlen(d->d_name) + 1;
+		if (len > left) {
+			if ((pool = arena_alloc(st->conn->arena, SDIRENT_POOL)) == NULL) {
+				closedir(dp);
+				return ERROR;
+			}
+			left = SDIRENT_POOL;
+		}
 
-		if (strlen(d->d_name) > sizeof(list[i].name)) continue;
-		sstrlcpy(list[i].name, d->d_name);
+		memcpy(pool, d->d_name, len);
+		list[i++].name = pool;
+		pool += len;
+		left -= len;
+	}
 
-		list[i].mode  = s.st_mode;
-		list[i].uid   = s.st_uid;
-		list[i].gid   = s.st_gid;
-		list[i].size  = s.st_size;
-		list[i].mtime = s.st_mtime;
-		i++;
+	/* Stat them relative to the directory */
+#ifdef HAVE_URING
+	if (st->conn->ring) i = uring_stat_dir(st->conn->ring, fd, list, i);
+	else
+#endif
+	{
+		for (num = i, i = 0, j = 0; j < num; j++) {
+			if (fstatat(fd, list[j].name, &s, 0) == ERROR) continue;
+
+			list[i].name  = list[j].name;
+			list[i].mode  = s.st_mode;
+			list[i].uid   = s.st_uid;
+			list[i].gid   = s.st_gid;
+			list[i].size  = s.st_size;
+			list[i].mtime = s.st_mtime;
+			i++;
+		}
 	}
 	closedir(dp);
 
@@ -96,6 +184,7 @@ static int sortdir(char *path, sdirent *list, int max)
 	if (i > 1) qsort(list, i, sizeof(sdirent), foldersort);
 
 	/* Return number of entries found */
+	*listp = list;
 	return i;
 }
 
@@ -104,29 +193,39 @@ static int sortdir(char *path, sdirent *list, int max)
  * Print a list of users with ~/public_gopher
  */
 #ifdef HAVE_PASSWD
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t passwd_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 static void userlist(state *st)
 {
 	struct passwd *pwd;
 	struct stat dir;
 	char buf[BUFSIZE];
-	user_date users[MAX_USERS];
-	struct tm *ltime;
+	user_date *users;
+	struct tm ltime;
 	char timestr[20];
 	int width;
 
 	/* Width of filenames for fancy listing */
-	width = st->out_width - DATE_WIDTH - 15;
+	width = st->cfg->out_width - DATE_WIDTH - 15;
+
+	if ((users = arena_alloc(st->conn->arena, sizeof(user_date) * MAX_USERS)) == NULL) return;
+	memset(users, 0, sizeof(user_date) * MAX_USERS);
 
-	/* Loop through all users */
+	/* Loop through all users (getpwent() is shared by all threads) */
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&passwd_lock);
+#endif
 	setpwent();
 	int i = 0;
-	while ((pwd = getpwent())) {
+	while (i < MAX_USERS && (pwd = getpwent())) {
 
 		/* Skip too small uids */
 		if (pwd->pw_uid < PASSWD_MIN_UID) continue;
 
 		/* Look for a world-readable user-owned ~/public_gopher */
-		snprintf(buf, sizeof(buf), "%s/%s", pwd->pw_dir, st->user_dir);
+		snprintf(buf, sizeof(buf), "%s/%s", pwd->pw_dir, st->cfg->user_dir);
 		if (stat(buf, &dir) == ERROR) continue;
 		if ((dir.st_mode & S_IROTH) == 0) continue;
 		if (dir.st_uid != pwd->pw_uid) continue;
@@ -137,6 +236,11 @@ static void userlist(state *st)
 		i++;
 	}
 
+	endpwent();
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&passwd_lock);
+#endif
+
 	/* Sort by date */
 	int true_length = 0;
 	while((users[true_length].user[0] != '\0') && (true_length < MAX_USERS)) true_length++;
@@ -152,21 +256,19 @@ static void userlist(state *st)
 		snprintf(buf, sizeof(buf), USERDIR_FORMAT);
 
 		/* Output */
-		if (st->opt_date) {
-			ltime = localtime(&users[i].mtime);
-			strftime(timestr, sizeof(timestr), DATE_FORMAT, ltime);
+		if (st->cfg->opt_date) {
+			localtime_r(&users[i].mtime, &ltime);
+			strftime(timestr, sizeof(timestr), DATE_FORMAT, &ltime);
 
-			printf("1%-*.*s   %s        -  \t/~%s/\t%s\t%i" CRLF,
+			conn_printf(st->conn, "1%-*.*s   %s        -  \t/~%s/\t%s\t%i" CRLF,
 			    width, width, buf, timestr, users[i].user,
 			    st->server_host, st->server_port);
 		}
 		else {
-			printf("1%.*s\t/~%s/\t%s\t%i" CRLF, st->out_width, buf,
+			conn_printf(st->conn, "1%.*s\t/~%s/\t%s\t%i" CRLF, st->cfg->out_width, buf,
 			    users[i].user, st->server_host_default, st->server_port);
 		}
 	}
-
-	endpwent();
 }
 #endif
 
@@ -176,20 +278,27 @@ static void userlist(state *st)
  */
 static void vhostlist(state *st)
 {
-	sdirent dir[MAX_SDIRENT];
-	struct tm *ltime;
+	sdirent *dir;
+	struct tm ltime;
 	char timestr[20];
 	char buf[BUFSIZE];
 	int width;
 	int num;
 	int i;
 
-	/* Scan the root dir for vhost dirs */
-	num = sortdir(st->server_root, dir, MAX_SDIRENT);
-	if (num < 0) die(st, ERR_NOTFOUND, "WTF?");
+	/* Scan the root dir for vhost dirs unless they're already indexed */
+	if ((num = vhost_cache_list(st, &dir)) == ERROR)
+		num = sortdir(st, st->cfg->server_root, &dir, TRUE);
+	else if (num > 1)
+		qsort(dir, num, sizeof(sdirent), foldersort);
+
+	if (num < 0) {
+		die(st, ERR_NOTFOUND, "WTF?");
+		return;
+	}
 
 	/* Width of filenames for fancy listing */
-	width = st->out_width - DATE_WIDTH - 15;
+	width = st->cfg->out_width - DATE_WIDTH - 15;
 
 	/* Loop through the directory entries */
 	for (i = 0; i < num; i++) {
@@ -208,18 +317,18 @@ static void vhostlist(state *st)
 		snprintf(buf, sizeof(buf), VHOST_FORMAT, dir[i].name);
 
 		/* Fancy listing */
-		if (st->opt_date) {
-			ltime = localtime(&dir[i].mtime);
-			strftime(timestr, sizeof(timestr), DATE_FORMAT, ltime);
+		if (st->cfg->opt_date) {
+			localtime_r(&dir[i].mtime, &ltime);
+			strftime(timestr, sizeof(timestr), DATE_FORMAT, &ltime);
 
-			printf("1%-*.*s   %s		-  \t/;%s\t%s\t%i" CRLF,
+			conn_printf(st->conn, "1%-*.*s   %s		-  \t/;%s\t%s\t%i" CRLF,
 				width, width, buf, timestr, dir[i].name,
 				dir[i].name, st->server_port);
 		}
 
 		/* Teh boring version */
 		else {
-			printf("1%.*s\t/;%s\t%s\t%i" CRLF, st->out_width, buf,
+			conn_printf(st->conn, "1%.*s\t/;%s\t%s\t%i" CRLF, st->cfg->out_width, buf,
 				dir[i].name, dir[i].name, st->server_port);
 		}
 	}
@@ -227,38 +336,76 @@ static void vhostlist(state *st)
 
 
 /*
- * Return gopher filetype for a file
+ * Case-insensitive hash of a file suffix - must match filetypes.sh
  */
-char gopher_filetype(state *st, char *file, char magic)
+#define FTYPE_SLOT(hash, mult, bits) ((((hash) * (mult)) & 0xffffffffUL) >> (32 - (bits)))
+#define FTYPE_MULT 2654435769UL
+
+unsigned long ftype_hash(const char *suffix)
+{
+	unsigned long hash = 5381;
+
+	while (*suffix) hash = (hash * 33 + tolower((unsigned char) *suffix++)) & 0xffffffffUL;
+	return hash;
+}
+
+
+/*
+ * Find a suffix in a table of filetype overrides - returns '\0' if it isn't there
+ */
+static char ftype_override(const ftype *filetype, unsigned long hash, const char *suffix)
 {
-	FILE *fp;
-	char buf[BUFSIZE];
-	char *c;
 	int i;
 
-	/* If it ends with an slash it's a menu */
-	if (!*file) return st->default_filetype;
-	if (strlast(file) == '/') return TYPE_MENU;
+	i = hash & (MAX_FILETYPES - 1);
 
-	/* Get file suffix */
-	if ((c = strrchr(file, '.'))) {
-		c++;
+	while (*filetype[i].suffix) {
+		if (strcasecmp(filetype[i].suffix, suffix) == MATCH)
+			return filetype[i].type;
 
-		/* Loop through the filetype array looking for a match*/
-		for (i = 0; i < st->filetype_count; i++)
-			if (strcasecmp(st->filetype[i].suffix, c) == MATCH)
-				return st->filetype[i].type;
+		i = (i + 1) & (MAX_FILETYPES - 1);
 	}
 
-	/* Are we allowed to look inside files? */
-	if (!magic) return st->default_filetype;
+	return '\0';
+}
 
-	/* Read data from the file */
-	if ((fp = fopen(file , "r")) == NULL) return st->default_filetype;
-	i = fread(buf, 1, sizeof(buf) - 1, fp);
-	buf[i] = '\0';
-	fclose(fp);
 
+/*
+ * Find the gopher filetype of a suffix - returns '\0' if unknown
+ */
+char ftype_lookup(state *st, const char *suffix)
+{
+	static const unsigned long displace[] = { FILETYPE_DISPLACE };
+	static const ftype builtin[] = { FILETYPE_TABLE };
+	unsigned long hash;
+	const ftype *f;
+	char type;
+	int i;
+
+	hash = ftype_hash(suffix);
+
+	/* Overrides from gophermaps, then from -e */
+	if (st->filetype_count > 0 &&
+	    (type = ftype_override(st->filetype, hash, suffix))) return type;
+
+	if (st->cfg->filetype_count > 0 &&
+	    (type = ftype_override(st->cfg->filetype, hash, suffix))) return type;
+
+	/* Built-in table from filetypes.conf is a perfect hash */
+	i = FTYPE_SLOT(hash, FTYPE_MULT, FILETYPE_BUCKET_BITS);
+	f = &builtin[FTYPE_SLOT(hash, FTYPE_MULT + 2 * displace[i], FILETYPE_BITS)];
+
+	if (*f->suffix && strcasecmp(f->suffix, suffix) == MATCH) return f->type;
+	return '\0';
+}
+
+
+/*
+ * Guess filetype from the first bytes of a file - returns
+ * UNKNOWN for plain data that gets the default type
+ */
+static char sniff_content(char *buf, int len)
+{
 	/* GIF images */
 	if (sstrncmp(buf, "GIF89a") == MATCH ||
 		sstrncmp(buf, "GIF87a") == MATCH) return TYPE_GIF;
@@ -290,71 +437,233 @@ char gopher_filetype(state *st, char *file, char magic)
 		sstrncmp(buf, "\037\213\010") == MATCH) return TYPE_GZIP;
 
 	/* Unknown content - binary or text? */
-	if (memchr(buf, '\0', i)) return TYPE_BINARY;
-	return st->default_filetype;
+	if (memchr(buf, '\0', len)) return TYPE_BINARY;
+	return UNKNOWN;
 }
 
 
 /*
- * Handle gophermaps
+ * Return gopher filetype for a file
  */
-static int gophermap(state *st, char *mapfile, int depth)
+char gopher_filetype(state *st, char *file, char magic)
 {
 	FILE *fp;
-	struct stat file;
-	char line[BUFSIZE];
-#ifdef HAVE_POPEN
-	char command[BUFSIZE];
+#ifdef HAVE_SHMEM
+	struct stat s;
 #endif
-	char *selector;
-	char *name;
-	char *host;
+	char buf[BUFSIZE];
+	int type;
 	char *c;
-	char type;
-	int port;
-	int exe;
-	int return_val = QUIT;
+	int i;
 
-	/* Prevent include loops */
-	if (depth > 4) return OK;
+	/* If it ends with an slash it's a menu */
+	if (!*file) return st->cfg->default_filetype;
+	if (strlast(file) == '/') return TYPE_MENU;
 
-	/* Try to figure out whether the map is executable */
-	if (stat(mapfile, &file) == OK) {
-		if ((file.st_mode & S_IXOTH)) {
-#ifdef HAVE_POPEN
-			/* Quote the command in case path has spaces */
-			snprintf(command, sizeof(command), "'%s'", mapfile);
+	/* Get file suffix */
+	if ((c = strrchr(file, '.')) && (type = ftype_lookup(st, c + 1)))
+		return type;
+
+	/* Are we allowed to look inside files? */
+	if (!magic) return st->cfg->default_filetype;
+
+	/* Sniffed this version of the file before? */
+#ifdef HAVE_SHMEM
+	if ((type = sniff_cache_get(file, &s)) != ERROR)
+		return (type == UNKNOWN ? st->cfg->default_filetype : type);
 #endif
-			exe = TRUE;
-		}
-		else exe = FALSE;
-	}
 
-	/* This must be a shell include */
-	else {
-#ifdef HAVE_POPEN
-		/* Let's assume the shell command runs as is without quoting */
-		sstrlcpy(command, mapfile);
+	/* Read data from the file */
+	if ((fp = fopen(file , "re")) == NULL) return st->cfg->default_filetype;
+	i = fread(buf, 1, sizeof(buf) - 1, fp);
+	buf[i] = '\0';
+	fclose(fp);
+
+	type = sniff_content(buf, i);
+#ifdef HAVE_SHMEM
+	sniff_cache_put(&s, type);
 #endif
-		exe = TRUE;
-	}
 
-	log_debug("parsing %s gophermap \"%s\"%s",
-	          exe ? "executable" : "static",
-	          mapfile,
-	          exe && !st->opt_exec ? ": forbidden by `-nx'" : "");
+	return (type == UNKNOWN ? st->cfg->default_filetype : type);
+}
 
-	/* Try to execute or open the mapfile */
-	if (exe & st->opt_exec) {
+
+/*
+ * A gophermap command whose output is being read
+ */
 #ifdef HAVE_POPEN
-		setenv_cgi(st, mapfile);
-		if ((fp = popen(command, "r")) == NULL) return OK;
-#else
-		return OK;
+typedef struct {
+	pid_t pid;	/* 0 when not running */
+	int slot;
+	sigset_t mask;
+} map_exec;
+
+
+/*
+ * Wait for a command started by exec_gophermap() - returns TRUE if it
+ * exited successfully
+ */
+static int exec_gophermap_wait(map_exec *x)
+{
+	int status;
+	int ok;
+
+	ok = (job_wait(x->slot, x->pid, &status) == OK &&
+		WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	signal_mask(SIG_SETMASK, &x->mask, NULL);
+	return ok;
+}
+
+
+/*
+ * Run a gophermap command in the resource directory - like popen()
+ * except the CGI environment is only set up for the child
+ */
+static FILE *exec_gophermap(state *st, char *const argv[], char *mapfile, map_exec *x)
+{
+	FILE *fp;
+	sigset_t sigs;
+	char *shell[3];
+	int fds[2];
+
+	x->pid = 0;
+	if (job_start(st, mapfile, &x->slot) == ERROR) return NULL;
+
+	/* The exit status decides whether the output may be cached */
+	job_waited(x->slot);
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	signal_mask(SIG_BLOCK, &sigs, &x->mask);
+
+	if (pipe_cloexec(fds) == ERROR) goto fail;
+
+	x->pid = spawn_cgi(st, mapfile, argv, STDIN_FILENO, fds[1], FALSE);
+
+	/* Scripts without #! are for the shell, like with execvp() */
+	if (x->pid == ERROR && errno == ENOEXEC && argv[1] == NULL) {
+		shell[0] = "/bin/sh";
+		shell[1] = argv[0];
+		shell[2] = NULL;
+		x->pid = spawn_cgi(st, mapfile, shell, STDIN_FILENO, fds[1], FALSE);
+	}
+	close(fds[1]);
+
+	if (x->pid == ERROR) {
+		close(fds[0]);
+		goto fail;
+	}
+
+	/* Not a process group leader, so no deadline */
+	job_running(x->slot, x->pid, 0);
+
+	/* Read the output */
+	if ((fp = fdopen(fds[0], "r")) == NULL) {
+		close(fds[0]);
+		exec_gophermap_wait(x);
+		x->pid = 0;
+	}
+	return fp;
+
+fail:
+	x->pid = 0;
+	job_cancel(x->slot);
+	signal_mask(SIG_SETMASK, &x->mask, NULL);
+	return NULL;
+}
 #endif
+
+
+/*
+ * Copy a string into a compiled gophermap - returns its offset
+ */
+static int map_string(gmap *m, const char *str)
+{
+	char *strings;
+	int len;
+
+	len = strlen(str) + 1;
+	if ((strings = realloc(m->strings, m->strings_len + len)) == NULL) {
+		m->error = TRUE;
+		return ERROR;
 	}
-	else
-		if ((fp = fopen(mapfile, "r")) == NULL) return OK;
+
+	m->strings = strings;
+	memcpy(m->strings + m->strings_len, str, len);
+	m->strings_len += len;
+
+	return m->strings_len - len;
+}
+
+
+/*
+ * Add a line to a compiled gophermap
+ */
+static void map_add(gmap *m, char op, char type, const char *name,
+	const char *selector, const char *host, int port)
+{
+	map_line *lines;
+	map_line l;
+
+	l.op = op;
+	l.type = type;
+	l.port = port;
+	l.name = map_string(m, name);
+	l.selector = (selector == name) ? l.name : selector ? map_string(m, selector) : ERROR;
+	l.host = host ? map_string(m, host) : ERROR;
+	if (m->error) return;
+
+	if ((lines = realloc(m->lines, sizeof(map_line) * (m->num_lines + 1))) == NULL) {
+		m->error = TRUE;
+		return;
+	}
+
+	m->lines = lines;
+	m->lines[m->num_lines++] = l;
+}
+
+
+/*
+ * Remember a file a gophermap was compiled from - NULL stat if it
+ * didn't exist
+ */
+static void map_depends(gmap *m, const char *file, struct stat *s)
+{
+	map_stamp *files;
+	map_stamp f;
+
+	f.name = map_string(m, file);
+	f.ino = s ? s->st_ino : 0;
+	f.size = s ? s->st_size : 0;
+	f.ctime = s ? s->st_ctime : 0;
+	if (m->error) return;
+
+	if ((files = realloc(m->files, sizeof(map_stamp) * (m->num_files + 1))) == NULL) {
+		m->error = TRUE;
+		return;
+	}
+
+	m->files = files;
+	m->files[m->num_files++] = f;
+}
+
+
+/*
+ * Parse gophermap lines into a compiled gophermap, including static
+ * includes in place - returns OK if the directory listing follows.
+ * exe is set for the output of an executable map.
+ */
+static int compile_gophermap(state *st, gmap *m, FILE *fp, int depth, int exe)
+{
+	FILE *inc;
+	struct stat file;
+	char line[BUFSIZE];
+	char *selector;
+	char *name;
+	char *host;
+	char *c;
+	char type;
+	int port;
+	int fd;
 
 	/* Read lines one by one */
 	while (fgets(line, sizeof(line) - 1, fp)) {
@@ -368,56 +677,79 @@ static int gophermap(state *st, char *mapfile, int depth)
 		if (type == '#') continue;
 
 		/* Stop handling gophermap? */
-		if (type == '*') {
-			return_val = OK;
-			goto CLOSE_FP;
-		}
-		if (type == '.')
-			goto CLOSE_FP;
+		if (type == '*') return OK;
+		if (type == '.') return QUIT;
 
+		/* Executable map output that may be reused for a while */
+		if (type == '^' && exe) {
+			m->ttl = atoi(name);
+			continue;
+		}
 
 		/* Print a list of users with public_gopher */
-		if (type == '~' && st->opt_personal_spaces) {
+		if (type == '~' && st->cfg->opt_personal_spaces) {
 #ifdef HAVE_PASSWD
-			userlist(st);
+			map_add(m, MAP_USERS, type, name, NULL, NULL, ERROR);
 #endif
 			continue;
 		}
 
 		/* Print a list of available virtual hosts */
 		if (type == '%') {
-			if (st->opt_vhost) vhostlist(st);
+			map_add(m, MAP_VHOSTS, type, name, NULL, NULL, ERROR);
 			continue;
 		}
 
 		/* Hide files in menus */
 		if (type == '-') {
-			if (st->hidden_count < MAX_HIDDEN)
-				sstrlcpy(st->hidden[st->hidden_count++], name);
+			map_add(m, MAP_HIDE, type, name, NULL, NULL, ERROR);
 			continue;
 		}
 
 		/* Override filetype mappings */
 		if (type == ':') {
-			add_ftype_mapping(st, name);
+			map_add(m, MAP_FILETYPE, type, name, NULL, NULL, ERROR);
 			continue;
 		}
 
 		/* Include gophermap or shell exec */
 		if (type == '=') {
-			gophermap(st, name, depth + 1);
+
+			/* Prevent include loops */
+			if (depth + 1 > 4) continue;
+
+			/* Static includes are compiled in, the rest run every time */
+			if (fstatat(st->req_dirfd, name, &file, 0) == ERROR ||
+			    ((file.st_mode & S_IXOTH) && st->cfg->opt_exec)) {
+				if (st->cfg->opt_exec) map_add(m, MAP_INCLUDE, type, name, NULL, NULL, depth + 1);
+				else map_depends(m, name, NULL);
+				continue;
+			}
+
+			log_debug("parsing static gophermap \"%s\"", name);
+			map_depends(m, name, &file);
+			m->included = TRUE;
+
+			if ((fd = openat(st->req_dirfd, name, O_RDONLY | O_CLOEXEC)) == ERROR) continue;
+			if ((inc = fdopen(fd, "r")) == NULL) {
+				close(fd);
+				continue;
+			}
+
+			compile_gophermap(st, m, inc, depth + 1, FALSE);
+			fclose(inc);
 			continue;
 		}
 
 		/* Title resource */
 		if (type == TYPE_TITLE) {
-			info(st, name, TYPE_TITLE);
+			map_add(m, MAP_TITLE, type, name, NULL, NULL, ERROR);
 			continue;
 		}
 
 		/* Print out non-resources as info text */
 		if (!strchr(line, '\t')) {
-			info(st, line, TYPE_INFO);
+			map_add(m, MAP_INFO, TYPE_INFO, line, NULL, NULL, ERROR);
 			continue;
 		}
 
@@ -430,78 +762,483 @@ static int gophermap(state *st, char *mapfile, int depth)
 		if (!*selector) selector = name;
 
 		/* Parse host */
-		host = st->server_host;
+		host = NULL;
 		if ((c = strchr(selector, '\t'))) {
 			*c = '\0';
 			host = c + 1;
 		}
 
 		/* Parse port */
-		port = st->server_port;
-		if ((c = strchr(host, '\t'))) {
+		port = ERROR;
+		if (host && (c = strchr(host, '\t'))) {
 			*c = '\0';
 			port = atoi(c + 1);
 		}
 
-		/* Handle remote, absolute and hURL gopher resources */
-		if (sstrncmp(selector, "URL:") == MATCH ||
-			selector[0] == '/' ||
-			host != st->server_host) {
+		/* Remote, absolute and hURL gopher resources are printed as is */
+		if (sstrncmp(selector, "URL:") == MATCH || selector[0] == '/' || host)
+			map_add(m, MAP_LINK, type, name, selector, host, port);
+		else
+			map_add(m, MAP_RELATIVE, type, name, selector, host, port);
+	}
 
-			printf("%c%s\t%s\t%s\t%i" CRLF, type, name,
-				selector, host, port);
-		}
+	return QUIT;
+}
 
-		/* Handle relative resources */
-		else {
-			printf("%c%s\t%s%s\t%s\t%i" CRLF, type, name,
-				st->req_selector, selector, host, port);
 
-			/* Automatically hide manually defined selectors */
+/*
+ * Executable includes are handled on every request
+ */
+static int gophermap(state *st, char *mapfile, int depth);
+
+
+/*
+ * Output a compiled gophermap
+ */
+static int run_gophermap(state *st, gmap *m)
+{
+	map_line *l;
+	char buf[BUFSIZE];
+	char *name;
+	char *selector;
+	char *host;
+	int port;
+	int i;
+
+	if (m->included) st->req_cacheable = FALSE;
+
+	for (i = 0; i < m->num_lines; i++) {
+		l = &m->lines[i];
+		name = m->strings + l->name;
+
+		switch (l->op) {
+			case MAP_INFO: info(st, name, TYPE_INFO); break;
+			case MAP_TITLE: info(st, name, TYPE_TITLE); break;
+
+			case MAP_USERS:
+#ifdef HAVE_PASSWD
+				st->req_cacheable = FALSE;
+				userlist(st);
+#endif
+				break;
+
+			case MAP_VHOSTS:
+				st->req_cacheable = FALSE;
+				if (st->cfg->opt_vhost) vhostlist(st);
+				break;
+
+			case MAP_HIDE:
+				if (st->hidden_count < MAX_HIDDEN)
+					sstrlcpy(st->hidden[st->hidden_count++], name);
+				break;
+
+			case MAP_FILETYPE:
+				/* Request overrides live in the arena and leave the config be */
+				if (!st->filetype &&
+				    (st->filetype = arena_alloc(st->conn->arena, sizeof(ftype) * MAX_FILETYPES)))
+					memset(st->filetype, 0, sizeof(ftype) * MAX_FILETYPES);
+
+				/* The cached map must keep its suffix=X intact */
+				sstrlcpy(buf, name);
+				if (st->filetype) add_ftype_mapping(st->filetype, &st->filetype_count, buf);
+				break;
+
+			case MAP_INCLUDE: gophermap(st, name, l->port); break;
+
+			default:
+				selector = m->strings + l->selector;
+				host = (l->host == ERROR) ? st->server_host : m->strings + l->host;
+				port = (l->port == ERROR) ? st->server_port : l->port;
+
+				if (l->op == MAP_LINK) {
+					conn_printf(st->conn, "%c%s\t%s\t%s\t%i" CRLF, l->type, name,
+						selector, host, port);
+					break;
+				}
+
+				conn_printf(st->conn, "%c%s\t%s%s\t%s\t%i" CRLF, l->type, name,
+					st->req_selector, selector, host, port);
+
+				/* Automatically hide manually defined selectors */
 #ifdef ENABLE_AUTOHIDING
-			if (st->hidden_count < MAX_HIDDEN)
-				sstrlcpy(st->hidden[st->hidden_count++], selector);
+				if (st->hidden_count < MAX_HIDDEN)
+					sstrlcpy(st->hidden[st->hidden_count++], selector);
 #endif
+				break;
 		}
 	}
 
-CLOSE_FP:
+	return m->result;
+}
+
+
+/*
+ * Run an executable gophermap in the background and cache its output
+ * for the next requests - the client gets the stale output meanwhile.
+ * Not for pool threads, only async-signal-safe calls may follow a fork.
+ */
 #ifdef HAVE_POPEN
-	if (exe & st->opt_exec) pclose(fp);
-	else
+static void refresh_gophermap(state *st, char *const argv[], char *mapfile,
+	int depth, const char *key, struct stat *file)
+{
+	FILE *fp;
+	gmap *m;
+	map_exec x;
+	pid_t child;
+	int fd;
+
+	if ((child = fork()) == ERROR) {
+		exec_cache_unlock(st, key);
+		return;
+	}
+	if (child > 0) {
+		waitpid(child, NULL, 0);
+		return;
+	}
+
+	/* Detach so that nobody needs to wait for the refresh */
+	if ((child = fork()) != 0) {
+		if (child == ERROR) exec_cache_unlock(st, key);
+		_exit(EXIT_SUCCESS);
+	}
+
+	/* Don't keep client connections open */
+	if ((fd = open("/dev/null", O_RDWR)) != ERROR) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+	}
+	for (fd = STDERR_FILENO + 1; fd < getdtablesize(); fd++)
+		if (fd != st->req_dirfd) close(fd);
+
+	if ((m = calloc(1, sizeof(gmap))) && (fp = exec_gophermap(st, argv, mapfile, &x))) {
+		m->refs = 1;
+		m->result = compile_gophermap(st, m, fp, depth, TRUE);
+		fclose(fp);
+
+		/* Output of a failed run isn't worth keeping */
+		if (exec_gophermap_wait(&x) && m->ttl > 0) exec_cache_put(st, key, file, m);
+		else exec_cache_drop(st, key);
+	}
+
+	exec_cache_unlock(st, key);
+	_exit(EXIT_SUCCESS);
+}
+#endif
+
+
+/*
+ * Handle gophermaps
+ */
+static int gophermap(state *st, char *mapfile, int depth)
+{
+	FILE *fp;
+	gmap *m;
+	struct stat file;
+	char key[BUFSIZE * 2];
+#ifdef HAVE_POPEN
+	char *argv[4];
+	char output[BUFSIZE * 4];
+	map_exec x;
+	int refresh = FALSE;
+	int threads;
+	int ok;
+	int stale;
+#endif
+	int fd;
+	int exe;
+	int ret;
+
+	/* Prevent include loops */
+	if (depth > 4) return OK;
+#ifdef HAVE_POPEN
+	x.pid = 0;
+#endif
+
+	/* Try to figure out whether the map is executable */
+	if (fstatat(st->req_dirfd, mapfile, &file, 0) == OK) {
+		if ((file.st_mode & S_IXOTH)) {
+#ifdef HAVE_POPEN
+			/* No need for a shell to run a file */
+			argv[0] = mapfile;
+			argv[1] = NULL;
+#endif
+			exe = TRUE;
+		}
+		else exe = FALSE;
+	}
+
+	/* This must be a shell include */
+	else {
+#ifdef HAVE_POPEN
+		/* Let's assume the shell command runs as is without quoting */
+		argv[0] = "/bin/sh";
+		argv[1] = "-c";
+		argv[2] = mapfile;
+		argv[3] = NULL;
+#endif
+		memset(&file, 0, sizeof(file));
+		exe = TRUE;
+	}
+
+	/* Only the directory's own static gophermap is tracked by the menu cache */
+	if (exe || depth > 0) st->req_cacheable = FALSE;
+
+	/* Static gophermaps compiled earlier (relative includes depend on the menu dir) */
+	snprintf(key, sizeof(key), "%s\t%s", st->req_realpath, mapfile);
+	if (!(exe & st->cfg->opt_exec) && (m = map_cache_get(st, key, &file))) {
+		log_debug("using compiled gophermap \"%s\"", mapfile);
+		ret = run_gophermap(st, m);
+		map_release(m);
+		return ret;
+	}
+
+	log_debug("parsing %s gophermap \"%s\"%s",
+	          exe ? "executable" : "static",
+	          mapfile,
+	          exe && !st->cfg->opt_exec ? ": forbidden by `-nx'" : "");
+
+	/* Try to execute or open the mapfile */
+	if (exe & st->cfg->opt_exec) {
+#ifdef HAVE_POPEN
+		/* Output of maps that asked for caching depends on the CGI request */
+		snprintf(output, sizeof(output), "%s\t%s\t%s\t%s\t%s\t%i\t%i\t%i",
+			st->req_realpath, mapfile, st->req_selector, st->req_query_string,
+			st->server_host, st->server_port, st->cfg->out_charset, st->cfg->out_width);
+
+		m = exec_cache_get(st, output, &file, &stale);
+
+		/* Pool threads can't fork, so one of them refreshes in the foreground */
+		threads = (st->cfg->opt_daemon && st->cfg->daemon_engine == ENGINE_THREAD);
+		if (m && stale && threads && exec_cache_lock(st, output) == OK) {
+			if ((fp = exec_gophermap(st, argv, mapfile, &x))) {
+				log_debug("refreshing cached output of \"%s\"", mapfile);
+				map_release(m);
+				m = NULL;
+				refresh = TRUE;
+			}
+			else exec_cache_unlock(st, output);
+		}
+
+		if (m) {
+			log_debug("using cached output of \"%s\"%s", mapfile, stale ? " (stale)" : "");
+			if (stale && !threads && exec_cache_lock(st, output) == OK)
+				refresh_gophermap(st, argv, mapfile, depth, output, &file);
+
+			ret = run_gophermap(st, m);
+			map_release(m);
+			return ret;
+		}
+
+		if (!refresh && (fp = exec_gophermap(st, argv, mapfile, &x)) == NULL) return OK;
+#else
+		return OK;
 #endif
+	}
+	else {
+		if ((fd = openat(st->req_dirfd, mapfile, O_RDONLY | O_CLOEXEC)) == ERROR) return OK;
+		if ((fp = fdopen(fd, "r")) == NULL) {
+			close(fd);
+			return OK;
+		}
+	}
+
+	if ((m = calloc(1, sizeof(gmap))) == NULL) {
 		fclose(fp);
+#ifdef HAVE_POPEN
+		if (x.pid > 0) exec_gophermap_wait(&x);
+		if (refresh) exec_cache_unlock(st, output);
+#endif
+		return OK;
+	}
+	m->refs = 1;
+
+	/* Compile the whole map first - the stat() above is the map itself */
+	map_depends(m, mapfile, &file);
+	m->result = compile_gophermap(st, m, fp, depth, exe & st->cfg->opt_exec);
+
+	fclose(fp);
+#ifdef HAVE_POPEN
+	if (x.pid > 0) {
+
+		/* Output of a failed run isn't worth keeping */
+		ok = exec_gophermap_wait(&x);
+		if (ok) exec_cache_put(st, output, &file, m);
+
+		if (refresh) {
+			if (!ok || m->ttl <= 0) exec_cache_drop(st, output);
+			exec_cache_unlock(st, output);
+		}
+	}
+	else
+#endif
+	map_cache_put(st, key, m);
 
-	return return_val;
+	ret = run_gophermap(st, m);
+	map_release(m);
+	return ret;
 }
 
 
 /*
- * Handle gopher menus
+ * Check whether a scanned directory entry shows up in the menu
  */
-void gopher_menu(state *st)
+static int listed(state *st, sdirent *d)
+{
+	int i;
+
+	/* Skip dotfiles and non world-readables */
+	if (d->name[0] == '.') return FALSE;
+	if ((d->mode & S_IROTH) == 0) return FALSE;
+
+	/* Skip gophermaps and tags (but not dirs) */
+	if ((d->mode & S_IFMT) != S_IFDIR) {
+		if (strcmp(d->name, st->cfg->map_file) == MATCH) return FALSE;
+		if (strcmp(d->name, st->cfg->tag_file) == MATCH) return FALSE;
+
+		/* Skip special files (sockets, fifos etc) */
+		if ((d->mode & S_IFMT) != S_IFREG) return FALSE;
+	}
+
+	/* Skip files marked for hiding */
+	for (i = 0; i < st->hidden_count; i++)
+		if (strcmp(d->name, st->hidden[i]) == MATCH) return FALSE;
+
+	return TRUE;
+}
+
+
+/*
+ * Move a page entry up or down the heap until it's in place - the
+ * last entry in sort order is at the top
+ */
+static void page_sift(sdirent *heap, int num, int i)
+{
+	sdirent tmp;
+	int j;
+
+	/* Up */
+	while (i > 0 && foldersort(&heap[(i - 1) / 2], &heap[i]) < 0) {
+		tmp = heap[i];
+		heap[i] = heap[(i - 1) / 2];
+		heap[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
+	}
+
+	/* Down */
+	while ((j = i * 2 + 1) < num) {
+		if (j + 1 < num && foldersort(&heap[j + 1], &heap[j]) > 0) j++;
+		if (foldersort(&heap[j], &heap[i]) <= 0) break;
+
+		tmp = heap[i];
+		heap[i] = heap[j];
+		heap[j] = tmp;
+		i = j;
+	}
+}
+
+
+/*
+ * Collect the first max listed entries of a directory that sort after
+ * the cursor (if any) - returns the number of entries, sorted, and the
+ * number of all listed entries in *total if it's wanted. Memory use
+ * only depends on max, names are copied into slots of NAME_MAX + 1.
+ */
+static int page_scan(state *st, char *path, sdirent *heap, int max,
+	sdirent *cursor, int *total)
+{
+	DIR *dp;
+	struct dirent *d;
+	struct stat s;
+	sdirent e;
+	char *name;
+	int num = 0;
+	int fd;
+	int i;
+
+	if (total) *total = 0;
+	if ((dp = opendir(path)) == NULL) return 0;
+	fd = dirfd(dp);
+
+	while ((d = readdir(dp))) {
+		if (skip_entry(st, d, FALSE)) continue;
+		e.name = d->d_name;
+		e.mode = 0;
+
+		/* Leave out what can't make it without stat()ing it, unless counting */
+#ifdef DT_UNKNOWN
+		if (d->d_type == DT_DIR) e.mode = S_IFDIR;
+		if (d->d_type == DT_REG) e.mode = S_IFREG;
+#endif
+		if (e.mode && !total && ((cursor && foldersort(&e, cursor) <= 0) ||
+		    (num == max && foldersort(&e, &heap[0]) >= 0))) continue;
+
+		if (fstatat(fd, d->d_name, &s, 0) == ERROR) continue;
+		e.mode  = s.st_mode;
+		e.uid   = s.st_uid;
+		e.gid   = s.st_gid;
+		e.size  = s.st_size;
+		e.mtime = s.st_mtime;
+
+		if (!listed(st, &e)) continue;
+		if (total) (*total)++;
+
+		if (cursor && foldersort(&e, cursor) <= 0) continue;
+
+		/* Take a free slot or replace the last entry on the heap */
+		if (num < max) i = num++;
+		else if (foldersort(&e, &heap[0]) < 0) i = 0;
+		else continue;
+
+		name = heap[i].name;
+		heap[i] = e;
+		heap[i].name = name;
+		memcpy(name, d->d_name, strlen(d->d_name) + 1);
+		page_sift(heap, num, i);
+	}
+
+	/* Sort the survivors */
+	if (num > 1) qsort(heap, num, sizeof(sdirent), foldersort);
+	closedir(dp);
+	return num;
+}
+
+
+/*
+ * Render a gopher menu from the directory contents
+ */
+static void render_menu(state *st)
 {
 	FILE *fp;
-	sdirent dir[MAX_SDIRENT];
-	struct tm *ltime;
+	sdirent *dir;
+	sdirent cursor;
+	struct tm ltime;
 	struct stat file;
 	char buf[BUFSIZE];
 	char pathname[BUFSIZE];
 	char displayname[BUFSIZE];
 	char encodedname[BUFSIZE];
+	char cursorname[NAME_MAX + 1];
 	char timestr[20];
 	char sizestr[20];
 	char *parent;
 	char *c;
 	char type;
 	int width;
+	int window;
+	int skipped;
+	int pages;
+	int page;
+	int first;
+	int last;
+	int shown;
 	int num;
 	int i;
 	int n;
 
 	/* Check for a gophermap */
 	snprintf(pathname, sizeof(pathname), "%s/%s",
-		st->req_realpath, st->map_file);
+		st->req_realpath, st->cfg->map_file);
 
 	if (stat(pathname, &file) == OK &&
 		(file.st_mode & S_IFMT) == S_IFREG) {
@@ -516,7 +1253,7 @@ void gopher_menu(state *st)
 	else {
 		/* Check for a gophertag */
 		snprintf(pathname, sizeof(pathname), "%s/%s",
-			st->req_realpath, st->tag_file);
+			st->req_realpath, st->cfg->tag_file);
 
 		if (stat(pathname, &file) == OK &&
 			(file.st_mode & S_IFMT) == S_IFREG) {
@@ -534,13 +1271,13 @@ void gopher_menu(state *st)
 		}
 
 		/* No gophermap or tag found - print default header */
-		else if (st->opt_header) {
+		else if (st->cfg->opt_header) {
 
 			/* Use the selector as menu title */
 			sstrlcpy(displayname, st->req_selector);
 
 			/* Shorten too long titles */
-			while (strlen(displayname) > (st->out_width - sizeof(HEADER_FORMAT))) {
+			while (strlen(displayname) > (st->cfg->out_width - sizeof(HEADER_FORMAT))) {
 				if ((c = strchr(displayname, '/')) == NULL) break;
 
 				if (!*++c) break;
@@ -554,12 +1291,31 @@ void gopher_menu(state *st)
 		}
 	}
 
-	/* Scan the directory */
-	num = sortdir(st->req_realpath, dir, MAX_SDIRENT);
-	if (num < 0) die(st, ERR_NOTFOUND, "WTF?");
+	/* Scan the directory - only a window at a time when paging */
+	window = 0;
+	if (st->cfg->out_page_size > 0) {
+		window = st->cfg->out_page_size;
+		if (window < PAGE_WINDOW) window = PAGE_WINDOW;
+		if (window > MAX_SDIRENT) window = MAX_SDIRENT;
+
+		if ((dir = arena_alloc(st->conn->arena, sizeof(sdirent) * window)) == NULL ||
+		    (c = arena_alloc(st->conn->arena, (size_t) window * (NAME_MAX + 1))) == NULL) {
+			die(st, ERR_NOTFOUND, "Out of memory");
+			return;
+		}
+		for (i = 0; i < window; i++) dir[i].name = c + (size_t) i * (NAME_MAX + 1);
+
+		num = page_scan(st, st->req_realpath, dir, window, NULL, &shown);
+	}
+	else num = sortdir(st, st->req_realpath, &dir, FALSE);
+
+	if (num < 0) {
+		die(st, ERR_NOTFOUND, "Out of memory");
+		return;
+	}
 
 	/* Create link to parent directory */
-	if (st->opt_parent) {
+	if (st->cfg->opt_parent) {
 		sstrlcpy(buf, st->req_selector);
 		parent = dirname(buf);
 
@@ -570,40 +1326,73 @@ void gopher_menu(state *st)
 			if (strcmp(parent, ROOT) == MATCH) parent++;
 
 			/* Print link */
-			printf("1%-*s\t%s/\t%s\t%i" CRLF,
-				st->opt_date ? (st->out_width - 1) : (int) strlen(PARENT),
+			conn_printf(st->conn, "1%-*s\t%s/\t%s\t%i" CRLF,
+				st->cfg->opt_date ? (st->cfg->out_width - 1) : (int) strlen(PARENT),
 				PARENT, parent, st->server_host, st->server_port);
 		}
 	}
 
+	/* Split huge directories into pages */
+	first = 0;
+	last = num;
+	pages = 1;
+	page = 1;
+
+	if (st->cfg->out_page_size > 0) {
+		pages = (shown + st->cfg->out_page_size - 1) / st->cfg->out_page_size;
+		if (pages < 1) pages = 1;
+
+		if (sstrncmp(st->req_query_string, "page=") == MATCH)
+			page = atoi(st->req_query_string + 5);
+		if (page < 1) page = 1;
+		if (page > pages) page = pages;
+
+		/* Jump to the furthest window an earlier request found the start of */
+		first = (page - 1) * st->cfg->out_page_size;
+		skipped = 0;
+		if (first + st->cfg->out_page_size > num && num == window &&
+		    (n = page_cursor_get(st, window, first / window, &cursor,
+		                         cursorname, sizeof(cursorname))) > 0) {
+			skipped = n * window;
+			first -= skipped;
+			num = page_scan(st, st->req_realpath, dir, window, &cursor, NULL);
+		}
+
+		/* Move the window forward until the page fits in it */
+		while (first > 0 && first + st->cfg->out_page_size > num && num == window) {
+			n = (first < num) ? first : num;
+			sstrlcpy(cursorname, dir[n - 1].name);
+			cursor = dir[n - 1];
+			cursor.name = cursorname;
+
+			first -= n;
+			skipped += n;
+			if (n == window) page_cursor_put(st, window, skipped / window, &cursor);
+			num = page_scan(st, st->req_realpath, dir, window, &cursor, NULL);
+		}
+
+		if (first > num) first = num;
+		last = first + st->cfg->out_page_size;
+	}
+
 	/* Width of filenames for fancy listing */
-	width = st->out_width - DATE_WIDTH - 15;
+	width = st->cfg->out_width - DATE_WIDTH - 15;
 
 	/* Loop through the directory entries */
-	for (i = 0; i < num; i++) {
+	for (i = 0, shown = 0; i < num; i++) {
+		if (!listed(st, &dir[i])) continue;
+
+		/* Only the requested page */
+		if (shown++ < first) continue;
+		if (shown > last) break;
 
 		/* Get full path+name */
 		snprintf(pathname, sizeof(pathname), "%s/%s",
 			st->req_realpath, dir[i].name);
 
-		/* Skip dotfiles and non world-readables */
-		if (dir[i].name[0] == '.') continue;
-		if ((dir[i].mode & S_IROTH) == 0) continue;
-
-		/* Skip gophermaps and tags (but not dirs) */
-		if ((dir[i].mode & S_IFMT) != S_IFDIR) {
-			if (strcmp(dir[i].name, st->map_file) == MATCH) continue;
-			if (strcmp(dir[i].name, st->tag_file) == MATCH) continue;
-		}
-
-		/* Skip files marked for hiding */
-		for (n = 0; n < st->hidden_count; n++)
-			if (strcmp(dir[i].name, st->hidden[n]) == MATCH) break;
-		if (n < st->hidden_count) continue;	/* Cruel hack... */
-
 		/* Generate display name with correct output charset */
-		if (st->opt_iconv)
-			sstrniconv(st->out_charset, displayname, dir[i].name);
+		if (st->cfg->opt_iconv)
+			sstrniconv(st->cfg->out_charset, displayname, dir[i].name);
 		else
 			sstrlcpy(displayname, dir[i].name);
 
@@ -611,7 +1400,8 @@ void gopher_menu(state *st)
 		strnencode(encodedname, dir[i].name, sizeof(encodedname));
 
 		/* Handle inline .gophermap */
-		if (strstr(displayname, st->map_file) > displayname) {
+		if (strstr(displayname, st->cfg->map_file) > displayname) {
+			st->req_cacheable = FALSE;
 			gophermap(st, pathname, 0);
 			continue;
 		}
@@ -621,7 +1411,7 @@ void gopher_menu(state *st)
 
 			/* Check for a gophertag */
 			snprintf(buf, sizeof(buf), "%s/%s",
-				pathname, st->tag_file);
+				pathname, st->cfg->tag_file);
 
 			if (stat(buf, &file) == OK &&
 				(file.st_mode & S_IFMT) == S_IFREG) {
@@ -637,7 +1427,7 @@ void gopher_menu(state *st)
 					if (*buf) {
 
 						/* Convert to output charset */
-						if (st->opt_iconv) sstrniconv(st->out_charset, displayname, buf);
+						if (st->cfg->opt_iconv) sstrniconv(st->cfg->out_charset, displayname, buf);
 						else sstrlcpy(displayname, buf);
 					}
 
@@ -645,15 +1435,15 @@ void gopher_menu(state *st)
 			}
 
 			/* Dir listing with dates */
-			if (st->opt_date) {
-				ltime = localtime(&dir[i].mtime);
-				strftime(timestr, sizeof(timestr), DATE_FORMAT, ltime);
+			if (st->cfg->opt_date) {
+				localtime_r(&dir[i].mtime, &ltime);
+				strftime(timestr, sizeof(timestr), DATE_FORMAT, &ltime);
 
 				/* Hack to get around UTF-8 byte != char */
 				n = width - strcut(displayname, width);
 				strrepeat(buf, ' ', n);
 
-				printf("1%s%s   %s   --------\t%s%s/\t%s\t%i" CRLF,
+				conn_printf(st->conn, "1%s%s   %s   --------\t%s%s/\t%s\t%i" CRLF,
 					displayname,
 					buf,
 					timestr,
@@ -665,8 +1455,8 @@ void gopher_menu(state *st)
 
 			/* Regular dir listing */
 			else {
-				strcut(displayname, st->out_width);
-				printf("1%s\t%s%s/\t%s\t%i" CRLF,
+				strcut(displayname, st->cfg->out_width);
+				conn_printf(st->conn, "1%s\t%s%s/\t%s\t%i" CRLF,
 					displayname,
 					st->req_selector,
 					encodedname,
@@ -677,23 +1467,20 @@ void gopher_menu(state *st)
 			continue;
 		}
 
-		/* Skip special files (sockets, fifos etc) */
-		if ((dir[i].mode & S_IFMT) != S_IFREG) continue;
-
 		/* Get file type */
-		type = gopher_filetype(st, pathname, st->opt_magic);
+		type = gopher_filetype(st, pathname, st->cfg->opt_magic);
 
 		/* File listing with dates & sizes */
-		if (st->opt_date) {
-			ltime = localtime(&dir[i].mtime);
-			strftime(timestr, sizeof(timestr), DATE_FORMAT, ltime);
+		if (st->cfg->opt_date) {
+			localtime_r(&dir[i].mtime, &ltime);
+			strftime(timestr, sizeof(timestr), DATE_FORMAT, &ltime);
 			strfsize(sizestr, dir[i].size, sizeof(sizestr));
 
 			/* Hack to get around UTF-8 byte != char */
 			n = width - strcut(displayname, width);
 			strrepeat(buf, ' ', n);
 
-			printf("%c%s%s   %s %s\t%s%s\t%s\t%i" CRLF, type,
+			conn_printf(st->conn, "%c%s%s   %s %s\t%s%s\t%s\t%i" CRLF, type,
 				displayname,
 				buf,
 				timestr,
@@ -706,8 +1493,8 @@ void gopher_menu(state *st)
 
 		/* Regular file listing */
 		else {
-			strcut(displayname, st->out_width);
-			printf("%c%s\t%s%s\t%s\t%i" CRLF, type,
+			strcut(displayname, st->cfg->out_width);
+			conn_printf(st->conn, "%c%s\t%s%s\t%s\t%i" CRLF, type,
 				displayname,
 				st->req_selector,
 				encodedname,
@@ -716,6 +1503,52 @@ void gopher_menu(state *st)
 		}
 	}
 
+	/* Links to the neighbouring pages */
+	if (pages > 1) {
+		info(st, EMPTY, TYPE_INFO);
+		snprintf(buf, sizeof(buf), PAGE_FORMAT, page, pages);
+		info(st, buf, TYPE_INFO);
+
+		if (page > 1)
+			conn_printf(st->conn, "1%s\t%s?page=%i\t%s\t%i" CRLF, PREV_PAGE,
+				st->req_selector, page - 1, st->server_host, st->server_port);
+		if (page < pages)
+			conn_printf(st->conn, "1%s\t%s?page=%i\t%s\t%i" CRLF, NEXT_PAGE,
+				st->req_selector, page + 1, st->server_host, st->server_port);
+	}
+
 	/* Print footer */
 	footer(st);
 }
+
+
+/*
+ * Print a gopher menu - from the cache if it's still valid
+ */
+void gopher_menu(state *st)
+{
+	conn *c = st->conn;
+	menu_stamp stamp;
+	size_t start;
+	char defer;
+
+	/* One-shot inetd processes would never see a cache hit */
+	if (!st->cfg->opt_cache || !st->cfg->opt_daemon) {
+		render_menu(st);
+		return;
+	}
+
+	if (menu_cache_send(st, &stamp) == OK) return;
+
+	/* Keep the whole menu in the buffer so it can be saved */
+	start = c->len;
+	defer = c->defer;
+	c->defer = TRUE;
+	st->req_cacheable = TRUE;
+
+	render_menu(st);
+
+	if (st->req_cacheable && !c->error)
+		menu_cache_store(st, &stamp, c->buf + start, c->len - start);
+	c->defer = defer;
+}
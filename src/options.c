@@ -31,9 +31,9 @@
 
 
 /*
- * Add one suffix->filetype mapping to the filetypes array
+ * Add one suffix->filetype mapping to a table of filetype overrides
  */
-void add_ftype_mapping(state *st, char *suffix)
+void add_ftype_mapping(ftype *filetype, int *count, char *suffix)
 {
 	char *type;
 	int i;
@@ -45,22 +45,26 @@ void add_ftype_mapping(state *st, char *suffix)
 	/* Extract type from the suffix=X string */
 	*type++ = '\0';
 	if (!*type) return;
+	if (strlen(suffix) >= sizeof(filetype[0].suffix)) return;
 
-	/* Loop through the filetype array */
-	for (i = 0; i < st->filetype_count; i++) {
+	/* Find the old entry or a free slot */
+	i = ftype_hash(suffix) & (MAX_FILETYPES - 1);
+	while (*filetype[i].suffix) {
 
 		/* Old entry found? */
-		if (strcasecmp(st->filetype[i].suffix, suffix) == MATCH) {
-			st->filetype[i].type = *type;
+		if (strcasecmp(filetype[i].suffix, suffix) == MATCH) {
+			filetype[i].type = *type;
 			return;
 		}
+
+		i = (i + 1) & (MAX_FILETYPES - 1);
 	}
 
-	/* No old entry found - add new entry */
-	if (i < MAX_FILETYPES) {
-		sstrlcpy(st->filetype[i].suffix, suffix);
-		st->filetype[i].type = *type;
-		st->filetype_count++;
+	/* No old entry found - add new entry (keeping the hash half empty) */
+	if (*count < MAX_FILETYPES / 2) {
+		sstrlcpy(filetype[i].suffix, suffix);
+		filetype[i].type = *type;
+		(*count)++;
 	}
 }
 
@@ -68,7 +72,7 @@ void add_ftype_mapping(state *st, char *suffix)
 /*
  * Add one selector rewrite mapping to the array
  */
-static void add_rewrite_mapping(state *st, char *match)
+static void add_rewrite_mapping(config *cfg, char *match)
 {
 	char *replace;
 
@@ -80,10 +84,10 @@ static void add_rewrite_mapping(state *st, char *match)
 	if (!*replace) return;
 
 	/* Insert match/replace values into the array */
-	if (st->rewrite_count < MAX_REWRITE) {
-		sstrlcpy(st->rewrite[st->rewrite_count].match, match);
-		sstrlcpy(st->rewrite[st->rewrite_count].replace, replace);
-		st->rewrite_count++;
+	if (cfg->rewrite_count < MAX_REWRITE) {
+		sstrlcpy(cfg->rewrite[cfg->rewrite_count].match, match);
+		sstrlcpy(cfg->rewrite[cfg->rewrite_count].replace, replace);
+		cfg->rewrite_count++;
 	}
 }
 
@@ -91,7 +95,7 @@ static void add_rewrite_mapping(state *st, char *match)
 /*
  * Parse command-line arguments
  */
-void parse_args(state *st, int argc, char *argv[])
+void parse_args(config *cfg, int argc, char *argv[])
 {
 	FILE *fp;
 	static const char readme[] = README;
@@ -105,63 +109,96 @@ void parse_args(state *st, int argc, char *argv[])
 #ifdef __OpenBSD__
 		"U:" /* extra unveil(2) paths are OpenBSD only */
 #endif
-		"h:p:T:r:t:g:a:c:u:m:l:w:o:s:i:k:f:e:R:D:L:A:P:n:dbv?-")) != ERROR) {
+		"h:p:T:r:t:g:a:c:u:m:l:w:M:o:s:i:k:I:J:j:x:q:Q:f:C:F:e:R:D:L:A:P:W:E:n:SZYKdbv?-")) != ERROR) {
 		switch(opt) {
-			case 'h': sstrlcpy(st->server_host, optarg); break;
-			case 'p': st->server_port = atoi(optarg); break;
-			case 'T': st->server_tls_port = atoi(optarg); break;
-			case 'r': sstrlcpy(st->server_root, optarg); break;
-			case 't': st->default_filetype = *optarg; break;
-			case 'g': sstrlcpy(st->map_file, optarg); break;
-			case 'a': sstrlcpy(st->tag_file, optarg); break;
-			case 'c': sstrlcpy(st->cgi_file, optarg); break;
-			case 'u': sstrlcpy(st->user_dir, optarg);  break;
+			case 'h': sstrlcpy(cfg->server_host, optarg); break;
+			case 'p': cfg->server_port = atoi(optarg); break;
+			case 'T': cfg->server_tls_port = atoi(optarg); break;
+			case 'r': sstrlcpy(cfg->server_root, optarg); break;
+			case 't': cfg->default_filetype = *optarg; break;
+			case 'g': sstrlcpy(cfg->map_file, optarg); break;
+			case 'a': sstrlcpy(cfg->tag_file, optarg); break;
+			case 'c': sstrlcpy(cfg->cgi_file, optarg); break;
+			case 'u': sstrlcpy(cfg->user_dir, optarg);  break;
 			case 'm': /* obsolete, replaced by -l */
-			case 'l': sstrlcpy(st->log_file, optarg);  break;
+			case 'l': sstrlcpy(cfg->log_file, optarg);  break;
 
-			case 'w': st->out_width = atoi(optarg); break;
+			case 'w': cfg->out_width = atoi(optarg); break;
+			case 'M': cfg->out_page_size = atoi(optarg); break;
 			case 'o':
-				if (sstrncasecmp(optarg, "UTF-8") == MATCH) st->out_charset = UTF_8;
-				if (sstrncasecmp(optarg, "US-ASCII") == MATCH) st->out_charset = US_ASCII;
-				if (sstrncasecmp(optarg, "ISO-8859-1") == MATCH) st->out_charset = ISO_8859_1;
+				if (sstrncasecmp(optarg, "UTF-8") == MATCH) cfg->out_charset = UTF_8;
+				if (sstrncasecmp(optarg, "US-ASCII") == MATCH) cfg->out_charset = US_ASCII;
+				if (sstrncasecmp(optarg, "ISO-8859-1") == MATCH) cfg->out_charset = ISO_8859_1;
 				break;
 
-			case 's': st->session_timeout = atoi(optarg); break;
-			case 'i': st->session_max_kbytes = abs(atoi(optarg)); break;
-			case 'k': st->session_max_hits = abs(atoi(optarg)); break;
-
-			case 'f': sstrlcpy(st->filter_dir, optarg); break;
-			case 'e': add_ftype_mapping(st, optarg); break;
-
-			case 'R': add_rewrite_mapping(st, optarg); break;
-			case 'D': sstrlcpy(st->server_description, optarg); break;
-			case 'L': sstrlcpy(st->server_location, optarg); break;
-			case 'A': sstrlcpy(st->server_admin, optarg); break;
+			case 's': cfg->session_timeout = atoi(optarg); break;
+			case 'i': cfg->session_max_kbytes = abs(atoi(optarg)); break;
+			case 'k': cfg->session_max_hits = abs(atoi(optarg)); break;
+			case 'I': cfg->session_slots = min(abs(atoi(optarg)), MAX_SESSIONS); break;
+
+			case 'J': cfg->cgi_jobs = min(abs(atoi(optarg)), JOB_SLOTS); break;
+			case 'j': cfg->cgi_script_jobs = abs(atoi(optarg)); break;
+			case 'x': cfg->cgi_timeout = abs(atoi(optarg)); break;
+			case 'q': cfg->cgi_cpu = abs(atoi(optarg)); break;
+			case 'Q': cfg->cgi_mbytes = abs(atoi(optarg)); break;
+
+			case 'f': sstrlcpy(cfg->filter_dir, optarg); break;
+			case 'C': sstrlcpy(cfg->cache_dir, optarg); break;
+			case 'F': sstrlcpy(cfg->fcgi_dir, optarg); break;
+			case 'K': cfg->opt_filter_cache = TRUE; break;
+			case 'e': add_ftype_mapping(cfg->filetype, &cfg->filetype_count, optarg); break;
+
+			case 'R': add_rewrite_mapping(cfg, optarg); break;
+			case 'D': sstrlcpy(cfg->server_description, optarg); break;
+			case 'L': sstrlcpy(cfg->server_location, optarg); break;
+			case 'A': sstrlcpy(cfg->server_admin, optarg); break;
+
+			case 'S': cfg->opt_daemon = TRUE; break;
+			case 'Z': cfg->opt_reuseport = TRUE; break;
+			case 'Y': cfg->opt_affinity = TRUE; break;
+			case 'W': cfg->daemon_workers = atoi(optarg); break;
+			case 'E':
+				if (strcasecmp(optarg, "prefork") == MATCH) cfg->daemon_engine = ENGINE_PREFORK;
+#ifdef HAVE_EPOLL
+				else if (strcasecmp(optarg, "epoll") == MATCH) cfg->daemon_engine = ENGINE_EPOLL;
+#endif
+#ifdef HAVE_URING
+				else if (strcasecmp(optarg, "uring") == MATCH) cfg->daemon_engine = ENGINE_URING;
+#endif
+#ifdef HAVE_PTHREAD
+				else if (strcasecmp(optarg, "thread") == MATCH) cfg->daemon_engine = ENGINE_THREAD;
+#endif
+				else {
+					fprintf(stderr, "%s: unknown or unsupported engine \"%s\"\n", argv[0], optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
 #ifdef __OpenBSD__
-			case 'U': st->extra_unveil_paths = optarg; break;
+			case 'U': cfg->extra_unveil_paths = optarg; break;
 #endif
 			case 'n':
-				if (*optarg == 'v') { st->opt_vhost = FALSE; break; }
-				if (*optarg == 'l') { st->opt_parent = FALSE; break; }
-				if (*optarg == 'h') { st->opt_header = FALSE; break; }
-				if (*optarg == 'f') { st->opt_footer = FALSE; break; }
-				if (*optarg == 'd') { st->opt_date = FALSE; break; }
-				if (*optarg == 'c') { st->opt_magic = FALSE; break; }
-				if (*optarg == 'o') { st->opt_iconv = FALSE; break; }
-				if (*optarg == 'q') { st->opt_query = FALSE; break; }
-				if (*optarg == 's') { st->opt_syslog = FALSE; break; }
-				if (*optarg == 'a') { st->opt_caps = FALSE; break; }
-				if (*optarg == 't') { st->opt_status = FALSE; break; }
-				if (*optarg == 'm') { st->opt_shm = FALSE; break; }
-				if (*optarg == 'r') { st->opt_root = FALSE; break; }
-				if (*optarg == 'p') { st->opt_proxy = FALSE; break; }
-				if (*optarg == 'x') { st->opt_exec = FALSE; break; }
-				if (*optarg == 'u') { st->opt_personal_spaces = FALSE; break; }
-				if (*optarg == 'H') { st->opt_http_requests = FALSE; break; }
-				if (*optarg == 'g') { st->opt_plus_menu = FALSE; break; }
+				if (*optarg == 'v') { cfg->opt_vhost = FALSE; break; }
+				if (*optarg == 'l') { cfg->opt_parent = FALSE; break; }
+				if (*optarg == 'h') { cfg->opt_header = FALSE; break; }
+				if (*optarg == 'f') { cfg->opt_footer = FALSE; break; }
+				if (*optarg == 'd') { cfg->opt_date = FALSE; break; }
+				if (*optarg == 'c') { cfg->opt_magic = FALSE; break; }
+				if (*optarg == 'o') { cfg->opt_iconv = FALSE; break; }
+				if (*optarg == 'q') { cfg->opt_query = FALSE; break; }
+				if (*optarg == 's') { cfg->opt_syslog = FALSE; break; }
+				if (*optarg == 'a') { cfg->opt_caps = FALSE; break; }
+				if (*optarg == 't') { cfg->opt_status = FALSE; break; }
+				if (*optarg == 'm') { cfg->opt_shm = FALSE; break; }
+				if (*optarg == 'r') { cfg->opt_root = FALSE; break; }
+				if (*optarg == 'p') { cfg->opt_proxy = FALSE; break; }
+				if (*optarg == 'x') { cfg->opt_exec = FALSE; break; }
+				if (*optarg == 'u') { cfg->opt_personal_spaces = FALSE; break; }
+				if (*optarg == 'H') { cfg->opt_http_requests = FALSE; break; }
+				if (*optarg == 'g') { cfg->opt_plus_menu = FALSE; break; }
+				if (*optarg == 'C') { cfg->opt_cache = FALSE; break; }
 				break;
 
-			case 'd': st->debug = TRUE; break;
+			case 'd': cfg->debug = TRUE; break;
 			case 'b': puts(license); exit(EXIT_SUCCESS);
 
 			case 'v':
@@ -173,40 +210,47 @@ void parse_args(state *st, int argc, char *argv[])
 	}
 
 	/* Sanitize options */
-	if (st->out_width > MAX_WIDTH) st->out_width = MAX_WIDTH;
-	if (st->out_width < MIN_WIDTH) st->out_width = MIN_WIDTH;
-	if (st->out_width < MIN_WIDTH + DATE_WIDTH) st->opt_date = FALSE;
-	if (!st->opt_syslog) st->debug = FALSE;
+	if (cfg->out_width > MAX_WIDTH) cfg->out_width = MAX_WIDTH;
+	if (cfg->out_width < MIN_WIDTH) cfg->out_width = MIN_WIDTH;
+	if (cfg->out_width < MIN_WIDTH + DATE_WIDTH) cfg->opt_date = FALSE;
+	if (cfg->out_page_size < 0 || !cfg->opt_query) cfg->out_page_size = 0;
+	if (!cfg->opt_syslog) cfg->debug = FALSE;
 
 	/* Primary vhost directory must exist or we disable vhosting */
-	if (st->opt_vhost) {
-		snprintf(buf, sizeof(buf), "%s/%s", st->server_root, st->server_host);
-		if (stat(buf, &file) == ERROR) st->opt_vhost = FALSE;
+	if (cfg->opt_vhost) {
+		snprintf(buf, sizeof(buf), "%s/%s", cfg->server_root, cfg->server_host);
+		if (stat(buf, &file) == ERROR) cfg->opt_vhost = FALSE;
 	}
 
+	/* Cache directory must be a directory */
+	if (*cfg->cache_dir && (stat(cfg->cache_dir, &file) == ERROR ||
+	    (file.st_mode & S_IFMT) != S_IFDIR)) strclear(cfg->cache_dir);
+	if (*cfg->fcgi_dir && (stat(cfg->fcgi_dir, &file) == ERROR ||
+	    (file.st_mode & S_IFMT) != S_IFDIR)) strclear(cfg->fcgi_dir);
+
 	/* If -D arg looks like a file load the file contents */
-	if (*st->server_description == '/') {
+	if (*cfg->server_description == '/') {
 
-		if ((fp = fopen(st->server_description , "r"))) {
-			if (fgets(st->server_description, sizeof(st->server_description), fp) == NULL)
-				strclear(st->server_description);
+		if ((fp = fopen(cfg->server_description , "r"))) {
+			if (fgets(cfg->server_description, sizeof(cfg->server_description), fp) == NULL)
+				strclear(cfg->server_description);
 
-			chomp(st->server_description);
+			chomp(cfg->server_description);
 			fclose(fp);
 		}
-		else strclear(st->server_description);
+		else strclear(cfg->server_description);
 	}
 
 	/* If -L arg looks like a file load the file contents */
-	if (*st->server_location == '/') {
+	if (*cfg->server_location == '/') {
 
-		if ((fp = fopen(st->server_location , "r"))) {
-			if (fgets(st->server_location, sizeof(st->server_location), fp) == NULL)
-				strclear(st->server_description);
+		if ((fp = fopen(cfg->server_location , "r"))) {
+			if (fgets(cfg->server_location, sizeof(cfg->server_location), fp) == NULL)
+				strclear(cfg->server_description);
 
-			chomp(st->server_location);
+			chomp(cfg->server_location);
 			fclose(fp);
 		}
-		else strclear(st->server_location);
+		else strclear(cfg->server_location);
 	}
 }
@@ -33,7 +33,7 @@
 /*
  * Get OS name, version & architecture we're running on
  */
-void platform(state *st)
+void platform(config *cfg)
 {
 #ifdef HAVE_UNAME
 #if defined(_AIX) || defined(__linux) || defined(__APPLE__)
@@ -78,12 +78,12 @@ void platform(state *st)
 	}
 
 	/* Get hardware name using shell uname */
-	if (!*st->server_description &&
+	if (!*cfg->server_description &&
 		(fp = popen("/usr/bin/uname -M", "r"))) {
 
-		if (fgets(st->server_description, sizeof(st->server_description), fp) != NULL) {
-			strreplace(st->server_description, ',', ' ');
-			chomp(st->server_description);
+		if (fgets(cfg->server_description, sizeof(cfg->server_description), fp) != NULL) {
+			strreplace(cfg->server_description, ',', ' ');
+			chomp(cfg->server_description);
 		}
 		pclose(fp);
 	}
@@ -104,18 +104,18 @@ void platform(state *st)
 	}
 
 	/* Get hardware name */
-	if (!*st->server_description &&
+	if (!*cfg->server_description &&
 		(fp = popen("/usr/sbin/sysctl -n hw.model", "r"))) {
 
 		/* Read hardware name */
 		if (fgets(buf, sizeof(buf), fp) != NULL) {
 
 			/* Clones are gone now so we'll hardcode the manufacturer */
-			sstrlcpy(st->server_description, "Apple ");
-			sstrlcat(st->server_description, buf);
+			sstrlcpy(cfg->server_description, "Apple ");
+			sstrlcat(cfg->server_description, buf);
 
 			/* Remove hardware revision */
-			for (c = st->server_description; *c; c++)
+			for (c = cfg->server_description; *c; c++)
 				if (*c >= '0' && *c <= '9') { *c = '\0'; break; }
 		}
 		pclose(fp);
@@ -127,7 +127,7 @@ void platform(state *st)
 
 	/* Most Linux ARM/MIPS boards have hardware name in /proc/cpuinfo */
 #if defined(__arm__) || defined(__mips__)
-	if (!*st->server_description && (fp = fopen("/proc/cpuinfo" , "r"))) {
+	if (!*cfg->server_description && (fp = fopen("/proc/cpuinfo" , "r"))) {
 
 		while (fgets(buf, sizeof(buf), fp)) {
 #ifdef __arm__
@@ -135,8 +135,8 @@ void platform(state *st)
 #else
 			if ((c = strkey(buf, "machine"))) {
 #endif
-				sstrlcpy(st->server_description, c);
-				chomp(st->server_description);
+				sstrlcpy(cfg->server_description, c);
+				chomp(cfg->server_description);
 				break;
 			}
 		}
@@ -145,18 +145,18 @@ void platform(state *st)
 #endif
 
 	/* Get hardware type from DMI data */
-	if (!*st->server_description && (fp = fopen("/sys/class/dmi/id/board_vendor" , "r"))) {
+	if (!*cfg->server_description && (fp = fopen("/sys/class/dmi/id/board_vendor" , "r"))) {
 		if (fgets(buf, sizeof(buf), fp) != NULL) {
-			sstrlcpy(st->server_description, buf);
-			chomp(st->server_description);
+			sstrlcpy(cfg->server_description, buf);
+			chomp(cfg->server_description);
 		}
 		fclose(fp);
 
 		if ((fp = fopen("/sys/class/dmi/id/board_name" , "r"))) {
 			if (fgets(buf, sizeof(buf), fp) != NULL) {
-				if (*st->server_description) sstrlcat(st->server_description, " ");
-				sstrlcat(st->server_description, buf);
-				chomp(st->server_description);
+				if (*cfg->server_description) sstrlcat(cfg->server_description, " ");
+				sstrlcat(cfg->server_description, buf);
+				chomp(cfg->server_description);
 			}
 
 			fclose(fp);
@@ -164,10 +164,10 @@ void platform(state *st)
 	}
 
 	/* No DMI? Get possible hypervisor name */
-	if (!*st->server_description && (fp = fopen("/sys/hypervisor/type" , "r"))) {
+	if (!*cfg->server_description && (fp = fopen("/sys/hypervisor/type" , "r"))) {
 		if (fgets(buf, sizeof(buf), fp) != NULL) {
 			chomp(buf);
-			if (*buf) snprintf(st->server_description, sizeof(st->server_description), "%s virtual machine", buf);
+			if (*buf) snprintf(cfg->server_description, sizeof(cfg->server_description), "%s virtual machine", buf);
 		}
 		fclose(fp);
 	}
@@ -294,7 +294,7 @@ void platform(state *st)
 	if ((c = strchr(release, '/'))) *c = '\0';
 
 	/* Create a nicely formatted platform string */
-	snprintf(st->server_platform, sizeof(st->server_platform), "%s%s%s %s",
+	snprintf(cfg->server_platform, sizeof(cfg->server_platform), "%s%s%s %s",
 			 sysname,
 #if defined(__OpenBSD__) || defined(__FreeBSD__) || defined(__NetBSD__)
 			 "/",
@@ -307,11 +307,11 @@ void platform(state *st)
 #endif
 
 	log_debug("generated platform string \"%s\"",
-	          st->server_platform);
+	          cfg->server_platform);
 
 #else
 	/* Fallback reply */
-	sstrlcpy(st->server_platform, "Unknown computer-like system");
+	sstrlcpy(cfg->server_platform, "Unknown computer-like system");
 #endif
 }
 
@@ -0,0 +1,401 @@
+/*
+ * Gophernicus
+ *
+ * Copyright (c) 2009-2018 Kim Holviala <kimholviala@fastmail.com>
+ * Copyright (c) 2019 Gophernicus Developers <gophernicus@gophernicus.org>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* CPU affinity needs the GNU extensions of glibc */
+#ifdef __linux
+#define _GNU_SOURCE
+#endif
+
+#include "gophernicus.h"
+
+#ifdef HAVE_AFFINITY
+#include <sched.h>
+#endif
+
+
+/*
+ * Set by the signal handler when the daemon should shut down
+ */
+static volatile sig_atomic_t terminate = FALSE;
+
+static void sig_terminate(int sig)
+{
+	(void) sig;
+	terminate = TRUE;
+}
+
+
+/*
+ * Open the listening socket for daemon mode
+ */
+static int listen_socket(config *cfg, int reuseport)
+{
+#ifdef HAVE_IPv6
+	struct sockaddr_in6 addr6;
+	int off = 0;
+#endif
+#ifdef HAVE_IPv4
+	struct sockaddr_in addr;
+#endif
+	int on = 1;
+	int fd;
+
+	/* Try dual-stack IPv6 first */
+#ifdef HAVE_IPv6
+	if ((fd = socket(AF_INET6, SOCK_STREAM, 0)) != ERROR) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+		if (reuseport) setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+		memset(&addr6, 0, sizeof(addr6));
+		addr6.sin6_family = AF_INET6;
+		addr6.sin6_addr = in6addr_any;
+		addr6.sin6_port = htons(cfg->server_port);
+
+		if (bind(fd, (struct sockaddr *) &addr6, sizeof(addr6)) == OK &&
+			listen(fd, LISTEN_BACKLOG) == OK) return fd;
+		close(fd);
+	}
+#endif
+
+	/* IPv6 didn't work - try IPv4 */
+#ifdef HAVE_IPv4
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) != ERROR) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+		if (reuseport) setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(cfg->server_port);
+
+		if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == OK &&
+			listen(fd, LISTEN_BACKLOG) == OK) return fd;
+		close(fd);
+	}
+#endif
+
+	return ERROR;
+}
+
+
+/*
+ * Get the listening sockets passed by systemd (Accept=no)
+ */
+static int inherit_sockets(int *socks, int max)
+{
+	char *c;
+	int num;
+	int i;
+
+	if ((c = getenv("LISTEN_PID")) == NULL || atoi(c) != (int) getpid()) return 0;
+	if ((c = getenv("LISTEN_FDS")) == NULL || (num = atoi(c)) < 1) return 0;
+
+	/* Don't pass these on to CGI scripts */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	num = min(num, max);
+	for (i = 0; i < num; i++) socks[i] = LISTEN_FDS_START + i;
+
+	return num;
+}
+
+
+/*
+ * Pin the calling process or thread to the nth CPU it may run on
+ */
+void pin_cpu(int n)
+{
+#ifdef HAVE_AFFINITY
+	cpu_set_t allowed;
+	cpu_set_t set;
+	int cpus;
+	int i;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == ERROR) return;
+	if ((cpus = CPU_COUNT(&allowed)) < 1) return;
+
+	/* Find the (n % cpus)th allowed CPU */
+	n %= cpus;
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (!CPU_ISSET(i, &allowed)) continue;
+		if (n-- == 0) break;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(i, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) == OK)
+		log_debug("worker %i pinned to cpu %i", (int) getpid(), i);
+#endif
+}
+
+
+/*
+ * Accept a connection that CGI scripts of other requests won't inherit
+ */
+int accept_client(int sock)
+{
+	int fd;
+
+#ifdef HAVE_ACCEPT4
+	fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+#else
+	if ((fd = accept(sock, NULL, NULL)) != ERROR) fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+	return fd;
+}
+
+
+/*
+ * Give an accepted blocking socket a deadline for each send and receive
+ */
+void socket_timeouts(int fd)
+{
+	struct timeval tv;
+
+	tv.tv_sec = CONN_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+
+/*
+ * Reap finished CGI children
+ */
+void reap_children(void)
+{
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) job_exited(pid, status);
+}
+
+
+/*
+ * Reap CGI children as soon as they exit so their job slots free up
+ */
+static void sig_child(int sig)
+{
+	int saved = errno;
+
+	(void) sig;
+	reap_children();
+	errno = saved;
+}
+
+
+/*
+ * Worker process - accept and serve connections until killed
+ */
+static void worker(config *cfg, shm_state *shm, int shmid, int *socks, int nsocks, int n)
+{
+	struct sigaction sa;
+	arena mem;
+	conn c;
+	int sock;
+	int fd;
+
+	/* Default signal handling & a random seed of our own */
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	srand(time(NULL) / (getpid() + getppid()));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_child;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+
+	/* Threaded workers only start the threads */
+#ifdef HAVE_PTHREAD
+	if (cfg->daemon_engine == ENGINE_THREAD) {
+		thread_pool(cfg, shm, shmid, socks, nsocks);
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	/* Each worker gets its own socket when there are several */
+	sock = socks[n % nsocks];
+	if (cfg->opt_affinity) pin_cpu(n);
+
+	/* Multiplex connections instead of serving one at a time? */
+#ifdef HAVE_EPOLL
+	if (cfg->daemon_engine == ENGINE_EPOLL) {
+		event_loop(cfg, shm, shmid, sock);
+		exit(EXIT_FAILURE);
+	}
+#endif
+#ifdef HAVE_URING
+	if (cfg->daemon_engine == ENGINE_URING) {
+		if (uring_loop(cfg, shm, shmid, sock) == OK) exit(EXIT_FAILURE);
+		log_info("io_uring not available, worker %i serves one connection at a time",
+			(int) getpid());
+		cfg->daemon_engine = ENGINE_PREFORK;
+	}
+#endif
+
+	arena_init(&mem, ARENA_SIZE);
+
+	for (;;) {
+		if ((fd = accept_client(sock)) == ERROR) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+
+			log_fatal("accept() failed in worker %i", (int) getpid());
+			exit(EXIT_FAILURE);
+		}
+
+		socket_timeouts(fd);
+		conn_init(&c, &mem, fd, fd);
+
+		handle_request(cfg, &c, shm, shmid);
+
+		/* Send the reply & hang up */
+		if (!c.detached) conn_flush(&c);
+		conn_free(&c);
+		close(fd);
+
+		reap_children();
+	}
+}
+
+
+/*
+ * Standalone preforking daemon
+ *
+ * Workers are forked after the configuration has been parsed and the
+ * shared memory attached. Each worker either serves one connection at
+ * a time or runs an event loop of its own (-E epoll). CGI scripts run
+ * in a child of the worker, and a worker that dies is simply replaced.
+ *
+ * The listening sockets are opened here so that a respawned worker
+ * takes over the queue of the one it replaces. With -Z every worker
+ * (or thread) gets a SO_REUSEPORT socket of its own and the kernel
+ * spreads connections between them.
+ */
+int server(config *cfg, shm_state *shm, int shmid)
+{
+	struct sigaction sa;
+	pid_t workers[MAX_WORKERS];
+	int socks[MAX_WORKERS];
+	time_t sweep = 0;
+	int nsocks;
+	pid_t pid;
+	int num;
+	int i;
+
+	num = min(max(cfg->daemon_workers, 1), MAX_WORKERS);
+
+	/* Use sockets from systemd or bind our own */
+	if ((nsocks = inherit_sockets(socks, MAX_WORKERS)) > 0)
+		log_info("using %i listening socket(s) from systemd", nsocks);
+	else {
+		nsocks = cfg->opt_reuseport ? num : 1;
+
+		for (i = 0; i < nsocks; i++) {
+			if ((socks[i] = listen_socket(cfg, cfg->opt_reuseport)) == ERROR) {
+				log_fatal("unable to listen on port %i", cfg->server_port);
+				while (i--) close(socks[i]);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	for (i = 0; i < nsocks; i++) fcntl(socks[i], F_SETFD, FD_CLOEXEC);
+
+	/* Handle signals */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_terminate;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+
+	log_info("listening on port %i with %i %s workers", cfg->server_port, num,
+	         cfg->daemon_engine == ENGINE_EPOLL ? "epoll" :
+	         cfg->daemon_engine == ENGINE_URING ? "uring" :
+	         cfg->daemon_engine == ENGINE_THREAD ? "thread" : "prefork");
+
+	/* Threads all live in one worker process */
+	if (cfg->daemon_engine == ENGINE_THREAD) num = 1;
+	for (i = 0; i < num; i++) workers[i] = 0;
+
+	while (!terminate) {
+
+		/* (Re)spawn missing workers */
+		for (i = 0; i < num; i++) {
+			if (workers[i] > 0) continue;
+
+			if ((pid = fork()) == 0) worker(cfg, shm, shmid, socks, nsocks, i);
+			if (pid == ERROR) {
+				log_fatal("unable to fork a worker");
+				sleep(1);
+				break;
+			}
+
+			workers[i] = pid;
+			log_debug("spawned worker %i", (int) pid);
+		}
+
+		/* Wait for a worker to exit, killing overdue CGI scripts & sweeping -C meanwhile */
+		if (cfg->cgi_timeout > 0 || *cfg->cache_dir) {
+			if (cfg->cgi_timeout > 0) jobs_expire();
+			if (*cfg->cache_dir && time(NULL) >= sweep) {
+				exec_cache_sweep(cfg);
+				sweep = time(NULL) + EXEC_CACHE_SWEEP;
+			}
+
+			if ((pid = waitpid(-1, NULL, WNOHANG)) <= 0) {
+				sleep(1);
+				continue;
+			}
+		}
+		else if ((pid = wait(NULL)) == ERROR) continue;
+
+		for (i = 0; i < num; i++)
+			if (workers[i] == pid) workers[i] = 0;
+	}
+
+	/* Shut down the workers */
+	log_info("shutting down");
+
+	for (i = 0; i < num; i++)
+		if (workers[i] > 0) kill(workers[i], SIGTERM);
+	while (wait(NULL) != ERROR || errno == EINTR);
+
+	for (i = 0; i < nsocks; i++) close(socks[i]);
+	return EXIT_SUCCESS;
+}
@@ -27,30 +27,304 @@
  */
 
 
+/* sched_getcpu() needs the GNU extensions of glibc */
+#ifdef __linux
+#define _GNU_SOURCE
+#endif
+
 #include "gophernicus.h"
 
+#ifdef HAVE_GETCPU
+#include <sched.h>
+#endif
+
+
+/*
+ * Client sessions are shared by all processes in an open addressing
+ * hash table keyed by the binary client address. A client's session is
+ * in one of the SESSION_PROBE slots following its hash - a new client
+ * takes a free (timed out) one of them, or the least recently used.
+ * The contents of a slot are written under its sequence lock and read
+ * optimistically, the counters are updated atomically. Writers lock a
+ * slot by putting their pid in it, so a lock left behind by a process
+ * that died (or got stuck) can be taken over.
+ */
+
+
+/*
+ * Convert a client address to a session key
+ */
+#ifdef HAVE_SHMEM
+static void session_key(const char *addr, unsigned char *key)
+{
+#ifdef HAVE_IPv4
+	struct in_addr in;
+#endif
+
+	memset(key, 0, 16);
+
+#ifdef HAVE_IPv6
+	if (inet_pton(AF_INET6, addr, key) == 1) return;
+#endif
+#ifdef HAVE_IPv4
+	if (inet_pton(AF_INET, addr, &in) == 1) {
+		key[10] = key[11] = 0xff;
+		memcpy(key + 12, &in, 4);
+		return;
+	}
+#endif
+
+	/* Not an address at all ("unknown") */
+	memcpy(key, addr, min(strlen(addr), 16));
+}
+#endif
+
+
+/*
+ * Hash a session key
+ */
+#ifdef HAVE_SHMEM
+static unsigned long session_hash(const unsigned char *key)
+{
+	unsigned long hash = memhash(key, 16);
+
+	return hash ^ (hash >> 16);
+}
+#endif
+
+
+/*
+ * Take the write side of a sequence lock - returns ERROR if it stays busy
+ */
+#ifdef HAVE_SHMEM
+static int seq_lock(unsigned int *lock)
+{
+	unsigned int seq;
+	int i;
+
+	for (i = 0; i < SHM_SPINS; i++) {
+		seq = __atomic_load_n(lock, __ATOMIC_RELAXED);
+
+		if (!(seq & 1) && __atomic_compare_exchange_n(lock, &seq, seq + 1,
+			FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return OK;
+	}
+
+	return ERROR;
+}
+#endif
+
+
+/*
+ * Release the write side of a sequence lock
+ */
+#ifdef HAVE_SHMEM
+static void seq_unlock(unsigned int *lock)
+{
+	__atomic_add_fetch(lock, 1, __ATOMIC_RELEASE);
+}
+#endif
+
+
+/*
+ * Is the write lock of a slot held by a process that is gone or stuck?
+ */
+#ifdef HAVE_SHMEM
+static int session_stale(shm_session *s, pid_t owner)
+{
+	time_t locked = __atomic_load_n(&s->locked, __ATOMIC_RELAXED);
+
+	if (kill(owner, 0) == ERROR && errno == ESRCH) return TRUE;
+	return (locked && (time(NULL) - locked) > SESSION_LOCK_MAX);
+}
+#endif
+
+
+/*
+ * Release the write lock of a slot
+ */
+#ifdef HAVE_SHMEM
+static void session_unlock(shm_session *s)
+{
+	__atomic_store_n(&s->locked, 0, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->seq, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&s->owner, 0, __ATOMIC_RELEASE);
+}
+#endif
+
+
+/*
+ * Free a slot whose lock was left behind - returns ERROR if the
+ * lock isn't stale or somebody else got to it first
+ */
+#ifdef HAVE_SHMEM
+static int session_recover(shm_session *s)
+{
+	pid_t owner;
+
+	owner = __atomic_load_n(&s->owner, __ATOMIC_ACQUIRE);
+	if (owner == 0 || !session_stale(s, owner)) return ERROR;
+
+	if (!__atomic_compare_exchange_n(&s->owner, &owner, getpid(),
+		FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return ERROR;
+
+	log_info("taking over session slot locked by process %i", (int) owner);
+
+	/* It may have died before or after marking the slot busy */
+	if (!(__atomic_load_n(&s->seq, __ATOMIC_RELAXED) & 1))
+		__atomic_add_fetch(&s->seq, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	/* Whatever it was writing is garbage - nobody's session now */
+	memset(s->addr, 0, sizeof(s->addr));
+	s->req_atime = 0;
+	s->session_id = 0;
+
+	session_unlock(s);
+	return OK;
+}
+#endif
+
+
+/*
+ * Take the write lock of a slot - returns ERROR if it stays busy
+ */
+#ifdef HAVE_SHMEM
+static int session_lock(shm_session *s)
+{
+	pid_t owner;
+	int tries;
+	int i;
+
+	for (tries = 0; tries < 2; tries++) {
+		for (i = 0; i < SHM_SPINS; i++) {
+			owner = 0;
+			if (!__atomic_compare_exchange_n(&s->owner, &owner, getpid(),
+				FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) continue;
+
+			__atomic_store_n(&s->locked, time(NULL), __ATOMIC_RELAXED);
+			__atomic_add_fetch(&s->seq, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			return OK;
+		}
+
+		if (session_recover(s) == ERROR) break;
+	}
+
+	return ERROR;
+}
+#endif
+
+
+/*
+ * Copy a consistent snapshot of a slot - returns ERROR if it stays busy
+ */
+#ifdef HAVE_SHMEM
+int read_shm_session(shm_state *shm, int i, shm_session *copy)
+{
+	shm_session *s = &shm->session[i];
+	unsigned int seq;
+	int n;
+
+	for (n = 0; n < SHM_SPINS; n++) {
+		if ((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1) continue;
+
+		memcpy(copy, s, sizeof(shm_session));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+			copy->hits = __atomic_load_n(&s->hits, __ATOMIC_RELAXED);
+			copy->kbytes = __atomic_load_n(&s->kbytes, __ATOMIC_RELAXED);
+			return OK;
+		}
+	}
+
+	return ERROR;
+}
+#endif
+
 
 /*
- * Locate shared memory session ID
+ * Locate the session of a client, optionally starting a new one -
+ * returns the slot or ERROR
  */
 #ifdef HAVE_SHMEM
-static int get_shm_session_id(state *st, shm_state *shm)
+static int get_shm_session_id(state *st, shm_state *shm, int create)
 {
+	unsigned char key[16];
+	shm_session copy;
+	shm_session *s;
+	unsigned long hash;
 	time_t now;
+	time_t oldest;
+	int victim;
+	int busy;
+	int tries;
 	int i;
+	int n;
 
-	/* Get current time */
+	if (shm->sessions <= 0) return ERROR;
+
+	session_key(st->req_remote_addr, key);
+	hash = session_hash(key);
 	now = time(NULL);
 
-	/* Locate user's old session using remote_addr */
-	for (i = 0; i < SHM_SESSIONS; i++) {
-		if (strcmp(st->req_remote_addr, shm->session[i].req_remote_addr) == MATCH &&
-			(now - shm->session[i].req_atime) < st->session_timeout) break;
+	for (tries = 0; tries < 3; tries++) {
+		victim = ERROR;
+		oldest = 0;
+		busy = FALSE;
+
+		/* Look for the client, and a slot to use if it's not there */
+		for (n = 0; n < SESSION_PROBE && n < shm->sessions; n++) {
+			i = (hash + n) & (shm->sessions - 1);
+
+			if (read_shm_session(shm, i, &copy) == ERROR &&
+			    (session_recover(&shm->session[i]) == ERROR ||
+			     read_shm_session(shm, i, &copy) == ERROR)) {
+				busy = TRUE;
+				continue;
+			}
+
+			if ((now - copy.req_atime) < st->cfg->session_timeout) {
+				if (memcmp(copy.addr, key, sizeof(key)) == MATCH) return i;
+			}
+			else copy.req_atime = 0;
+
+			if (victim == ERROR || copy.req_atime < oldest) {
+				victim = i;
+				oldest = copy.req_atime;
+			}
+		}
+
+		if (!create || victim == ERROR) return ERROR;
+
+		/* The client may be in a slot we couldn't read - don't start another */
+		if (busy) continue;
+
+		/* Take over the slot - unless someone else just did */
+		s = &shm->session[victim];
+		if (session_lock(s) == ERROR) continue;
+
+		if (s->req_atime > oldest && (now - s->req_atime) < st->cfg->session_timeout) {
+			session_unlock(s);
+			continue;
+		}
+
+		memcpy(s->addr, key, sizeof(key));
+		sstrlcpy(s->req_remote_addr, st->req_remote_addr);
+		s->req_atime = now;
+		s->req_selector[0] = '\0';
+		s->req_filetype = '\0';
+		s->server_host[0] = '\0';
+		s->server_port = 0;
+		s->session_id = rand();
+		__atomic_store_n(&s->hits, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->kbytes, 0, __ATOMIC_RELAXED);
+
+		session_unlock(s);
+		return victim;
 	}
 
-	/* Return -1 on error */
-	if (i == SHM_SESSIONS) return ERROR;
-	else return i;
+	return ERROR;
 }
 #endif
 
@@ -61,14 +335,16 @@ static int get_shm_session_id(state *st, shm_state *shm)
 #ifdef HAVE_SHMEM
 void get_shm_session(state *st, shm_state *shm)
 {
+	shm_session copy;
 	int i;
 
 	/* Get session id */
-	if ((i = get_shm_session_id(st, shm)) == ERROR) return;
+	if ((i = get_shm_session_id(st, shm, FALSE)) == ERROR) return;
+	if (read_shm_session(shm, i, &copy) == ERROR) return;
 
 	/* Get session data */
-	if (st->opt_vhost) {
-		sstrlcpy(st->server_host, shm->session[i].server_host);
+	if (st->cfg->opt_vhost) {
+		sstrlcpy(st->server_host, copy.server_host);
 	}
 }
 #endif
@@ -80,72 +356,288 @@ void get_shm_session(state *st, shm_state *shm)
 #ifdef HAVE_SHMEM
 void update_shm_session(state *st, shm_state *shm)
 {
-	time_t now;
+	unsigned char key[16];
+	shm_session *s;
 	char buf[BUFSIZE];
+	long kbytes;
+	long hits;
 	int delay;
 	int i;
 
-	/* Get current time */
-	now = time(NULL);
-
-	/* No existing session found? */
-	if ((i = get_shm_session_id(st, shm)) == ERROR) {
+	/* No session to count the data to unless we get one */
+	st->conn->session = ERROR;
 
-		/* Look for an empty/expired session slot */
-		for (i = 0; i < SHM_SESSIONS; i++) {
+	/* Find the session or start a new one */
+	if ((i = get_shm_session_id(st, shm, TRUE)) == ERROR) return;
+	s = &shm->session[i];
 
-			if ((now - shm->session[i].req_atime) > st->session_timeout) {
+	if (session_lock(s) == ERROR) return;
 
-				/* Found slot -> initialize it */
-				sstrlcpy(shm->session[i].req_remote_addr, st->req_remote_addr);
-				shm->session[i].hits = 0;
-				shm->session[i].kbytes = 0;
-				shm->session[i].session_id = rand();
-				break;
-			}
-		}
+	/* The slot may have gone to another client meanwhile */
+	session_key(st->req_remote_addr, key);
+	if (memcmp(s->addr, key, sizeof(key)) != MATCH) {
+		session_unlock(s);
+		return;
 	}
 
-	/* No available session slot found? */
-	if (i == SHM_SESSIONS) return;
-
 	/* Get referrer from old session data */
-	if (*shm->session[i].server_host) {
+	if (*s->server_host) {
 		snprintf(buf, sizeof(buf), "gopher%s://%s:%i/%c%s",
-			(shm->session[i].server_port == st->server_tls_port ? "s" : ""),
-			shm->session[i].server_host,
-			shm->session[i].server_port,
-			shm->session[i].req_filetype,
-			shm->session[i].req_selector);
+			(s->server_port == st->cfg->server_tls_port ? "s" : ""),
+			s->server_host,
+			s->server_port,
+			s->req_filetype,
+			s->req_selector);
 		sstrlcpy(st->req_referrer, buf);
 	}
 
 	/* Get public session id */
-	st->session_id = shm->session[i].session_id;
+	st->session_id = s->session_id;
 
 	/* Update session data */
-	sstrlcpy(shm->session[i].server_host, st->server_host);
-	shm->session[i].server_port = st->server_port;
+	sstrlcpy(s->server_host, st->server_host);
+	s->server_port = st->server_port;
 
-	sstrlcpy(shm->session[i].req_selector, st->req_selector);
-	shm->session[i].req_filetype = st->req_filetype;
-	shm->session[i].req_atime = now;
+	sstrlcpy(s->req_selector, st->req_selector);
+	s->req_filetype = st->req_filetype;
+	s->req_atime = time(NULL);
 
-	shm->session[i].hits++;
-	shm->session[i].kbytes += st->req_filesize / 1024;
+	session_unlock(s);
+
+	hits = __atomic_add_fetch(&s->hits, 1, __ATOMIC_RELAXED);
+	kbytes = __atomic_load_n(&s->kbytes, __ATOMIC_RELAXED);
+
+	/* The data is counted once it's been sent */
+	st->conn->session = i;
+	st->conn->session_id = st->session_id;
 
 	/* Transfer limits exceeded? */
-	if ((st->session_max_kbytes && shm->session[i].kbytes > st->session_max_kbytes) ||
-		(st->session_max_hits && shm->session[i].hits > st->session_max_hits)) {
+	if ((st->cfg->session_max_kbytes && kbytes > st->cfg->session_max_kbytes) ||
+		(st->cfg->session_max_hits && hits > st->cfg->session_max_hits)) {
 
 		/* Calculate throttle delay */
-		delay = max(shm->session[i].kbytes / st->session_max_kbytes,
-			shm->session[i].hits / st->session_max_hits);
+		delay = max(st->cfg->session_max_kbytes ? kbytes / st->cfg->session_max_kbytes : 0,
+			st->cfg->session_max_hits ? hits / st->cfg->session_max_hits : 0);
 
 		/* Throttle user */
 		log_info("throttling user from %s for %i seconds",
 		         st->req_remote_addr, delay);
-		sleep(delay);
+
+		/* The event loop holds the reply back instead of sleeping */
+		if (st->conn->defer) st->conn->delay = delay;
+		else sleep(delay);
+	}
+}
+#endif
+
+
+/*
+ * Account for the data actually sent to a client
+ */
+#ifdef HAVE_SHMEM
+void update_shm_sent(conn *c)
+{
+	shm_state *shm = c->shm;
+	shm_session *s;
+	long kbytes = c->sent / 1024;
+
+	if (!shm || kbytes == 0) return;
+
+	shm_count(shm, 0, kbytes);
+
+	/* Unless the slot went to another client meanwhile */
+	if (c->session == ERROR) return;
+	s = &shm->session[c->session];
+
+	if (s->session_id == c->session_id)
+		__atomic_add_fetch(&s->kbytes, kbytes, __ATOMIC_RELAXED);
+}
+#endif
+
+
+/*
+ * Get the counters of the CPU we're running on
+ */
+#ifdef HAVE_SHMEM
+static shm_counter *get_shm_counter(shm_state *shm)
+{
+	int cpu;
+
+#ifdef HAVE_GETCPU
+	if ((cpu = sched_getcpu()) == ERROR) cpu = getpid();
+#else
+	cpu = getpid();
+#endif
+	return &shm->counter[cpu % SHM_COUNTERS];
+}
+#endif
+
+
+/*
+ * Add to the global hit & transfer counters
+ */
+#ifdef HAVE_SHMEM
+void shm_count(shm_state *shm, long hits, long kbytes)
+{
+	shm_counter *cnt = get_shm_counter(shm);
+	int locked;
+
+	/* Still counted if another process hangs on to the lock */
+	locked = (seq_lock(&cnt->seq) == OK);
+
+	__atomic_add_fetch(&cnt->hits, hits, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&cnt->kbytes, kbytes, __ATOMIC_RELAXED);
+
+	if (locked) seq_unlock(&cnt->seq);
+}
+#endif
+
+
+/*
+ * Sum up the global counters, each CPU's hits & kbytes taken together
+ */
+#ifdef HAVE_SHMEM
+void read_shm_counters(shm_state *shm, long *hits, long *kbytes)
+{
+	shm_counter *cnt;
+	unsigned int seq;
+	long h = 0;
+	long k = 0;
+	int i;
+	int n;
+
+	*hits = *kbytes = 0;
+
+	for (i = 0; i < SHM_COUNTERS; i++) {
+		cnt = &shm->counter[i];
+
+		for (n = 0; n < SHM_SPINS; n++) {
+			seq = __atomic_load_n(&cnt->seq, __ATOMIC_ACQUIRE);
+			h = __atomic_load_n(&cnt->hits, __ATOMIC_RELAXED);
+			k = __atomic_load_n(&cnt->kbytes, __ATOMIC_RELAXED);
+
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (!(seq & 1) && __atomic_load_n(&cnt->seq, __ATOMIC_RELAXED) == seq) break;
+		}
+
+		*hits += h;
+		*kbytes += k;
+	}
+}
+#endif
+
+
+/*
+ * Attach to a shared memory segment, creating it first if needed. The
+ * first one to attach a new segment sets it up with init(). A segment
+ * of another version, or too small for us, is only replaced if nobody
+ * is using it - returns NULL if there's none we can use.
+ */
+#ifdef HAVE_SHMEM
+void *shm_attach(key_t key, size_t size, unsigned int version,
+	void (*init)(void *mem, void *arg), void *arg, int *shmid)
+{
+	struct shmid_ds shm_ds;
+	shm_header *h;
+	unsigned int magic;
+	int id;
+	int tries;
+	int i;
+
+	for (tries = 0; tries < 2; tries++) {
+
+		/* An old segment smaller than ours can only be had as it is */
+		if ((id = shmget(key, size, IPC_CREAT | SHM_MODE)) == ERROR &&
+		    (id = shmget(key, 0, 0)) == ERROR) break;
+		if ((h = shmat(id, NULL, 0)) == (void *) ERROR) break;
+
+		if (shmctl(id, IPC_STAT, &shm_ds) == OK && shm_ds.shm_segsz >= size) {
+
+			/* New memory is zeroed - the first one here initializes it */
+			magic = 0;
+			if (__atomic_compare_exchange_n(&h->magic, &magic, SHM_BUSY,
+				FALSE, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+
+				h->version = version;
+				if (init) init(h, arg);
+				__atomic_store_n(&h->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+			}
+
+			/* Others wait for it to finish */
+			for (i = 0; i < SHM_SPINS; i++) {
+				if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != SHM_BUSY) break;
+				usleep(1000);
+			}
+
+			/* Use the memory only if it has our layout */
+			if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) == SHM_MAGIC &&
+			    h->version == version) {
+				if (shmid) *shmid = id;
+				return h;
+			}
+		}
+
+		/* Not ours - but don't pull it out from under a running server */
+		if (shmctl(id, IPC_STAT, &shm_ds) == ERROR || shm_ds.shm_nattch > 1) {
+			log_warning("shared memory 0x%lx is in use by another version", (unsigned long) key);
+			shmdt(h);
+			break;
+		}
+
+		shmctl(id, IPC_RMID, NULL);
+		shmdt(h);
 	}
+
+	if (shmid) *shmid = ERROR;
+	return NULL;
+}
+#endif
+
+
+/*
+ * Session table size, a power of two
+ */
+#ifdef HAVE_SHMEM
+static int shm_sessions(config *cfg)
+{
+	int sessions;
+
+	if (cfg->session_slots == 0) return 0;
+
+	for (sessions = 1; sessions < cfg->session_slots; sessions <<= 1);
+	return sessions;
+}
+#endif
+
+
+/*
+ * Set up new shared memory for sessions & accounting
+ */
+#ifdef HAVE_SHMEM
+static void shm_setup(void *mem, void *arg)
+{
+	shm_state *shm = mem;
+	config *cfg = arg;
+
+	shm->sessions = shm_sessions(cfg);
+	shm->start_time = time(NULL);
+
+	/* Keep server platform & description in shm */
+	platform(cfg);
+	sstrlcpy(shm->server_platform, cfg->server_platform);
+	sstrlcpy(shm->server_description, cfg->server_description);
+}
+#endif
+
+
+/*
+ * Attach to the shared memory, creating and initializing it first if
+ * needed - returns NULL if there's none we can use
+ */
+#ifdef HAVE_SHMEM
+shm_state *shm_init(config *cfg, int *shmid)
+{
+	return shm_attach(SHM_KEY, sizeof(shm_state) + shm_sessions(cfg) * sizeof(shm_session),
+		SHM_VERSION, shm_setup, cfg, shmid);
 }
 #endif
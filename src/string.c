@@ -30,6 +30,130 @@
 #include "gophernicus.h"
 
 
+/*
+ * Runs of chars the string functions below can copy (or skip) as is
+ */
+#define SPAN_ASCII	0	/* 7-bit chars */
+#define SPAN_ENCODE	1	/* Chars strnencode() leaves alone */
+#define SPAN_DECODE	2	/* Chars strndecode() leaves alone */
+
+#if defined(HAVE_AVX2)
+#define VEC_SIZE	32
+#define VEC_ALL		0xffffffffU
+typedef __m256i vec_t;
+#define vec_load(p)	_mm256_load_si256((const __m256i *) (p))
+#define vec_set(c)	_mm256_set1_epi8(c)
+#define vec_gt(a, b)	_mm256_cmpgt_epi8(a, b)
+#define vec_eq(a, b)	_mm256_cmpeq_epi8(a, b)
+#define vec_and(a, b)	_mm256_and_si256(a, b)
+#define vec_or(a, b)	_mm256_or_si256(a, b)
+#define vec_mask(a)	((unsigned int) _mm256_movemask_epi8(a))
+#elif defined(HAVE_SSE2)
+#define VEC_SIZE	16
+#define VEC_ALL		0xffffU
+typedef __m128i vec_t;
+#define vec_load(p)	_mm_load_si128((const __m128i *) (p))
+#define vec_set(c)	_mm_set1_epi8(c)
+#define vec_gt(a, b)	_mm_cmpgt_epi8(a, b)
+#define vec_eq(a, b)	_mm_cmpeq_epi8(a, b)
+#define vec_and(a, b)	_mm_and_si128(a, b)
+#define vec_or(a, b)	_mm_or_si128(a, b)
+#define vec_mask(a)	((unsigned int) _mm_movemask_epi8(a))
+#endif
+
+
+/*
+ * Check whether a char belongs to a run (none of them include NUL)
+ */
+static inline int span_char(unsigned char c, int kind)
+{
+	if (kind == SPAN_ASCII) return (c > 0 && c < 0x80);
+	if (kind == SPAN_ENCODE) return (c >= '+' && c <= '~');
+	return (c && c != '%' && c != '#');
+}
+
+
+#ifdef VEC_SIZE
+/*
+ * Same for a vector of chars, returns a bitmask with one bit per char
+ */
+static inline unsigned int span_mask(vec_t v, int kind)
+{
+	/* Chars compare as signed, so all 8-bit chars are below zero */
+	if (kind == SPAN_ASCII)
+		return vec_mask(vec_gt(v, vec_set(0)));
+
+	if (kind == SPAN_ENCODE)
+		return vec_mask(vec_and(vec_gt(v, vec_set('+' - 1)),
+			vec_gt(vec_set('~' + 1), v)));
+
+	return ~vec_mask(vec_or(vec_eq(v, vec_set(0)),
+		vec_or(vec_eq(v, vec_set('%')), vec_eq(v, vec_set('#'))))) & VEC_ALL;
+}
+#endif
+
+
+/*
+ * Return the length of the run at the start of a string, up to max chars
+ */
+static inline size_t strspan(const char *str, size_t max, int kind)
+{
+	size_t n = 0;
+#ifdef VEC_SIZE
+	unsigned int mask;
+
+	/* Go one char at a time until the loads can be aligned */
+	while (n < max && ((size_t) (str + n) & (VEC_SIZE - 1))) {
+		if (!span_char(str[n], kind)) return n;
+		n++;
+	}
+
+	/*
+	 * An aligned load never crosses a page, and a run always ends at
+	 * the terminating NUL, so reading the rest of its vector is safe
+	 */
+	while (n < max) {
+		mask = span_mask(vec_load(str + n), kind);
+
+		if (mask != VEC_ALL) {
+			n += __builtin_ctz(~mask);
+			return (n < max) ? n : max;
+		}
+
+		n += VEC_SIZE;
+	}
+
+	return max;
+#else
+	while (n < max && span_char(str[n], kind)) n++;
+	return n;
+#endif
+}
+
+
+/*
+ * Return value of a hex digit, or ERROR
+ */
+static inline int hexdigit(unsigned char c)
+{
+	unsigned int d = c - '0';
+	unsigned int x = (c | 0x20) - 'a';
+
+	return (d < 10) ? (int) d : (x < 6) ? (int) x + 10 : ERROR;
+}
+
+
+/*
+ * Return value of an octal digit, or ERROR
+ */
+static inline int octdigit(unsigned char c)
+{
+	unsigned int d = c - '0';
+
+	return (d < 8) ? (int) d : ERROR;
+}
+
+
 /*
  * Repeat a character num times and zero-terminate
  */
@@ -58,10 +182,24 @@ void strreplace(char *str, char from, char to)
 size_t strcut(char *str, size_t width)
 {
 	unsigned char c = '\0';
+	size_t n;
 	int w = 0;
 	int i;
 
-	while (width-- && (c = *str++)) {
+	while (width) {
+
+		/* Skip over 7-bit chars in one go */
+		if ((n = strspan(str, width, SPAN_ASCII))) {
+			str += n;
+			width -= n;
+			w += n;
+			c = str[-1];
+			continue;
+		}
+
+		width--;
+		if (!(c = *str++)) break;
+
 		if (c >= 0x80 && (*str & 0xc0) == 0x80) {
 			i = 0;
 
@@ -69,7 +207,8 @@ size_t strcut(char *str, size_t width)
 			else if ((c & 0xf0) == 0xe0) i = 2;
 			else if ((c & 0xe0) == 0xc0) i = 1;
 
-			while (i--) if (!*str++) break;
+			/* Don't step over the terminating NUL of a cut sequence */
+			while (i-- && *str) str++;
 		}
 
 		w++;
@@ -147,25 +286,30 @@ char *strcharset(int charset)
  */
 void strniconv(int charset, char *out, char *in, size_t outsize)
 {
-	char ascii[] = ASCII;
+	static const char ascii[] = ASCII;
 	unsigned long c;
 	size_t len;
+	size_t n;
 	int i;
 
 	/* Loop through the input string */
 	len = strlen(in);
 	while (--outsize && len > 0) {
 
-		/* Get one input char */
-		c = (unsigned char) *in++;
-		len--;
-
 		/* 7-bit chars are the same in all three charsets */
-		if (c < 0x80) {
-			*out++ = (unsigned char) c;
+		if ((n = strspan(in, (len < outsize) ? len : outsize, SPAN_ASCII))) {
+			memmove(out, in, n);
+			out += n;
+			in += n;
+			len -= n;
+			outsize -= n - 1;
 			continue;
 		}
 
+		/* Get one input char */
+		c = (unsigned char) *in++;
+		len--;
+
 		/* Assume ISO-8859-1 which requires 0 extra bytes */
 		i = 0;
 
@@ -242,27 +386,39 @@ void strniconv(int charset, char *out, char *in, size_t outsize)
  */
 void strnencode(char *out, const char *in, size_t outsize)
 {
+	char *end = out + outsize - 1;
 	unsigned char c;
+	size_t max;
+	size_t n;
 
-	/* Loop through the input string */
-	while (--outsize) {
+	/*
+	 * Loop through the input string - outsize counts one per input
+	 * char as it always has, end keeps escapes from running past it
+	 */
+	while (outsize > 1 && out < end) {
+
+		/* Copy regular chars */
+		max = (size_t) (end - out);
+		if ((n = strspan(in, (outsize - 1 < max) ? outsize - 1 : max, SPAN_ENCODE))) {
+			memcpy(out, in, n);
+			out += n;
+			in += n;
+			outsize -= n;
+			continue;
+		}
 
 		/* End of source? */
 		if (!(c = *in++)) break;
 
-		/* Need to encode the char? */
-		if (c < '+' || c > '~') {
+		/* Can we fit the encoded version into outbuffer? */
+		if (outsize < 6 || end - out < 4) break;
 
-			/* Can we fit the encoded version into outbuffer? */
-			if (outsize < 5) break;
-
-			/* Output encoded char */
-			snprintf(out, outsize, "#%.3o", c);
-			out += 4;
-		}
-
-		/* Copy regular chars */
-		else *out++ = c;
+		/* Output encoded char */
+		*out++ = '#';
+		*out++ = '0' + (c >> 6);
+		*out++ = '0' + ((c >> 3) & 7);
+		*out++ = '0' + (c & 7);
+		outsize--;
 	}
 
 	/* Zero-terminate output */
@@ -276,31 +432,44 @@ void strnencode(char *out, const char *in, size_t outsize)
 void strndecode(char *out, char *in, size_t outsize)
 {
 	unsigned char c;
-	unsigned int i;
+	size_t n;
+	int i, d;
 
-	/* Loop through the input string */
+	/* Loop through the input string (which may be the output too) */
 	while (--outsize) {
 
+		/* Copy non-encoded chars */
+		if ((n = strspan(in, outsize, SPAN_DECODE))) {
+			memmove(out, in, n);
+			out += n;
+			in += n;
+			outsize -= n - 1;
+			continue;
+		}
+
 		/* End of source? */
 		if (!(c = *in++)) break;
 
-		/* Parse %hex encoding */
-		if (c == '%' && strlen(in) >= 2) {
-			sscanf(in, "%2x", &i);
+		/* Parse %hex encoding (one or two digits, like "%2x") */
+		if (c == '%' && in[0] && in[1] && (i = hexdigit(in[0])) != ERROR) {
+			if ((d = hexdigit(in[1])) != ERROR) i = (i << 4) | d;
 			*out++ = i;
 			in += 2;
 			continue;
 		}
 
-		/* Parse #octal encoding */
-		if (c == '#' && strlen(in) >= 3) {
-			sscanf(in, "%3o", &i);
+		/* Parse #octal encoding (one to three digits, like "%3o") */
+		if (c == '#' && in[0] && in[1] && in[2] && (i = octdigit(in[0])) != ERROR) {
+			if ((d = octdigit(in[1])) != ERROR) {
+				i = (i << 3) | d;
+				if ((d = octdigit(in[2])) != ERROR) i = (i << 3) | d;
+			}
 			*out++ = i;
 			in += 3;
 			continue;
 		}
 
-		/* Copy non-encoded chars */
+		/* Copy a % or # that isn't followed by digits */
 		*out++ = c;
 	}
 
@@ -333,6 +502,28 @@ void strfsize(char *out, off_t size, size_t outsize)
 }
 
 
+/*
+ * Hash a block of memory (djb2) for cache keys and file names
+ */
+unsigned long long memhash(const void *data, size_t len)
+{
+	const unsigned char *c = data;
+	unsigned long long hash = 5381;
+
+	while (len--) hash = hash * 33 + *c++;
+	return hash;
+}
+
+
+/*
+ * Hash a string
+ */
+unsigned long long strhash(const char *str)
+{
+	return memhash(str, strlen(str));
+}
+
+
 #ifndef HAVE_STRLCPY
 /*
  * Copyright (c) 1998 Todd C. Miller <Todd.Miller@courtesan.com>
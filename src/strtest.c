@@ -0,0 +1,480 @@
+/*
+ * Gophernicus
+ *
+ * Copyright (c) 2009-2018 Kim Holviala <kimholviala@fastmail.com>
+ * Copyright (c) 2019 Gophernicus Developers <gophernicus@gophernicus.org>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Checks the string functions in string.c against the plain char at a
+ * time versions they replaced, on random input at random alignments,
+ * ending right before an unmapped page. Built and run by "make check"
+ * as scalar, default (SSE2 on x86-64) and AVX2 binaries.
+ *
+ * Usage: strtest [rounds [seed]]
+ */
+
+#include "gophernicus.h"
+#include <sys/mman.h>
+
+
+/* Test settings */
+#define TEST_ROUNDS		200000	/* Default number of random inputs per function */
+#define TEST_INPUT	300	/* Longest random input */
+#define SLACK		64	/* Output bytes checked for overruns */
+#define CANARY		0x5a
+
+/* Globals */
+static unsigned long long start;
+static unsigned long long seed;
+static long round;
+static char *page;
+static size_t pagesize;
+static int failed;
+
+
+/*
+ * The old implementations, as they were before the vector runs. Where
+ * they read or wrote past their buffers or used unset values, *undef
+ * is set and the result isn't compared.
+ */
+static size_t old_strcut(char *str, size_t width, int *undef)
+{
+	unsigned char c = '\0';
+	int w = 0;
+	int i;
+
+	while (width-- && (c = *str++)) {
+		if (c >= 0x80 && (*str & 0xc0) == 0x80) {
+			i = 0;
+
+			if ((c & 0xf8) == 0xf0) i = 3;
+			else if ((c & 0xf0) == 0xe0) i = 2;
+			else if ((c & 0xe0) == 0xc0) i = 1;
+
+			/* Stepping over the NUL left str past the string */
+			while (i--) if (!*str++) { *undef = TRUE; return 0; }
+		}
+
+		w++;
+	}
+
+	if (c) *str = '\0';
+	return w;
+}
+
+static void old_strniconv(int charset, char *out, char *in, size_t outsize)
+{
+	char ascii[] = ASCII;
+	unsigned long c;
+	size_t len;
+	int i;
+
+	/* Loop through the input string */
+	len = strlen(in);
+	while (--outsize && len > 0) {
+
+		/* Get one input char */
+		c = (unsigned char) *in++;
+		len--;
+
+		/* 7-bit chars are the same in all three charsets */
+		if (c < 0x80) {
+			*out++ = (unsigned char) c;
+			continue;
+		}
+
+		/* Assume ISO-8859-1 which requires 0 extra bytes */
+		i = 0;
+
+		/* UTF-8? (We'll actually check the next char here, not current) */
+		if ((*in & 0xc0) == 0x80) {
+
+			/* Four-byte UTF-8? */
+			if ((c & 0xf8) == 0xf0 && len >= 3) { c &= 0x07; i = 3; }
+
+			/* Three-byte UTF-8? */
+			else if ((c & 0xf0) == 0xe0 && len >= 2) { c &= 0x0f; i = 2; }
+
+			/* Two-byte UTF-8? */
+			else if ((c & 0xe0) == 0xc0 && len >= 1) { c &= 0x1f; i = 1; }
+
+			/* Parse rest of the UTF-8 bytes */
+			while (i--) {
+				c <<= 6;
+				c |= *in++ & 0x3f;
+				len--;
+			}
+		}
+
+		/* Handle UTF-8 */
+		if (charset == UTF_8) {
+			i = 0;
+
+			/* Two-byte encoding? */
+			if (c < 0x800 && outsize > 2) { *out++ = (c >> 6) | 0xc0; i = 1; }
+
+			/* Three-byte encoding? */
+			else if (c < 0x10000 && outsize > 3) { *out++ = (c >> 12) | 0xe0; i = 2; }
+
+			/* Four-byte encoding? */
+			else if (c < 0x110000 && outsize > 4) { *out++ = (c >> 18) | 0xf0; i = 3; }
+
+			/* Encode rest of the UTF-8 bytes */
+			while (i--) {
+				*out++ = ((c >> (i * 6)) & 0x3f) | 0x80;
+				outsize--;
+			}
+			continue;
+		}
+
+		/* Handle ISO-8859-1 */
+		if (charset == ISO_8859_1) {
+
+			if (c >= 0xa0 && c <= 0xff)
+				*out++ = (unsigned char) c;
+			else
+				*out++ = UNKNOWN;
+			continue;
+		}
+
+		/* Handle all other charsets as 7-bit US-ASCII */
+		if (c >= 0x80 && c <= 0xff)
+			*out++ = ascii[c - 0x80];
+		else
+			*out++ = UNKNOWN;
+	}
+
+	/* Zero-terminate output */
+	*out = '\0';
+}
+
+static void old_strnencode(char *out, const char *in, size_t outsize)
+{
+	unsigned char c;
+
+	/* Loop through the input string */
+	while (--outsize) {
+
+		/* End of source? */
+		if (!(c = *in++)) break;
+
+		/* Need to encode the char? */
+		if (c < '+' || c > '~') {
+
+			/* Can we fit the encoded version into outbuffer? */
+			if (outsize < 5) break;
+
+			/* Output encoded char */
+			snprintf(out, outsize, "#%.3o", c);
+			out += 4;
+		}
+
+		/* Copy regular chars */
+		else *out++ = c;
+	}
+
+	/* Zero-terminate output */
+	*out = '\0';
+}
+
+static void old_strndecode(char *out, char *in, size_t outsize, int *undef)
+{
+	unsigned char c;
+	unsigned int i;
+
+	/* Loop through the input string */
+	while (--outsize) {
+
+		/* End of source? */
+		if (!(c = *in++)) break;
+
+		/* Parse %hex encoding */
+		if (c == '%' && strlen(in) >= 2) {
+			if (!isxdigit((unsigned char) in[0])) *undef = TRUE;
+			sscanf(in, "%2x", &i);
+			*out++ = i;
+			in += 2;
+			continue;
+		}
+
+		/* Parse #octal encoding */
+		if (c == '#' && strlen(in) >= 3) {
+			if (in[0] < '0' || in[0] > '7') *undef = TRUE;
+			sscanf(in, "%3o", &i);
+			*out++ = i;
+			in += 3;
+			continue;
+		}
+
+		/* Copy non-encoded chars */
+		*out++ = c;
+	}
+
+	/* Zero-terminate output */
+	*out = '\0';
+}
+
+
+/*
+ * Random numbers (xorshift64*)
+ */
+static unsigned long random_next(void)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return (unsigned long) ((seed * 2685821657736338717ULL) >> 32);
+}
+
+
+/*
+ * Fill a buffer with random chars that the functions care about
+ */
+static void random_string(char *buf, size_t len)
+{
+	static const char special[] = "%#+*~0123456789abcdefABCDEFxX -\t\x7f";
+	static const unsigned char utf8[] = { 0xc3, 0xa4, 0xe2, 0x82, 0xac, 0xf0, 0x9f, 0x98, 0x80 };
+	size_t i;
+
+	/* Mostly long plain runs, sometimes with special chars mixed in */
+	for (i = 0; i < len; i++) {
+		switch (random_next() % 8) {
+			case 0: buf[i] = special[random_next() % (sizeof(special) - 1)]; break;
+			case 1: buf[i] = utf8[random_next() % sizeof(utf8)]; break;
+			case 2: buf[i] = 1 + random_next() % 255; break;
+			default: buf[i] = 'a' + random_next() % 26;
+		}
+	}
+	buf[len] = '\0';
+}
+
+
+/*
+ * Place a string so that its NUL is the last byte before the guard page
+ */
+static char *guarded(const char *str)
+{
+	size_t len = strlen(str) + 1;
+
+	return memcpy(page + pagesize - len, str, len);
+}
+
+
+/*
+ * Report a mismatch
+ */
+static void fail(const char *func, const char *in, size_t size, const char *want, const char *got)
+{
+	size_t i;
+
+	failed++;
+	printf("FAIL %s(size %lu) round %ld of seed %llu\n  in:  ", func,
+		(unsigned long) size, round, start);
+	for (i = 0; in[i]; i++) printf("%02x", (unsigned char) in[i]);
+	printf("\n  old: ");
+	for (i = 0; want[i]; i++) printf("%02x", (unsigned char) want[i]);
+	printf("\n  new: ");
+	for (i = 0; got[i]; i++) printf("%02x", (unsigned char) got[i]);
+	printf("\n");
+}
+
+
+/*
+ * Check that nothing was written past outsize
+ */
+static int overrun(const char *buf, size_t outsize)
+{
+	size_t i;
+
+	for (i = outsize; i < outsize + SLACK; i++)
+		if ((unsigned char) buf[i] != CANARY) return TRUE;
+
+	return FALSE;
+}
+
+
+/*
+ * Random rounds against the old implementations
+ */
+static void test_random(long rounds)
+{
+	char in[TEST_INPUT + 1];
+	char want[TEST_INPUT * 4 + SLACK];
+	char got[TEST_INPUT * 4 + SLACK];
+	char *str;
+	size_t outsize;
+	size_t len;
+	size_t n;
+	size_t w1;
+	size_t w2;
+	int charset;
+	int undef;
+	for (round = 1; round <= rounds; round++) {
+		len = random_next() % (TEST_INPUT + 1);
+		random_string(in, len);
+		outsize = 1 + random_next() % (len * 4 + 8);
+		if (outsize > TEST_INPUT * 4) outsize = TEST_INPUT * 4;
+
+		/* strniconv() */
+		charset = 1 + random_next() % 3;
+		memset(want, CANARY, sizeof(want));
+		memset(got, CANARY, sizeof(got));
+		old_strniconv(charset, want, in, outsize);
+		strniconv(charset, got, guarded(in), outsize);
+		if (strcmp(want, got) != MATCH || overrun(got, outsize))
+			fail("strniconv", in, outsize, want, got);
+
+		/*
+		 * strnencode() - the old one could write past outsize when
+		 * there were escapes, the new one must stop at the last
+		 * char or escape of the full old output that fits
+		 */
+		memset(want, CANARY, sizeof(want));
+		memset(got, CANARY, sizeof(got));
+		old_strnencode(want, in, outsize);
+		strnencode(got, guarded(in), outsize);
+
+		if (strlen(want) < outsize && !overrun(want, outsize)) {
+			if (strcmp(want, got) != MATCH) fail("strnencode", in, outsize, want, got);
+		}
+		else {
+			old_strnencode(want, in, sizeof(want) - SLACK);
+			n = strlen(got);
+
+			if (n >= outsize || overrun(got, outsize) || strncmp(want, got, n) != MATCH ||
+			    (want[n] && n + ((want[n] == '#') ? 5 : 2) <= outsize))
+				fail("strnencode", in, outsize, want, got);
+		}
+
+		/* strndecode(), both into a new buffer and in place */
+		undef = FALSE;
+		memset(want, CANARY, sizeof(want));
+		memset(got, CANARY, sizeof(got));
+		if (outsize > len + 1) outsize = len + 1 + random_next() % 4;
+		old_strndecode(want, in, outsize, &undef);
+
+		if (!undef) {
+			strndecode(got, guarded(in), outsize);
+			if (strcmp(want, got) != MATCH || overrun(got, outsize))
+				fail("strndecode", in, outsize, want, got);
+
+			str = guarded(in);
+			strndecode(str, str, outsize);
+			if (strcmp(want, str) != MATCH)
+				fail("strndecode(in place)", in, outsize, want, str);
+		}
+
+		/* strcut() */
+		undef = FALSE;
+		outsize = random_next() % (len + 2);
+		strcpy(want, in);
+		w1 = old_strcut(want, outsize, &undef);
+
+		if (!undef) {
+			str = guarded(in);
+			w2 = strcut(str, outsize);
+			if (w1 != w2 || strcmp(want, str) != MATCH)
+				fail("strcut", in, outsize, want, str);
+		}
+	}
+}
+
+
+/*
+ * Inputs whose results changed on purpose
+ */
+static void test_changes(void)
+{
+	char buf[BUFSIZE];
+	char *str;
+
+	/* strnencode() stays within outsize however many chars need escaping */
+	memset(buf, CANARY, sizeof(buf));
+	strnencode(buf, "\x01\x02\x03\x04\x05\x06", 10);
+	if (strcmp(buf, "#001#002") != MATCH || overrun(buf, 10))
+		fail("strnencode", "\x01\x02\x03\x04\x05\x06", 10, "#001#002", buf);
+
+	/* A % or # without digits is copied as is */
+	strndecode(buf, "100% #tag %zz #9x", sizeof(buf));
+	if (strcmp(buf, "100% #tag %zz #9x") != MATCH)
+		fail("strndecode", "100% #tag %zz #9x", sizeof(buf), "100% #tag %zz #9x", buf);
+
+	/* Escapes with fewer digits still take up the full width */
+	strndecode(buf, "%41%4g#101#1z9", sizeof(buf));
+	if (strcmp(buf, "A\x04" "A\x01") != MATCH)
+		fail("strndecode", "%41%4g#101#1z9", sizeof(buf), "A\x04" "A\x01", buf);
+
+	/* strcut() stops at the NUL after a cut UTF-8 sequence */
+	str = guarded("abc\xe2\x82");
+	if (strcut(str, 10) != 4 || strcmp(str, "abc\xe2\x82") != MATCH)
+		fail("strcut", "abc\xe2\x82", 10, "abc\xe2\x82", str);
+}
+
+
+/*
+ * Main
+ */
+int main(int argc, char *argv[])
+{
+	long rounds = TEST_ROUNDS;
+
+#ifdef HAVE_AVX2
+	/* Built for a newer CPU than this one */
+	if (!__builtin_cpu_supports("avx2")) {
+		printf("strtest: no AVX2 on this CPU, skipped\n");
+		return 0;
+	}
+#endif
+
+	if (argc > 1) rounds = atol(argv[1]);
+	seed = (argc > 2) ? strtoull(argv[2], NULL, 10) : (unsigned long long) time(NULL);
+	if (!seed) seed = 1;
+	start = seed;
+
+	/* A page for the input with an unmapped one after it */
+	pagesize = sysconf(_SC_PAGESIZE);
+	page = mmap(NULL, pagesize * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED || mprotect(page + pagesize, pagesize, PROT_NONE) == ERROR) {
+		perror("strtest: mmap");
+		return 1;
+	}
+
+	printf("strtest: %s, %ld rounds, seed %llu\n",
+#if defined(HAVE_AVX2)
+		"AVX2",
+#elif defined(HAVE_SSE2)
+		"SSE2",
+#else
+		"scalar",
+#endif
+		rounds, seed);
+
+	test_changes();
+	test_random(rounds);
+
+	if (failed) printf("strtest: %i failures\n", failed);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * Gophernicus
+ *
+ * Copyright (c) 2009-2018 Kim Holviala <kimholviala@fastmail.com>
+ * Copyright (c) 2019 Gophernicus Developers <gophernicus@gophernicus.org>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "gophernicus.h"
+
+
+#ifdef HAVE_PTHREAD
+
+/*
+ * Everything the pool threads share - all read-only
+ */
+typedef struct {
+	const config *cfg;
+	shm_state *shm;
+	int shmid;
+	int *socks;
+	int nsocks;
+} pool;
+
+/* Per-thread startup arguments */
+typedef struct {
+	pool *pool;
+	int n;
+} pool_arg;
+
+
+/*
+ * Pool thread - accept and serve connections until the process dies
+ *
+ * The threads all sleep in accept() on the shared listening socket, so
+ * the kernel accept queue is the work queue: each new connection wakes
+ * up exactly one idle thread and no lock is taken in user space.
+ */
+static void *pool_thread(void *arg)
+{
+	pool *p = ((pool_arg *) arg)->pool;
+	int n = ((pool_arg *) arg)->n;
+	arena mem;
+	conn c;
+	int sock;
+	int fd;
+
+	/* With -Z each thread has a socket of its own */
+	sock = p->socks[n % p->nsocks];
+	if (p->cfg->opt_affinity) pin_cpu(n);
+
+	/* Each thread reuses one arena for all of its requests */
+	arena_init(&mem, ARENA_SIZE);
+
+	for (;;) {
+		if ((fd = accept_client(sock)) == ERROR) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+
+			log_fatal("accept() failed in worker %i", (int) getpid());
+			exit(EXIT_FAILURE);
+		}
+
+		socket_timeouts(fd);
+		conn_init(&c, &mem, fd, fd);
+
+		handle_request(p->cfg, &c, p->shm, p->shmid);
+
+		/* Send the reply & hang up */
+		if (!c.detached) conn_flush(&c);
+		conn_free(&c);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Threaded worker process - serves connections with -W threads
+ */
+void thread_pool(const config *cfg, shm_state *shm, int shmid, int *socks, int nsocks)
+{
+	pool_arg args[MAX_WORKERS];
+	pthread_t thread;
+	pool p;
+	int started = 0;
+	int num;
+	int i;
+
+	p.cfg = cfg;
+	p.shm = shm;
+	p.shmid = shmid;
+	p.socks = socks;
+	p.nsocks = nsocks;
+
+	num = min(max(cfg->daemon_workers, 1), MAX_WORKERS);
+
+	for (i = 0; i < num; i++) {
+		args[i].pool = &p;
+		args[i].n = i;
+
+		if (pthread_create(&thread, NULL, pool_thread, &args[i]) != OK) {
+			log_fatal("unable to start a thread in worker %i", (int) getpid());
+			continue;
+		}
+
+		pthread_detach(thread);
+		started++;
+	}
+
+	if (!started) return;
+	log_debug("worker %i serving with %i threads", (int) getpid(), started);
+
+	/* CGI children are reaped here while the threads serve */
+	for (;;) {
+		sleep(1);
+		reap_children();
+	}
+}
+
+#endif
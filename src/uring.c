@@ -0,0 +1,744 @@
+/*
+ * Gophernicus
+ *
+ * Copyright (c) 2009-2018 Kim Holviala <kimholviala@fastmail.com>
+ * Copyright (c) 2019 Gophernicus Developers <gophernicus@gophernicus.org>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "gophernicus.h"
+
+
+#ifdef HAVE_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/stat.h>
+#include <linux/io_uring.h>
+
+/* Ring size - also the most stat() calls batched into one syscall */
+#define URING_ENTRIES    256
+
+/* Completions that don't belong to a client */
+#define URING_ACCEPT    0
+#define URING_TICK    1
+
+/* What we need to know about files for menus */
+#define STATX_MENU    (STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_SIZE | STATX_MTIME)
+
+
+/*
+ * A submission & completion queue pair mapped from the kernel
+ */
+struct uring {
+	int fd;
+	unsigned entries;
+	unsigned queued;
+	int broken;    /* Completions went missing, don't submit any more */
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_map;
+	size_t sq_size;
+	void *cq_map;
+	size_t cq_size;
+	size_t sqes_size;
+
+	struct statx *stx;
+};
+
+
+/*
+ * Event loop client
+ */
+typedef struct client {
+	struct client *prev;
+	struct client *next;
+	conn c;
+	char stage;
+	char closing;
+	time_t atime;
+	time_t wake;
+} client;
+
+
+/*
+ * Tear down a ring
+ */
+static void uring_close(uring *r)
+{
+	if (r->sqes) munmap(r->sqes, r->sqes_size);
+	if (r->cq_map) munmap(r->cq_map, r->cq_size);
+	if (r->sq_map) munmap(r->sq_map, r->sq_size);
+	if (r->fd != ERROR) close(r->fd);
+	if (r->stx) free(r->stx);
+	free(r);
+}
+
+
+/*
+ * Check that the kernel supports every operation we submit
+ */
+static int uring_probe(uring *r)
+{
+	static const int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+		IORING_OP_READ, IORING_OP_TIMEOUT, IORING_OP_STATX };
+	struct io_uring_probe *p;
+	size_t i;
+	int ret = OK;
+
+	if ((p = calloc(1, sizeof(*p) + 256 * sizeof(struct io_uring_probe_op))) == NULL)
+		return ERROR;
+
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, p, 256) == ERROR) ret = ERROR;
+
+	for (i = 0; ret == OK && i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if (ops[i] > p->last_op || !(p->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			ret = ERROR;
+	}
+
+	free(p);
+	return ret;
+}
+
+
+/*
+ * Set up a new ring - returns NULL if the kernel can't do io_uring
+ */
+static uring *uring_open(unsigned entries)
+{
+	struct io_uring_params p;
+	uring *r;
+
+	if ((r = calloc(1, sizeof(uring))) == NULL) return NULL;
+
+	memset(&p, 0, sizeof(p));
+	if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) == ERROR) {
+		free(r);
+		return NULL;
+	}
+
+	/* Don't leak the ring to CGI scripts */
+	fcntl(r->fd, F_SETFD, FD_CLOEXEC);
+
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if ((r->sq_map = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		r->fd, IORING_OFF_SQ_RING)) == MAP_FAILED) r->sq_map = NULL;
+	if ((r->cq_map = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) r->cq_map = NULL;
+	if ((r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		r->fd, IORING_OFF_SQES)) == MAP_FAILED) r->sqes = NULL;
+
+	r->stx = malloc(p.sq_entries * sizeof(struct statx));
+
+	if (!r->sq_map || !r->cq_map || !r->sqes || !r->stx || uring_probe(r) == ERROR) {
+		uring_close(r);
+		return NULL;
+	}
+
+	r->entries = p.sq_entries;
+	r->sq_head = (unsigned *) ((char *) r->sq_map + p.sq_off.head);
+	r->sq_tail = (unsigned *) ((char *) r->sq_map + p.sq_off.tail);
+	r->sq_mask = (unsigned *) ((char *) r->sq_map + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) ((char *) r->sq_map + p.sq_off.array);
+	r->cq_head = (unsigned *) ((char *) r->cq_map + p.cq_off.head);
+	r->cq_tail = (unsigned *) ((char *) r->cq_map + p.cq_off.tail);
+	r->cq_mask = (unsigned *) ((char *) r->cq_map + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) ((char *) r->cq_map + p.cq_off.cqes);
+
+	return r;
+}
+
+
+/*
+ * Submit queued operations and optionally wait for completions
+ */
+static int uring_enter(uring *r, unsigned wait)
+{
+	long ret;
+
+	for (;;) {
+		if ((ret = syscall(__NR_io_uring_enter, r->fd, r->queued, wait,
+			wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) != ERROR) break;
+
+		if (errno == EINTR) continue;
+		return ERROR;
+	}
+
+	r->queued -= ret;
+	return OK;
+}
+
+
+/*
+ * Get a cleared submission queue entry - NULL if the queue is full
+ */
+static struct io_uring_sqe *uring_sqe(uring *r, unsigned long long data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *r->sq_tail;
+	unsigned index;
+
+	/* Make room by submitting what we have */
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries) {
+		if (uring_enter(r, 0) == ERROR) return NULL;
+		if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries) return NULL;
+	}
+
+	index = tail & *r->sq_mask;
+	sqe = &r->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = data;
+
+	/* Without SQPOLL the kernel only looks at the queue in io_uring_enter() */
+	r->sq_array[index] = index;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->queued++;
+
+	return sqe;
+}
+
+
+/*
+ * Peek at the next completion & mark it seen
+ */
+static int uring_cqe(uring *r, unsigned long long *data, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return FALSE;
+
+	cqe = &r->cqes[head & *r->cq_mask];
+	*data = cqe->user_data;
+	*res = cqe->res;
+
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return TRUE;
+}
+
+
+/*
+ * Wait for the completions of operations in flight and throw them
+ * away - returns ERROR if they can't be waited for
+ */
+static int uring_drain(uring *r, int inflight)
+{
+	unsigned long long data;
+	int res;
+
+	while (inflight > 0) {
+		if (uring_cqe(r, &data, &res)) inflight--;
+		else if (uring_enter(r, 1) == ERROR) return ERROR;
+	}
+
+	return OK;
+}
+
+
+/*
+ * Copy the interesting bits of a stat() into a directory entry
+ */
+static void stat_entry(sdirent *d, struct stat *s)
+{
+	d->mode  = s->st_mode;
+	d->uid   = s->st_uid;
+	d->gid   = s->st_gid;
+	d->size  = s->st_size;
+	d->mtime = s->st_mtime;
+}
+
+
+/*
+ * Stat the entries the ring didn't get to one by one
+ */
+static void stat_rest(int dirfd, sdirent *list, int num)
+{
+	struct stat s;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (list[i].mode == 0 && fstatat(dirfd, list[i].name, &s, 0) == OK)
+			stat_entry(&list[i], &s);
+	}
+}
+
+
+/*
+ * Stat a list of named directory entries with as few syscalls as
+ * possible - entries that can't be stat()ed are dropped
+ */
+int uring_stat_dir(uring *r, int dirfd, sdirent *list, int num)
+{
+	struct io_uring_sqe *sqe;
+	struct statx *x;
+	struct stat s;
+	unsigned long long data;
+	int inflight;
+	int batch;
+	int done;
+	int res;
+	int i;
+	int j;
+
+	for (i = 0; i < num; i += batch) {
+		if ((batch = num - i) > (int) r->entries) batch = r->entries;
+
+		for (j = 0; j < batch; j++) list[i + j].mode = 0;
+
+		for (j = 0; j < batch && !r->broken; j++) {
+			if ((sqe = uring_sqe(r, j)) == NULL) break;
+
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = dirfd;
+			sqe->addr = (unsigned long) list[i + j].name;
+			sqe->len = STATX_MENU;
+			sqe->off = (unsigned long) &r->stx[j];
+		}
+
+		/* Stat one by one if the ring is broken */
+		if (j < batch || uring_enter(r, batch) == ERROR) {
+			inflight = j - r->queued;
+			*r->sq_tail -= r->queued;
+			r->queued = 0;
+
+			/* What got submitted anyway would complete into the next batch */
+			if (uring_drain(r, inflight) == ERROR) r->broken = TRUE;
+
+			stat_rest(dirfd, &list[i], batch);
+			continue;
+		}
+
+		for (done = 0; done < batch;) {
+
+			/* A signal can end the wait early - collect every completion */
+			if (!uring_cqe(r, &data, &res)) {
+				if (uring_enter(r, 1) == ERROR) break;
+				continue;
+			}
+
+			done++;
+			j = (int) data;
+
+			/* Kernels without statx() on this filesystem */
+			if (res == -EINVAL || res == -EOPNOTSUPP) {
+				if (fstatat(dirfd, list[i + j].name, &s, 0) == OK)
+					stat_entry(&list[i + j], &s);
+				continue;
+			}
+			if (res < 0) continue;
+
+			x = &r->stx[j];
+			list[i + j].mode  = x->stx_mode;
+			list[i + j].uid   = x->stx_uid;
+			list[i + j].gid   = x->stx_gid;
+			list[i + j].size  = x->stx_size;
+			list[i + j].mtime = x->stx_mtime.tv_sec;
+		}
+
+		/* Couldn't wait for the rest */
+		if (done < batch) {
+			if (uring_drain(r, batch - done) == ERROR) r->broken = TRUE;
+			stat_rest(dirfd, &list[i], batch);
+		}
+	}
+
+	/* Drop the failures - a real file always has a type */
+	for (i = j = 0; i < num; i++) {
+		if (list[i].mode == 0) continue;
+		if (i != j) list[j] = list[i];
+		j++;
+	}
+
+	return j;
+}
+
+
+/*
+ * Queue reading more of the request
+ */
+static int queue_recv(uring *r, client *cl)
+{
+	struct io_uring_sqe *sqe;
+	conn *c = &cl->c;
+
+	if ((sqe = uring_sqe(r, (unsigned long) cl)) == NULL) return ERROR;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->in;
+	sqe->addr = (unsigned long) (c->req + c->req_len);
+	sqe->len = REQBUFSIZE - c->req_len;
+
+	cl->stage = STAGE_READ;
+	return OK;
+}
+
+
+/*
+ * Queue accepting the next connection
+ */
+static int queue_accept(uring *r, int sock)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(r, URING_ACCEPT)) == NULL) return ERROR;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = sock;
+	sqe->accept_flags = SOCK_CLOEXEC;
+
+	return OK;
+}
+
+
+/*
+ * Queue the once a second housekeeping wakeup
+ */
+static int queue_tick(uring *r, struct __kernel_timespec *ts)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(r, URING_TICK)) == NULL) return ERROR;
+
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (unsigned long) ts;
+	sqe->len = 1;
+
+	return OK;
+}
+
+
+/*
+ * Start tracking a new connection
+ */
+static client *client_open(uring *r, uring *batch, client **list, arena *mem, int fd, time_t now)
+{
+	client *cl;
+
+	if ((cl = arena_get(mem, sizeof(client))) == NULL) return NULL;
+	memset(cl, 0, sizeof(client));
+
+	conn_init(&cl->c, mem, fd, fd);
+	cl->c.defer = TRUE;
+	cl->c.ring = batch;
+	cl->atime = now;
+
+	if ((cl->c.req = arena_get(mem, REQBUFSIZE)) == NULL || cl->c.buf == NULL ||
+	    queue_recv(r, cl) == ERROR) {
+		conn_free(&cl->c);
+		arena_put(mem, cl);
+		return NULL;
+	}
+
+	/* Link to the list of clients */
+	cl->next = *list;
+	if (*list) (*list)->prev = cl;
+	*list = cl;
+
+	return cl;
+}
+
+
+/*
+ * Hang up & forget a connection - it must not have anything in flight
+ */
+static void client_close(client **list, client *cl)
+{
+	close(cl->c.in);
+	conn_free(&cl->c);
+
+	if (cl->prev) cl->prev->next = cl->next;
+	else *list = cl->next;
+	if (cl->next) cl->next->prev = cl->prev;
+
+	arena_put(cl->c.arena, cl);
+}
+
+
+/*
+ * Queue sending more of the reply - returns TRUE when the connection is done
+ */
+static int client_send(uring *r, client *cl)
+{
+	struct io_uring_sqe *sqe;
+	conn *c = &cl->c;
+	off_t len;
+
+	while (!c->error) {
+
+		/* Put the next piece of a file after what's buffered so they leave together */
+		if (c->pos == 0 && c->len < OUTBUFSIZE / 2) {
+			if (c->text) send_text_chunk(c);
+
+			else if (c->file != ERROR) {
+				if (c->file_pos < c->file_size) {
+					if ((sqe = uring_sqe(r, (unsigned long) cl)) == NULL) return TRUE;
+
+					len = c->file_size - c->file_pos;
+					if (len > (off_t) (c->size - c->len)) len = c->size - c->len;
+
+					sqe->opcode = IORING_OP_READ;
+					sqe->fd = c->file;
+					sqe->addr = (unsigned long) (c->buf + c->len);
+					sqe->len = len;
+					sqe->off = c->file_pos;
+
+					cl->stage = STAGE_FILE;
+					return FALSE;
+				}
+
+				close(c->file);
+				c->file = ERROR;
+			}
+		}
+
+		/* Send buffered output */
+		if (c->pos < c->len) {
+			if ((sqe = uring_sqe(r, (unsigned long) cl)) == NULL) return TRUE;
+
+			sqe->opcode = IORING_OP_SEND;
+			sqe->fd = c->out;
+			sqe->addr = (unsigned long) (c->buf + c->pos);
+			sqe->len = c->len - c->pos;
+			sqe->msg_flags = MSG_NOSIGNAL | (conn_pending(c) ? MSG_MORE : 0);
+
+			cl->stage = STAGE_WRITE;
+			return FALSE;
+		}
+		c->pos = c->len = 0;
+
+		if (c->text || c->file != ERROR) continue;
+		break;
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Serve a fully received request
+ */
+static int client_serve(const config *cfg, shm_state *shm, int shmid,
+	uring *r, client *cl, time_t now)
+{
+	handle_request(cfg, &cl->c, shm, shmid);
+
+	/* A CGI child took over the connection */
+	if (cl->c.detached) return TRUE;
+
+	/* Throttled clients get their reply later */
+	if (cl->c.delay > 0) {
+		cl->wake = now + cl->c.delay;
+		cl->stage = STAGE_WAIT;
+		return FALSE;
+	}
+
+	return client_send(r, cl);
+}
+
+
+/*
+ * Handle a finished operation - returns TRUE when the connection is done
+ */
+static int client_complete(const config *cfg, shm_state *shm, int shmid,
+	uring *r, client *cl, int res, time_t now)
+{
+	conn *c = &cl->c;
+
+	/* Dropped while the operation was in flight */
+	if (cl->closing) return TRUE;
+
+	/* More of the request arrived */
+	if (cl->stage == STAGE_READ) {
+
+		/* Client is gone or hung up without asking for anything */
+		if (res < 0 || (res == 0 && c->req_len == 0)) return TRUE;
+
+		if (res > 0) {
+			c->req_len += res;
+			cl->atime = now;
+			if (!conn_request_ready(cfg, c)) return (queue_recv(r, cl) == ERROR);
+		}
+
+		/* Serve what we have if the client stopped sending */
+		return client_serve(cfg, shm, shmid, r, cl, now);
+	}
+
+	/* Client took some of the reply */
+	if (cl->stage == STAGE_WRITE) {
+		if (res <= 0) return TRUE;
+
+		c->pos += res;
+		c->sent += res;
+		cl->atime = now;
+		return client_send(r, cl);
+	}
+
+	/* File data is ready for sending */
+	if (cl->stage == STAGE_FILE) {
+		if (res > 0) {
+			c->file_pos += res;
+			c->len += res;
+		}
+
+		/* File shrunk under us or can't be read */
+		else {
+			close(c->file);
+			c->file = ERROR;
+		}
+
+		return client_send(r, cl);
+	}
+
+	return TRUE;
+}
+
+
+/*
+ * Completion based worker - accepting, receiving, reading files and
+ * sending are all batched through one io_uring. Returns ERROR right
+ * away if the kernel can't do io_uring.
+ */
+int uring_loop(const config *cfg, shm_state *shm, int shmid, int sock)
+{
+	struct __kernel_timespec ts;
+	unsigned long long data;
+	client *clients = NULL;
+	client *cl;
+	client *next;
+	uring *ring;
+	uring *batch;
+	arena mem;
+	time_t now;
+	int accepting = FALSE;
+	int paused = FALSE;
+	int ticking = FALSE;
+	int tick = FALSE;
+	int res;
+
+	if ((ring = uring_open(URING_ENTRIES)) == NULL) return ERROR;
+
+	/* Menus stat() through a ring of their own so they can wait for it */
+	if ((batch = uring_open(URING_ENTRIES)) == NULL) {
+		uring_close(ring);
+		return ERROR;
+	}
+
+	/* Requests are served one at a time so they can share an arena */
+	arena_init(&mem, ARENA_SIZE);
+
+	ts.tv_sec = 1;
+	ts.tv_nsec = 0;
+
+	for (;;) {
+
+		/* Keep an accept & the housekeeping timer queued */
+		if (!accepting && !paused && queue_accept(ring, sock) == OK) accepting = TRUE;
+		if (!ticking && queue_tick(ring, &ts) == OK) ticking = TRUE;
+
+		if (uring_enter(ring, 1) == ERROR) {
+			log_fatal("io_uring_enter() failed in worker %i", (int) getpid());
+			break;
+		}
+
+		now = time(NULL);
+
+		while (uring_cqe(ring, &data, &res)) {
+
+			/* New connection */
+			if (data == URING_ACCEPT) {
+				if (res >= 0 && client_open(ring, batch, &clients, &mem, res, now) == NULL) {
+					log_fatal("out of memory for a new connection");
+					close(res);
+				}
+
+				/* Out of descriptors - try again after housekeeping */
+				if (res == -EMFILE || res == -ENFILE || res == -ENOBUFS || res == -ENOMEM)
+					paused = TRUE;
+
+				accepting = FALSE;
+				continue;
+			}
+
+			if (data == URING_TICK) {
+				ticking = FALSE;
+				tick = TRUE;
+				continue;
+			}
+
+			cl = (client *) (unsigned long) data;
+			if (client_complete(cfg, shm, shmid, ring, cl, res, now))
+				client_close(&clients, cl);
+		}
+
+		/* Housekeeping once a second */
+		if (!tick) continue;
+		tick = FALSE;
+		paused = FALSE;
+
+		for (cl = clients; cl; cl = next) {
+			next = cl->next;
+
+			/* Throttle delay over? */
+			if (cl->stage == STAGE_WAIT) {
+				if (now < cl->wake) continue;
+
+				cl->atime = now;
+				if (client_send(ring, cl)) client_close(&clients, cl);
+				continue;
+			}
+
+			/* Kick stalled clients - they're closed when their operation fails */
+			if (!cl->closing && (now - cl->atime) > CONN_TIMEOUT) {
+				log_debug("dropping stalled connection from worker %i", (int) getpid());
+				shutdown(cl->c.in, SHUT_RDWR);
+				cl->closing = TRUE;
+			}
+		}
+
+		reap_children();
+	}
+
+	/*
+	 * Only reached on fatal errors - the worker exits right after, and
+	 * the kernel may still be using client buffers so leave them be
+	 */
+	uring_close(ring);
+	uring_close(batch);
+	return OK;
+}
+
+#endif